@@ -8,10 +8,12 @@
 #define FRONIUS_PRIVATE_H
 
 #include <sys/time.h>
+#include <time.h>
 #include <termios.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #include "fronius.h"
 
@@ -56,36 +58,171 @@ FRONIUS_BEGIN_DECLS
 				  FRONIUS_MAX_DATALEN + \
 				  FRONIUS_FL_CHECKSUM )
 
+/* a packet is laid out as on the wire, the checksum follows the data */
 struct fronius_pkt {
 	uint8_t start[FRONIUS_FL_START];
 	uint8_t length;
 	uint8_t device;
 	uint8_t number;
 	uint8_t command;
-	uint8_t data[FRONIUS_MAX_DATALEN];
-	uint8_t checksum;
+	uint8_t data[FRONIUS_MAX_DATALEN + FRONIUS_FL_CHECKSUM];
 };
 
+/* checksum byte and length of the frame in wire order */
+#define FRONIUS_PKT_CHECKSUM(pkt)	((pkt)->data[(pkt)->length])
+#define FRONIUS_PKT_LEN(pkt)		(FRONIUS_MIN_PKTLEN + (pkt)->length)
+
+/* size of the per-device receive ring, a power of two */
+#define FRONIUS_RXRING_SIZE	512
+
+struct fronius_parser {
+	uint8_t			ring[FRONIUS_RXRING_SIZE];
+	/* free running write and read positions */
+	size_t			head, tail;
+	/* losses of synchronisation and the bytes dropped meanwhile */
+	uint64_t		resyncs;
+	uint64_t		skipped;
+	int			lost;
+	/* frames dropped due to a checksum mismatch */
+	uint64_t		checksum_errors;
+};
+
+/* states of the request/completion engine */
+typedef enum {
+	FRONIUS_XFER_IDLE = 0,
+	FRONIUS_XFER_SEND,
+	FRONIUS_XFER_RECV,
+	FRONIUS_XFER_DONE,
+} fronius_xfer_state_t;
+
+/* round-trip estimate in microseconds, srtt 0 means no sample yet */
+struct fronius_rtt {
+	uint32_t		srtt;
+	uint32_t		rttvar;
+	/* doublings of the timeout since the last sample */
+	uint32_t		backoff;
+};
+
+/* round-trip estimates of one baudrate, per command and over all */
+struct fronius_rtt_table {
+	struct fronius_rtt	any;
+	struct fronius_rtt	cmd[256];
+};
+
+/* baudrates with their own estimates: unknown, 2400, 4800, 9600, 19200 */
+#define FRONIUS_RTT_BAUDRATES	5
+
+struct fronius_xfer {
+	fronius_xfer_state_t	state;
+	/* pending request frame, the request buffer or a prebuilt frame */
+	const struct fronius_pkt	*req;
+	struct fronius_pkt	request;
+	struct fronius_pkt	response;
+	/* submission, end of transmission and receive deadline
+	   (CLOCK_MONOTONIC) */
+	struct timespec		started;
+	struct timespec		sent;
+	struct timespec		deadline;
+	int			retries;
+	/* completion status and notification */
+	fronius_error_t		error;
+	/* errno of a transport failure, 0 if the device answered or not */
+	int			ioerror;
+	/* the frame could not be sent as the link was down */
+	int			lost;
+	fronius_callback_t	callback;
+	void			*arg;
+};
+
+/*
+ * A transport moves frames between the engine and the device. Send and
+ * recv return -1 with EAGAIN when they would block; recv appends to the
+ * receive ring of the parser and returns 0 at end of file. Send fails with
+ * ENOTCONN while the link is down for a while, the frame is lost then.
+ */
+struct fronius_transport {
+	const char	*name;
+	ssize_t		(*send)(struct fronius_dev *, const uint8_t *, size_t);
+	ssize_t		(*recv)(struct fronius_dev *, struct fronius_parser *);
+	/* wait up to timeout ms (-1 forever) for poll events, returns the
+	   ready events, 0 on timeout */
+	int		(*wait)(struct fronius_dev *, int, int);
+	/* optionally adjust the poll events and the timeout in ms the engine
+	   asks for, e.g. while the link is re-established */
+	int		(*events)(struct fronius_dev *, int);
+	int		(*timeout)(struct fronius_dev *, int);
+	int		(*close)(struct fronius_dev *);
+};
+
+extern const struct fronius_transport fronius_transport_serial;
+extern const struct fronius_transport fronius_transport_stream;
+extern const struct fronius_transport fronius_transport_tcp;
+extern const struct fronius_transport fronius_transport_dgram;
+extern const struct fronius_transport fronius_transport_mem;
+
 struct fronius_dev {
-	/* file handle */
+	/* file handle, -1 for transports without one */
 	int			fd;
+	/* bumped whenever another open file is put behind fd */
+	unsigned int		fdgen;
+	/* transport and its private state */
+	const struct fronius_transport	*transport;
+	void			*transport_priv;
 	/* type of attached Fronius device */
 	fronius_ifc_type_t	ifc_type;
 	/* baudrate of serial connection */
 	fronius_baudrate_t	baudrate;
 	struct termios		*old_tio;
 
+	/* frame being written and progress of a partial write */
+	const struct fronius_pkt	*txpkt;
+	size_t			txlen, txoff;
+	/* incremental parser for received data */
+	struct fronius_parser	parser;
+
+	/* request/completion engine */
+	struct fronius_xfer	xfer;
+	/* multiplexer entry, NULL unless added to one */
+	struct fronius_mux_entry	*mux_entry;
+	/* round-trip estimator for the receive timeout */
+	struct fronius_rtt_table	rtt[FRONIUS_RTT_BAUDRATES];
+
+	/* trace sink and its per-device format buffer */
+	fronius_trace_t		trace;
+	void			*trace_arg;
+	char			tracebuf[FRONIUS_TRACE_BUFSIZE];
+
+	/* frame capture, NULL if disabled */
+	struct fronius_capture	*capture;
+
+	/* value cache, NULL if disabled */
+	struct fronius_cache	*cache;
+
+	/* low-latency serial mode, NULL if disabled */
+	struct fronius_lowlat	*lowlat;
+	/* receive timing, first and latest read of the frame in progress */
+	struct fronius_serial_stats	serial;
+	struct timespec		rx_first, rx_last;
+	int			rx_busy;
+
 	/* various flags */
 	int			debug:1;
 	int			rawdump:1;
+	/* discovery in progress: short timeouts, few retries */
+	unsigned int		probing:1;
 
 	/* statistical values */
 	struct timeval		last_sent, last_received;
-	int			bytes_sent, bytes_received;
-	int			pkts_sent, pkts_received;
-	int			checksum_errors;
+	struct fronius_stats	stats;
+	/* latency histograms per command and inverter, allocated on demand */
+	struct fronius_hist	*cmd_hist[256];
+	struct fronius_hist	*inverter_hist[256];
 };
 
+/* counters may be read concurrently from other threads */
+#define FRONIUS_STAT_ADD(counter, n) \
+	__atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
 /**
  * Fronius packet API
  **/
@@ -119,14 +256,297 @@ int fronius_pkt_headerdump(FILE *, const char *, const struct fronius_pkt *);
 int fronius_pkt_dump(FILE *, const char *, const struct fronius_pkt *, int);
 
 /*
- * Send a packet to Fronius device.
+ * Pass a frame to the trace sink of the device.
+ */
+void fronius_pkt_trace(struct fronius_dev *, int, const uint8_t *, size_t);
+
+/*
+ * Record a frame in the capture file of the device.
+ */
+void fronius_capture_frame(struct fronius_dev *, int, const uint8_t *, size_t);
+
+/*
+ * Account a completed request in the statistics.
+ */
+void fronius_stats_request(struct fronius_dev *);
+
+/*
+ * Free the latency histograms.
+ */
+void fronius_stats_free(struct fronius_dev *);
+
+/*
+ * Add a sample in microseconds to a histogram, take a snapshot of one.
+ */
+void fronius_hist_add(struct fronius_hist *, uint64_t);
+void fronius_hist_read(const struct fronius_hist *, struct fronius_hist *);
+
+/*
+ * Low-latency mode: set the read threshold for the response to the
+ * request in flight, taking already buffered bytes into account.
+ */
+void fronius_serial_expect(struct fronius_dev *);
+
+/*
+ * Account a read() returning data and a received frame of the given
+ * length in the receive timing counters.
+ */
+void fronius_serial_rx(struct fronius_dev *);
+void fronius_serial_frame(struct fronius_dev *, size_t);
+
+/*
+ * Returns the bits per second of a baudrate, 0 if unknown.
+ */
+unsigned int fronius_serial_bps(fronius_baudrate_t);
+
+/* time to connect to a network port, all addresses together, in ms */
+#define FRONIUS_CONNECT_TIMEOUT		3000
+#define FRONIUS_RECONNECT_TIMEOUT	1000
+/* addresses of a host tried at most */
+#define FRONIUS_CONNECT_MAX		8
+
+/*
+ * Connect to a network port without blocking longer than the timeout in
+ * ms. The addresses of the host are raced, the first connection wins.
+ * Returns a non-blocking socket or -1.
+ */
+int fronius_connect(const char *, const char *, int, int);
+
+/*
+ * Set the options of a connected TCP socket of the given address family.
+ */
+void fronius_connect_tune(int, int);
+
+/*
+ * Remember the addresses of host and port of a connected TCP device for
+ * reconnects.
+ */
+int fronius_tcp_init(struct fronius_dev *, const char *, const char *);
+
+/*
+ * Set up a TCP device whose connect is only started. Requests wait for
+ * it like for a reconnect.
+ */
+int fronius_tcp_open(struct fronius_dev *, const char *, const char *);
+
+/*
+ * Returns the error of the latest connect of a TCP device whose link is
+ * down, EINPROGRESS before the first one finished, else 0.
+ */
+int fronius_tcp_error(struct fronius_dev *);
+
+/* flags of fronius_open_flags() */
+#define FRONIUS_OPEN_NONBLOCK	0x01	/* do not wait for a TCP connect */
+
+/*
+ * fronius_open() with flags.
+ */
+struct fronius_dev *fronius_open_flags(const char *, fronius_ifc_type_t,
+                                       fronius_baudrate_t, int);
+
+/*
+ * Switch a serial port to another baudrate. Data received at the previous
+ * one is discarded. Returns -1 with errno ENOTTY for other transports.
+ */
+int fronius_serial_baudrate(struct fronius_dev *, fronius_baudrate_t);
+
+/*
+ * Feed the round-trip time of a request sent at the given time into the
+ * estimator. Only requests answered without retransmission may be sampled.
+ */
+void fronius_rto_sample(struct fronius_dev *, uint8_t, const struct timespec *);
+
+/*
+ * Double the receive timeout of a command after it timed out. The backoff
+ * holds for later requests as well, up to a bound, until the next sample.
+ */
+void fronius_rto_backoff(struct fronius_dev *, uint8_t);
+
+/*
+ * Returns the receive timeout in microseconds for a command after the given
+ * number of retransmissions, backed off further for recent timeouts. While
+ * probing, a command without any estimate waits only as long as the
+ * exchange takes on the line.
+ */
+long fronius_rto(struct fronius_dev *, uint8_t, int);
+
+/*
+ * Look up a cached response. Returns its data and sets the length on a hit,
+ * NULL otherwise. The cache must be enabled.
+ */
+const uint8_t *fronius_cache_lookup(struct fronius_dev *, uint8_t, uint8_t,
+                                    uint8_t, uint8_t *);
+
+/*
+ * Remember a response if its command is cacheable.
+ */
+void fronius_cache_store(struct fronius_dev *, const struct fronius_pkt *);
+
+/* number of cache entries, a power of two */
+#define FRONIUS_CACHE_SLOTS	256
+/* longest response kept, values need 3 bytes, the version 4 */
+#define FRONIUS_CACHE_DATALEN	8
+
+/* a cached response detached from its slot, e.g. to be saved in a file */
+struct fronius_cache_value {
+	/* wall clock time of expiry in milliseconds */
+	int64_t		expires;
+	uint8_t		device;
+	uint8_t		number;
+	uint8_t		command;
+	uint8_t		length;
+	uint8_t		data[FRONIUS_CACHE_DATALEN];
+};
+
+/*
+ * Copy up to the given number of fresh entries, returns the number copied.
+ */
+size_t fronius_cache_export(struct fronius_dev *, struct fronius_cache_value *,
+                            size_t);
+
+/*
+ * Store saved responses with the time to live they had left, capped by the
+ * current one of their class. Expired responses are dropped.
+ */
+void fronius_cache_import(struct fronius_dev *,
+                          const struct fronius_cache_value *, size_t);
+
+/*
+ * Send a packet to Fronius device without blocking. Passing a packet starts
+ * a new frame, passing NULL continues a partially written one. The packet
+ * is written as is, so its checksum must be set and it must stay unchanged
+ * until the frame is written. Returns 0 when the frame is completely
+ * written and -1 with errno EAGAIN if the device is not writable yet.
+ */
+int fronius_pkt_send(struct fronius_dev *, const struct fronius_pkt *);
+
+/*
+ * Receive a packet from Fronius device without blocking. Returns 0 when a
+ * valid frame was received and -1 with errno EAGAIN if no complete frame is
+ * available yet. Invalid data is skipped until the next start sequence.
+ */
+int fronius_pkt_recv(struct fronius_dev *, struct fronius_pkt *);
+
+/**
+ * Streaming frame parser
+ **/
+
+/*
+ * Initialize a parser.
+ */
+void fronius_parser_init(struct fronius_parser *);
+
+/*
+ * Discard all buffered data.
+ */
+void fronius_parser_flush(struct fronius_parser *);
+
+/*
+ * Returns the number of buffered, not yet consumed bytes.
+ */
+size_t fronius_parser_pending(const struct fronius_parser *);
+
+/*
+ * Returns the number of bytes still missing for the frame at the read
+ * position, assuming the given data length while its header is
+ * incomplete. At least 1 is returned.
+ */
+size_t fronius_parser_missing(const struct fronius_parser *, size_t);
+
+/*
+ * Append data to the parser, returns the number of bytes taken.
+ */
+size_t fronius_parser_feed(struct fronius_parser *, const uint8_t *, size_t);
+
+/*
+ * Read available data from a file descriptor into the parser.
+ */
+ssize_t fronius_parser_fill(struct fronius_parser *, int);
+
+/*
+ * Extract the next valid frame. Returns 1 if a packet was extracted and
+ * 0 if more data is needed.
+ */
+int fronius_parser_next(struct fronius_parser *, struct fronius_pkt *);
+
+/*
+ * Called for every valid frame found by fronius_frames_scan(), with a
+ * pointer to the frame in its wire format. Returning non-zero stops the scan.
+ */
+typedef int (*fronius_frame_cb_t)(const uint8_t *, size_t, void *);
+
+/*
+ * Scan a linear buffer for valid frames without copying them. Returns the
+ * number of consumed bytes; an incomplete frame at the end is left over.
+ * Skipped bytes are added to the optional counter.
+ */
+size_t fronius_frames_scan(const uint8_t *, size_t, fronius_frame_cb_t, void *,
+                           unsigned long *);
+
+/*
+ * Decode the value of a response to a value query.
+ */
+fronius_error_t fronius_get_value(const struct fronius_pkt *, double *);
+
+/*
+ * Decode the 3 data bytes (mantissa, exponent) of a value response.
+ */
+fronius_error_t fronius_decode_value(const uint8_t *, double *);
+
+/*
+ * Check a response length against the registry, commands which are not
+ * registered are expected to return a value.
+ */
+int fronius_cmd_length_ok(uint8_t, uint8_t);
+
+/**
+ * Request/completion engine
+ **/
+
+/*
+ * Start a transaction for a prepared request packet.
+ */
+int fronius_xfer_start(struct fronius_dev *, const struct fronius_pkt *,
+                       fronius_callback_t, void *);
+
+/*
+ * Start a transaction for a prebuilt request frame, checksum included. The
+ * frame is sent as is and must stay unchanged until the transaction
+ * completed.
+ */
+int fronius_xfer_start_frame(struct fronius_dev *, const struct fronius_pkt *,
+                             fronius_callback_t, void *);
+
+/*
+ * Block until the pending transaction completed.
+ */
+int fronius_xfer_wait(struct fronius_dev *);
+
+/*
+ * Note a request started on a device of a multiplexer, so that the next
+ * run registers it.
+ */
+void fronius_mux_touch(struct fronius_mux_entry *);
+
+/**
+ * Sampler internals for the metrics exporter
+ **/
+
+struct fronius_dev *fronius_sampler_dev(struct fronius_sampler *);
+
+/*
+ * Returns the number of columns; the request frame of a column tells its
+ * device, number and command.
  */
-int fronius_pkt_send(struct fronius_dev *, struct fronius_pkt *);
+size_t fronius_sampler_ncolumns(struct fronius_sampler *);
+const struct fronius_pkt *fronius_sampler_frame(struct fronius_sampler *,
+                                                size_t);
 
 /*
- * Receive a packet from Fronius device.
+ * Fetch the latest sample of a column. Returns 0 if it has none yet.
  */
-int fronius_pkt_recv(struct fronius_dev *, const struct fronius_pkt *);
+int fronius_sampler_last(struct fronius_sampler *, size_t, int64_t *,
+                         double *, fronius_error_t *);
 
 
 #define FRONIUS_CMD_IFCARD_GETVERSION		0x01
@@ -8,6 +8,9 @@
 #define FRONIUS_H
 
 #include <termios.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 #include <fronius-version.h>
 
 #ifdef  __cplusplus
@@ -63,12 +66,35 @@ typedef enum {
 struct fronius_dev;
 
 /*
- * Open the serial device.
+ * Open the serial device. Other transports are selected by a prefix:
+ * raw://host:port or tcp://host:port, udp://host:port and unix:///path.
  */
 struct fronius_dev *fronius_open(const char *,
                                  const fronius_ifc_type_t,
                                  const fronius_baudrate_t);
 
+/*
+ * Use an already connected file descriptor, e.g. one end of a socketpair.
+ * The descriptor is owned by the device and closed by fronius_close().
+ */
+struct fronius_dev *fronius_open_fd(int, const fronius_ifc_type_t);
+
+/*
+ * Called by the in-memory transport with every request frame. The
+ * response frame is written to the buffer of the given size, which is
+ * part of the receive buffer of the device. Returns the response length,
+ * 0 leaves the request unanswered.
+ */
+typedef size_t (*fronius_responder_t)(const uint8_t *, size_t,
+                                      uint8_t *, size_t, void *);
+
+/*
+ * Open a device answered in-process by a responder, e.g. for load tests
+ * of the protocol stack. Such a device has no file descriptor.
+ */
+struct fronius_dev *fronius_open_mem(fronius_responder_t, void *,
+                                     const fronius_ifc_type_t);
+
 /*
  * Close the serial device, free all resources.
  */
@@ -81,10 +107,829 @@ int fronius_fd(struct fronius_dev *);
 
 /*
  * Probe port for fronius device and return interface card type and baudrate.
+ * Returns -1 with errno ENODEV if no Interface Card answered, see
+ * fronius_probe_many() for the details.
  */
 int fronius_probe(const char *, fronius_ifc_type_t *, fronius_baudrate_t *);
 
 
+/**
+ * Non-blocking request/completion API
+ *
+ * A request is submitted with fronius_submit() and the device is then driven
+ * by calling fronius_process() whenever the file descriptor returned by
+ * fronius_fd() signals the events of fronius_events() or the timeout
+ * returned by fronius_timeout() expires. Only one request can be in flight
+ * per device, but a single thread can drive any number of devices.
+ **/
+
+struct fronius_result {
+	/* completion status of the request */
+	fronius_error_t	error;
+	/* addressing of the answered request */
+	uint8_t		device;
+	uint8_t		number;
+	uint8_t		command;
+	/* response payload, valid until the next request is submitted */
+	uint8_t		length;
+	const uint8_t	*data;
+};
+
+typedef void (*fronius_callback_t)(struct fronius_dev *,
+                                   const struct fronius_result *, void *);
+
+/*
+ * Submit a request. The optional callback is invoked from fronius_process()
+ * on completion; without a callback the result has to be fetched with
+ * fronius_result(). Returns -1 with errno EBUSY if a request is in flight.
+ */
+int fronius_submit(struct fronius_dev *, uint8_t, uint8_t, uint8_t,
+                   fronius_callback_t, void *);
+
+/*
+ * Returns the poll events (POLLIN/POLLOUT) the device is waiting for,
+ * or 0 if no request is in flight.
+ */
+int fronius_events(struct fronius_dev *);
+
+/*
+ * Returns the milliseconds until the pending request times out, or -1 if
+ * the device does not wait for a deadline.
+ */
+int fronius_timeout(struct fronius_dev *);
+
+/*
+ * Drive the device with the returned poll events (0 on timer expiry).
+ * Returns 1 if a request completed, 0 if it is still pending and -1 on
+ * i/o errors.
+ */
+int fronius_process(struct fronius_dev *, int);
+
+/*
+ * Fetch the result of a request submitted without callback. Returns -1 with
+ * errno EAGAIN if the request has not completed yet.
+ */
+int fronius_result(struct fronius_dev *, struct fronius_result *);
+
+/**
+ * Shared device
+ *
+ * A device can be shared by several threads by handing it over to an owner
+ * i/o thread. Any thread can then queue requests without locking; they are
+ * put on the bus one after the other in the order they were queued.
+ **/
+
+struct fronius_shared;
+struct fronius_future;
+
+/*
+ * Start an owner thread for the device. The device must not be used
+ * directly until the shared handle is freed again.
+ */
+struct fronius_shared *fronius_shared_new(struct fronius_dev *);
+
+/*
+ * Complete all queued requests and stop the owner thread. The device itself
+ * is not closed.
+ */
+int fronius_shared_free(struct fronius_shared *);
+
+/*
+ * Queue a request whose callback is invoked from the owner thread. The
+ * callback must not block and must not use the device directly.
+ */
+int fronius_shared_submit(struct fronius_shared *, uint8_t, uint8_t, uint8_t,
+                          fronius_callback_t, void *);
+
+/*
+ * Queue a request and return a future for its result.
+ */
+struct fronius_future *fronius_shared_query(struct fronius_shared *, uint8_t,
+                                            uint8_t, uint8_t);
+
+/*
+ * Wait for the completion of a future. The result data stays valid until
+ * the future is freed.
+ */
+int fronius_future_wait(struct fronius_future *, struct fronius_result *);
+
+/*
+ * Free a completed future.
+ */
+void fronius_future_free(struct fronius_future *);
+
+/**
+ * Multiplexer
+ *
+ * A multiplexer drives the requests of many devices from a single thread,
+ * waiting on all of them with one epoll instance and keeping their receive
+ * deadlines in a timer wheel. Requests and poll plans are started on the
+ * devices as usual and then progress in fronius_mux_run().
+ **/
+
+struct fronius_mux;
+
+/*
+ * Create and free a multiplexer. Freeing does not close the devices.
+ */
+struct fronius_mux *fronius_mux_new(void);
+void fronius_mux_free(struct fronius_mux *);
+
+/*
+ * Add a device to or remove it from the multiplexer. A device must be
+ * removed before it is closed. In-memory devices are rejected (EBADF).
+ */
+int fronius_mux_add(struct fronius_mux *, struct fronius_dev *);
+int fronius_mux_del(struct fronius_mux *, struct fronius_dev *);
+
+/*
+ * Returns the epoll file descriptor, e.g. to embed the multiplexer into
+ * another event loop.
+ */
+int fronius_mux_fd(struct fronius_mux *);
+
+/*
+ * Wait up to the given milliseconds (-1 without limit) for events or
+ * deadlines and process them. Only devices which are ready, expired or
+ * have started a request are visited. Returns the number of devices with
+ * a request in flight afterwards, or -1 on errors of the multiplexer
+ * itself. A device may be removed from a completion callback.
+ */
+int fronius_mux_run(struct fronius_mux *, int);
+
+/*
+ * Returns the errno of the latest failure of a device in
+ * fronius_mux_run() and clears it, 0 if there was none.
+ */
+int fronius_mux_error(struct fronius_mux *, struct fronius_dev *);
+
+/**
+ * Frame tracing
+ *
+ * A trace sink is called with the raw bytes of every frame sent to or
+ * received from the device.
+ **/
+
+/* direction of a traced frame */
+#define FRONIUS_TRACE_TX	0
+#define FRONIUS_TRACE_RX	1
+
+/* buffer size sufficient to format any frame with a short prefix */
+#define FRONIUS_TRACE_BUFSIZE	1024
+
+typedef void (*fronius_trace_t)(struct fronius_dev *, int,
+                                const struct timespec *,
+                                const uint8_t *, size_t, void *);
+
+/*
+ * Install a trace sink (NULL removes it). The timestamp passed to the sink
+ * is taken from CLOCK_REALTIME.
+ */
+int fronius_set_trace(struct fronius_dev *, fronius_trace_t, void *);
+
+/*
+ * Format a frame as "prefix: 0x80 0x80 ...\n" into a caller-provided buffer
+ * without any allocation. Returns the length of the string or -1 with errno
+ * ENOSPC if the buffer is too small.
+ */
+int fronius_trace_format(char *, size_t, const char *, const uint8_t *, size_t);
+
+/*
+ * Built-in trace sink, writes each formatted frame with a single write() to
+ * the file descriptor passed as argument, i.e. (void *) (intptr_t) fd.
+ */
+void fronius_trace_fd(struct fronius_dev *, int, const struct timespec *,
+                      const uint8_t *, size_t, void *);
+
+/**
+ * Frame capture
+ *
+ * Every sent and received frame is recorded with its direction and a
+ * timestamp into a fixed-size, memory-mapped ring file. Recording does not
+ * use stdio and needs no system call per frame; the oldest records are
+ * overwritten once the file is full.
+ **/
+
+/*
+ * Start capturing into the given file of the given size in bytes. An
+ * existing capture file of the same size is continued.
+ */
+int fronius_capture_open(struct fronius_dev *, const char *, size_t);
+
+/*
+ * Flush the capture file to disk.
+ */
+int fronius_capture_sync(struct fronius_dev *);
+
+/*
+ * Stop capturing.
+ */
+int fronius_capture_close(struct fronius_dev *);
+
+/*
+ * Called for every record of a capture file, oldest first, with the
+ * direction (FRONIUS_TRACE_TX/_RX), the wall clock time in nanoseconds
+ * since the epoch and the raw frame. Returning non-zero stops reading.
+ */
+typedef int (*fronius_capture_cb_t)(int, uint64_t, const uint8_t *, size_t,
+                                    void *);
+
+/*
+ * Read all records of a capture file. A damaged record ends the walk with
+ * -1 and errno EBADMSG, the records before it have been passed on.
+ */
+int fronius_capture_read(const char *, fronius_capture_cb_t, void *);
+
+/**
+ * Value cache
+ *
+ * Responses of slowly changing values can be answered from a per-device
+ * cache instead of the bus. Every command belongs to a volatility class with
+ * its own time to live; momentary values are not cached by default. The
+ * cache is consulted by the blocking command functions only.
+ **/
+
+typedef enum {
+	/* momentary values, e.g. FRONIUS_CMD_POWER_NOW (default: not cached) */
+	FRONIUS_CACHE_NOW = 0,
+	/* day, year and total yields and min/max values (10 s, 60 s, 60 s) */
+	FRONIUS_CACHE_DAY,
+	FRONIUS_CACHE_YEAR,
+	FRONIUS_CACHE_TOTAL,
+	/* version and device type (1 h) */
+	FRONIUS_CACHE_INFO,
+	FRONIUS_CACHE_CLASSES,
+} fronius_cache_class_t;
+
+/* wildcard for fronius_cache_invalidate() */
+#define FRONIUS_CACHE_ANY	(-1)
+
+struct fronius_cache_stats {
+	/* lookups of cacheable commands answered from / missing the cache */
+	unsigned long	hits;
+	unsigned long	misses;
+	/* live entries displaced by others */
+	unsigned long	evictions;
+	/* currently valid entries */
+	unsigned int	entries;
+};
+
+/*
+ * Enable (with the default TTLs) or disable and flush the value cache.
+ */
+int fronius_cache_enable(struct fronius_dev *, int);
+
+/*
+ * Set the time to live of a class in milliseconds, 0 disables caching.
+ */
+int fronius_cache_set_ttl(struct fronius_dev *, fronius_cache_class_t,
+                          unsigned int);
+
+/*
+ * Drop the entries of the given device, number and command, each of them
+ * may be FRONIUS_CACHE_ANY.
+ */
+int fronius_cache_invalidate(struct fronius_dev *, int, int, int);
+
+/*
+ * Returns the cache counters.
+ */
+int fronius_cache_stats(struct fronius_dev *, struct fronius_cache_stats *);
+
+/**
+ * Statistics
+ *
+ * All counters are 64 bit wide and updated atomically, so a snapshot can be
+ * taken from a monitoring thread while another one drives the device.
+ **/
+
+/* log-linear latency buckets, 4 per power of two microseconds */
+#define FRONIUS_HIST_BUCKETS	88
+
+struct fronius_hist {
+	uint64_t	count;
+	/* sum of all latencies in microseconds */
+	uint64_t	sum;
+	uint64_t	buckets[FRONIUS_HIST_BUCKETS];
+};
+
+/* errors are counted per fronius_error_t code */
+#define FRONIUS_STATS_ERRORS	(FRONIUS_ERR_VALUE_UNDERFLOW + 1)
+
+struct fronius_stats {
+	uint64_t		bytes_sent, bytes_received;
+	uint64_t		pkts_sent, pkts_received;
+	/* completed requests, expired receive timeouts and retransmissions */
+	uint64_t		requests;
+	uint64_t		timeouts;
+	uint64_t		retries;
+	/* losses of frame synchronisation and the bytes dropped meanwhile */
+	uint64_t		resyncs;
+	uint64_t		bytes_skipped;
+	uint64_t		checksum_errors;
+	/* broken network connections re-established */
+	uint64_t		reconnects;
+	/* completed requests per error code */
+	uint64_t		errors[FRONIUS_STATS_ERRORS];
+	/* request latency from submission to completion */
+	struct fronius_hist	latency;
+};
+
+/*
+ * Take a snapshot of the device counters.
+ */
+int fronius_stats(struct fronius_dev *, struct fronius_stats *);
+
+/*
+ * Take a snapshot of the latency histogram of a command or of an inverter.
+ * Returns -1 with errno ENOENT if there were no such requests yet.
+ */
+int fronius_stats_command(struct fronius_dev *, uint8_t, struct fronius_hist *);
+int fronius_stats_inverter(struct fronius_dev *, uint8_t, struct fronius_hist *);
+
+/*
+ * Returns the lower bound of a histogram bucket in microseconds.
+ */
+uint64_t fronius_hist_bucket(unsigned int);
+
+/**
+ * Fixed-point values
+ *
+ * Values are transferred as an unsigned 16 bit mantissa and a decimal
+ * exponent. They can be taken as they are or scaled to an integer of a
+ * chosen base unit, e.g. mWh with scale -3, so that counters can be summed
+ * up exactly without any floating point arithmetic.
+ **/
+
+struct fronius_fixed {
+	uint16_t	mantissa;
+	int8_t		exponent;
+};
+
+/*
+ * Decode the 3 data bytes of a value response. Returns
+ * FRONIUS_ERR_VALUE_OVERFLOW/UNDERFLOW for the flagged values and
+ * FRONIUS_ERR_INVALID_RESPONSE for an exponent out of range.
+ */
+fronius_error_t fronius_fixed_decode(const uint8_t *, struct fronius_fixed *);
+
+/*
+ * Scale a value to multiples of 10^scale, rounded to nearest. Returns
+ * FRONIUS_ERR_VALUE_OVERFLOW if the result does not fit.
+ */
+fronius_error_t fronius_fixed_scale(const struct fronius_fixed *, int,
+                                    int64_t *);
+
+/*
+ * Decode and scale the 3 data bytes of a value response.
+ */
+fronius_error_t fronius_value_scaled(const uint8_t *, int, int64_t *);
+
+/*
+ * Decode and scale n values placed stride bytes apart, e.g. the payloads
+ * of consecutive frames. Failed values are stored as 0 and their status
+ * goes to the optional error array. Returns the number of valid values.
+ */
+size_t fronius_values_scaled(const uint8_t *, size_t, size_t, int, int64_t *,
+                             fronius_error_t *);
+
+/**
+ * Low-latency serial mode
+ *
+ * The read threshold of the serial port (VMIN) follows the length of the
+ * expected frame, so the port only becomes readable once the frame or
+ * the rest of it is there. Where the driver supports it, immediate
+ * delivery of received bytes is requested, too.
+ **/
+
+/* driver tuning applied by fronius_set_lowlatency() */
+#define FRONIUS_LOWLAT_DRIVER	0x01	/* ASYNC_LOW_LATENCY */
+#define FRONIUS_LOWLAT_FIFO	0x02	/* receive FIFO trigger at 1 byte */
+
+struct fronius_serial_stats {
+	/* received frames and the read() calls returning data */
+	uint64_t		frames;
+	uint64_t		reads;
+	/* summed time from the first to the last read of each frame and the
+	   time the frames take on the line at the baudrate, both in us */
+	uint64_t		span_us;
+	uint64_t		wire_us;
+	/* request sent to first read, gaps between the reads of a frame */
+	struct fronius_hist	first_byte;
+	struct fronius_hist	gap;
+};
+
+/*
+ * Enable or disable low-latency mode. Returns the FRONIUS_LOWLAT_* flags
+ * of the driver tuning applied, or -1 with errno ENOTTY if the device is
+ * not a serial port. Disabling restores the previous driver settings.
+ */
+int fronius_set_lowlatency(struct fronius_dev *, int);
+
+/*
+ * Take a snapshot of the receive timing counters. They are kept in both
+ * modes, so the effect of low-latency mode can be compared.
+ */
+int fronius_serial_stats(struct fronius_dev *, struct fronius_serial_stats *);
+
+/**
+ * Bus discovery
+ *
+ * Probing asks the Interface Card for its version, trying the likely
+ * baudrates first with timeouts derived from the time the frames take on
+ * the line. Once the card answers, its active inverters and sensor cards
+ * are queried with the adaptive timeouts of the request engine. Any number
+ * of ports is probed in parallel from a single thread.
+ **/
+
+/* most inverters and sensor cards an Interface Card reports */
+#define FRONIUS_MAX_INVERTERS	100
+#define FRONIUS_MAX_SENSORS	10
+
+struct fronius_probe_result {
+	/* 0 if an Interface Card was found, otherwise an errno value */
+	int			error;
+	/* FRONIUS_IFC_TYPE_PROBE if the card answered the version query
+	   with an error */
+	fronius_ifc_type_t	ifc_type;
+	/* FRONIUS_BAUDRATE_AUTO if the port is no serial line */
+	fronius_baudrate_t	baudrate;
+	char			version[16];
+	/* numbers of the active inverters and sensor cards */
+	size_t			ninverters;
+	uint8_t			inverters[FRONIUS_MAX_INVERTERS];
+	size_t			nsensors;
+	uint8_t			sensors[FRONIUS_MAX_SENSORS];
+	/* time taken to probe the port */
+	unsigned int		elapsed_ms;
+};
+
+/*
+ * Probe the given ports in parallel, serial ports as well as the network
+ * names accepted by fronius_open(). Ports still busy after timeout ms
+ * (-1 for no limit) fail with ETIMEDOUT. Returns the number of ports an
+ * Interface Card was found on.
+ */
+int fronius_probe_many(const char *const *, size_t,
+                       struct fronius_probe_result *, int);
+
+/**
+ * Topology cache
+ *
+ * The topology of a bus, i.e. the Interface Card and the active inverters
+ * and sensor cards with their device types, can be saved to a file along
+ * with the last known values of the value cache. After a restart it is
+ * loaded without any bus traffic, and a revalidation asks only for the
+ * version and the lists of active devices; the device types are queried
+ * again only if these changed.
+ **/
+
+struct fronius_topology {
+	fronius_ifc_type_t	ifc_type;
+	/* FRONIUS_BAUDRATE_AUTO if the device is no serial line */
+	fronius_baudrate_t	baudrate;
+	uint8_t			version[3];
+	/* numbers and device type ids of the active inverters and sensor
+	   cards, the type id is 0 if an inverter did not answer */
+	size_t			ninverters;
+	uint8_t			inverters[FRONIUS_MAX_INVERTERS];
+	uint8_t			inverter_types[FRONIUS_MAX_INVERTERS];
+	size_t			nsensors;
+	uint8_t			sensors[FRONIUS_MAX_SENSORS];
+	uint8_t			sensor_types[FRONIUS_MAX_SENSORS];
+	/* wall clock time of the last enumeration */
+	time_t			discovered;
+};
+
+/*
+ * Called when a revalidation finished. Changed is 1 if the topology was
+ * enumerated again, 0 if it was still valid; the error is not
+ * FRONIUS_ERR_NOERROR if the Interface Card could not be queried.
+ */
+typedef void (*fronius_topology_cb_t)(struct fronius_dev *,
+                                      struct fronius_topology *, int,
+                                      fronius_error_t, void *);
+
+/*
+ * Enumerate the topology of the bus, blocking.
+ */
+fronius_error_t fronius_topology_discover(struct fronius_dev *,
+                                          struct fronius_topology *);
+
+/*
+ * Save a topology to a file, replacing it atomically. If a device with an
+ * enabled value cache is given, its fresh entries are saved, too.
+ */
+int fronius_topology_save(const char *, const struct fronius_topology *,
+                          struct fronius_dev *);
+
+/*
+ * Load a topology from a file. If a device with an enabled value cache is
+ * given, the saved values are put into the cache with a fresh time to
+ * live. Returns -1 with errno EINVAL for a damaged or foreign file.
+ */
+int fronius_topology_load(const char *, struct fronius_topology *,
+                          struct fronius_dev *);
+
+/*
+ * Revalidate a topology in the background: the requests are driven by
+ * fronius_process() like any other and the callback is invoked on
+ * completion. No other request may be submitted to the device meanwhile.
+ */
+int fronius_topology_revalidate_start(struct fronius_dev *,
+                                      struct fronius_topology *,
+                                      fronius_topology_cb_t, void *);
+
+/*
+ * Revalidate a topology, blocking. The flag is set to 1 if the topology
+ * was enumerated again, to 0 if it was still valid.
+ */
+fronius_error_t fronius_topology_revalidate(struct fronius_dev *,
+                                            struct fronius_topology *, int *);
+
+/**
+ * Sampler
+ *
+ * A sampler reads commands of all listed devices periodically, each
+ * command at its own rate, e.g. FRONIUS_CMD_POWER_NOW every second and
+ * FRONIUS_CMD_ENERGY_YEAR every hour. The samples of every (number,
+ * command) pair go to a column of an in-memory ring. Timestamps, values
+ * and status codes are kept in separate arrays, so that a time window is
+ * handed out as pointers into the ring instead of a copy.
+ **/
+
+struct fronius_sampler;
+
+struct fronius_sample_rate {
+	uint8_t		command;
+	/* sampling period in ms */
+	unsigned int	period;
+	/* samples kept per column, rounded up to a power of two */
+	unsigned int	depth;
+};
+
+/*
+ * The samples of one column within a time window. As the ring wraps, they
+ * come in up to two runs; the second one is empty most of the time.
+ */
+struct fronius_window {
+	size_t				count[2];
+	/* request time in ms since the epoch, never decreasing */
+	const int64_t			*time[2];
+	const double			*value[2];
+	const struct fronius_fixed	*fixed[2];
+	/* fronius_error_t of the sample, its values are 0 unless NOERROR */
+	const uint8_t			*error[2];
+	/* samples taken by the column before the first one of the window */
+	uint64_t			seq;
+};
+
+struct fronius_sampler_stats {
+	uint64_t		samples;
+	uint64_t		errors;
+	/* periods skipped because the bus was busy with other columns */
+	uint64_t		missed;
+	/* delay of the requests behind their schedule */
+	struct fronius_hist	lateness;
+};
+
+/*
+ * Create a sampler for the given device class (e.g. FRONIUS_DEVICE_INVERTER).
+ * The number list is in the format returned by
+ * fronius_cmd_ic_getactiveinverters(). Each command may appear only once
+ * in the rate list.
+ */
+struct fronius_sampler *fronius_sampler_new(struct fronius_dev *, uint8_t,
+                                            const char *, size_t,
+                                            const struct fronius_sample_rate *,
+                                            size_t);
+
+/*
+ * Free a sampler; it must not be running.
+ */
+void fronius_sampler_free(struct fronius_sampler *);
+
+/*
+ * Start sampling; the columns of a rate are spread evenly over its period.
+ * The sampler is then driven with fronius_sampler_process() or
+ * fronius_sampler_run(); the device must not be used otherwise meanwhile.
+ */
+int fronius_sampler_start(struct fronius_sampler *);
+
+/*
+ * Stop sampling after the request currently in flight.
+ */
+void fronius_sampler_stop(struct fronius_sampler *);
+
+/*
+ * Returns the milliseconds until the sampler has to be processed again,
+ * or -1 if it is stopped. The poll events are those of fronius_events().
+ */
+int fronius_sampler_timeout(struct fronius_sampler *);
+
+/*
+ * Handle the poll events of the device and put due requests on the wire.
+ */
+int fronius_sampler_process(struct fronius_sampler *, int);
+
+/*
+ * Drive the sampler for the given number of milliseconds, blocking.
+ */
+int fronius_sampler_run(struct fronius_sampler *, int);
+
+/*
+ * Look up the samples of a column taken from (inclusive) to (exclusive)
+ * the given times in ms since the epoch. The window points into the ring:
+ * it is valid until the sampler is processed again, and its oldest
+ * samples are the first to be overwritten. Returns the number of samples,
+ * or -1 with errno ENOENT if the pair is not sampled.
+ */
+int fronius_sampler_window(struct fronius_sampler *, uint8_t, uint8_t,
+                           int64_t, int64_t, struct fronius_window *);
+
+/*
+ * Returns sample counters and the scheduling delay histogram.
+ */
+int fronius_sampler_stats(struct fronius_sampler *,
+                          struct fronius_sampler_stats *);
+
+/**
+ * Sample store
+ *
+ * An append-only file of (number, command) series of timestamped values,
+ * e.g. from a sampler. Samples are compressed to a few bits each and
+ * written in blocks of about 1 KiB, so a logger on flash storage writes
+ * rarely and little. Samples not written yet are lost on a crash unless
+ * fronius_store_flush() was called.
+ **/
+
+struct fronius_store;
+
+struct fronius_store_stats {
+	/* samples in the store and those of them not written yet */
+	uint64_t	samples;
+	uint64_t	pending;
+	/* blocks and bytes in the file */
+	uint64_t	blocks;
+	uint64_t	bytes;
+	/* damaged blocks found on open or skipped while scanning */
+	uint64_t	corrupt;
+	/* block writes which failed, their samples stay pending */
+	uint64_t	failed;
+};
+
+/*
+ * Open a store, creating it if it does not exist unless opened read-only.
+ * A block torn by a crash at the end of the file is cut off.
+ */
+struct fronius_store *fronius_store_open(const char *, int);
+
+/*
+ * Write all pending samples and close the store.
+ */
+int fronius_store_close(struct fronius_store *);
+
+/*
+ * Append a sample with its time in ms since the epoch; the value may be
+ * NULL unless the error is FRONIUS_ERR_NOERROR. Returns -1 with errno
+ * EINVAL if the time is before the latest sample of the series. If a full
+ * block cannot be written, the sample is not taken and -1 is returned
+ * with the errno of the write; the block stays in memory and is written
+ * by the next append or flush which succeeds.
+ */
+int fronius_store_append(struct fronius_store *, uint8_t, uint8_t, int64_t,
+                         const struct fronius_fixed *, fronius_error_t);
+
+/*
+ * Append the samples of a sampler window which are newer than the latest
+ * one of the series, so that overlapping windows can be passed. Returns
+ * the number of samples appended.
+ */
+int fronius_store_append_window(struct fronius_store *, uint8_t, uint8_t,
+                                const struct fronius_window *);
+
+/*
+ * Write all pending samples and flush the file to disk. On failure the
+ * samples not written stay pending and can be flushed again.
+ */
+int fronius_store_flush(struct fronius_store *);
+
+/*
+ * Called for every sample of a scan with number, command, time, value
+ * (NULL for failed samples) and status. Returning non-zero stops the scan.
+ */
+typedef int (*fronius_store_cb_t)(uint8_t, uint8_t, int64_t,
+                                  const struct fronius_fixed *,
+                                  fronius_error_t, void *);
+
+/*
+ * Pass the samples taken from (inclusive) to (exclusive) the given times
+ * on, series by series and in time order within a series. A number or
+ * command of 0 matches all. Only blocks overlapping the range are read.
+ * Returns the number of samples passed on.
+ */
+int fronius_store_scan(struct fronius_store *, uint8_t, uint8_t, int64_t,
+                       int64_t, fronius_store_cb_t, void *);
+
+/*
+ * Returns sample, block and size counters.
+ */
+int fronius_store_stats(struct fronius_store *, struct fronius_store_stats *);
+
+/**
+ * Metrics exporter
+ *
+ * A small HTTP endpoint on a loopback TCP port or a Unix socket serves the
+ * latest samples of a sampler, their age and the device statistics in
+ * OpenMetrics text format, e.g. for Prometheus. Scrapes are answered from
+ * memory only, their cost does not depend on the speed of the bus.
+ **/
+
+struct fronius_exporter;
+
+/*
+ * Listen on "tcp://host:port" or "unix:///path/to/socket". The sampler is
+ * optional; without one, only the statistics of the device are exported.
+ */
+struct fronius_exporter *fronius_exporter_new(struct fronius_dev *,
+                                              struct fronius_sampler *,
+                                              const char *);
+
+/*
+ * Close all connections and the listening socket.
+ */
+void fronius_exporter_free(struct fronius_exporter *);
+
+/*
+ * Returns a descriptor which becomes readable when the exporter has work
+ * to do, to be added to the poll loop driving the sampler.
+ */
+int fronius_exporter_fd(struct fronius_exporter *);
+
+/*
+ * Accept and serve scrapes without blocking. Call it when the descriptor
+ * is readable, and every few seconds to drop stalled connections.
+ */
+int fronius_exporter_process(struct fronius_exporter *);
+
+/**
+ * Poll plan
+ *
+ * A poll plan walks every (number, command) pair of a device class
+ * back-to-back: each completion submits the next request right away, so
+ * the bus has no idle gaps between transactions.
+ **/
+
+struct fronius_plan;
+
+struct fronius_plan_stats {
+	/* completed and failed transactions, finished cycles */
+	unsigned long	transactions;
+	unsigned long	errors;
+	unsigned long	cycles;
+	/* seconds since start and achieved transactions per second */
+	double		elapsed;
+	double		rate;
+};
+
+/*
+ * Create a plan for the given device class (e.g. FRONIUS_DEVICE_INVERTER).
+ * The number list is in the format returned by
+ * fronius_cmd_ic_getactiveinverters(), i.e. terminated by a zero entry or
+ * its size. The callback is invoked for every completed transaction.
+ */
+struct fronius_plan *fronius_plan_new(struct fronius_dev *, uint8_t,
+                                      const char *, size_t,
+                                      const uint8_t *, size_t,
+                                      fronius_callback_t, void *);
+
+/*
+ * Free a plan; it must not be running.
+ */
+void fronius_plan_free(struct fronius_plan *);
+
+/*
+ * Start the plan for the given number of cycles (0 runs until stopped);
+ * the device is then driven with fronius_process().
+ */
+int fronius_plan_start(struct fronius_plan *, unsigned int);
+
+/*
+ * Stop the plan after the request currently in flight.
+ */
+void fronius_plan_stop(struct fronius_plan *);
+
+/*
+ * Run the plan for the given number of cycles, blocking until done.
+ */
+int fronius_plan_run(struct fronius_plan *, unsigned int);
+
+/*
+ * Returns transaction counters and the achieved transaction rate.
+ */
+int fronius_plan_stats(struct fronius_plan *, struct fronius_plan_stats *);
+
+
 fronius_error_t fronius_cmd_ic_getversion(struct fronius_dev *, fronius_ifc_type_t *, char *, size_t);
 fronius_error_t fronius_cmd_ic_getdevicetype(struct fronius_dev *, uint8_t, uint8_t, const char **, const char **);
 fronius_error_t fronius_cmd_ic_getactiveinverters(struct fronius_dev *, char *, size_t);
@@ -99,6 +944,27 @@ fronius_error_t fronius_cmd_iv_getpowernow(struct fronius_dev *, int *);
 
 fronius_error_t fronius_cmd_iv_getvalue(struct fronius_dev *, unsigned char cmd, double *);
 
+fronius_error_t fronius_cmd_iv_getfixed(struct fronius_dev *, unsigned char cmd, struct fronius_fixed *);
+
+struct fronius_value {
+	/* FRONIUS_ERR_NOERROR, FRONIUS_ERR_VALUE_OVERFLOW,
+	   FRONIUS_ERR_VALUE_UNDERFLOW or the protocol error of this value */
+	fronius_error_t		error;
+	double			value;
+	/* the same value as received */
+	struct fronius_fixed	fixed;
+};
+
+/*
+ * Query several values of one device in a single call. Every value gets
+ * its own status, a failing command does not abort the batch. Returns
+ * FRONIUS_ERR_INVALID_RESPONSE with errno set only if the connection to
+ * the device fails; the values not queried then have that status too.
+ */
+fronius_error_t fronius_cmd_iv_getvalues(struct fronius_dev *, uint8_t, uint8_t,
+                                         const uint8_t *, size_t,
+                                         struct fronius_value *);
+
 typedef enum fronius_unit {
   FRONIUS_UNIT_W,
   FRONIUS_UNIT_WH,
@@ -111,21 +977,11 @@ typedef enum fronius_unit {
   FRONIUS_UNIT_WPM2,
   FRONIUS_UNIT_CURR,
   FRONIUS_UNIT_TEMP,
+  FRONIUS_UNIT_NONE,
 } fronius_unit_t;
 
-static const char *fronius_unit_str[] = {
-  [FRONIUS_UNIT_W]    = "W",
-  [FRONIUS_UNIT_WH]   = "Wh",
-  [FRONIUS_UNIT_A]    = "A",
-  [FRONIUS_UNIT_V]    = "V",
-  [FRONIUS_UNIT_HZ]   = "Hz",
-  [FRONIUS_UNIT_MIN]  = "min",
-  [FRONIUS_UNIT_C]    = "°C",
-  [FRONIUS_UNIT_RPM]  = "rpm",
-  [FRONIUS_UNIT_WPM2] = "W/m²",
-  [FRONIUS_UNIT_CURR] = "",
-  [FRONIUS_UNIT_TEMP] = "",
-};
+/* unit symbols indexed by fronius_unit_t */
+extern const char *const fronius_unit_str[];
 
 enum fronius_cmd {
   /* commands for inverters */
@@ -203,76 +1059,65 @@ struct fronius_query_value {
 };
 
 
-static const struct fronius_query_value fronius_cmds[] = {
-  /* commands for inverters */
-  { FRONIUS_CMD_POWER_NOW,                      FRONIUS_UNIT_W },
-  { FRONIUS_CMD_ENERGY_TOTAL,                   FRONIUS_UNIT_WH },
-  { FRONIUS_CMD_ENERGY_DAY,                     FRONIUS_UNIT_WH },
-  { FRONIUS_CMD_ENERGY_YEAR ,                   FRONIUS_UNIT_WH },
-  { FRONIUS_CMD_AC_CURRENT_NOW,                 FRONIUS_UNIT_A },
-  { FRONIUS_CMD_AC_VOLTAGE_NOW,                 FRONIUS_UNIT_V },
-  { FRONIUS_CMD_AC_FREQUENCY_NOW,               FRONIUS_UNIT_HZ },
-  { FRONIUS_CMD_DC_CURRENT_NOW,                 FRONIUS_UNIT_A },
-  { FRONIUS_CMD_DC_VOLTAGE_NOW,                 FRONIUS_UNIT_V },
-  { FRONIUS_CMD_YIELD_DAY,                      FRONIUS_UNIT_CURR },
-  { FRONIUS_CMD_MAX_POWER_DAY,                  FRONIUS_UNIT_W },
-  { FRONIUS_CMD_MAX_AC_VOLTAGE_DAY,             FRONIUS_UNIT_V },
-  { FRONIUS_CMD_MIN_AC_VOLTAGE_DAY,             FRONIUS_UNIT_V },
-  { FRONIUS_CMD_MAX_DC_VOLTAGE_DAY,             FRONIUS_UNIT_V },
-  { FRONIUS_CMD_OPERATING_HOURS_DAY,            FRONIUS_UNIT_MIN },
-  { FRONIUS_CMD_YIELD_YEAR,                     FRONIUS_UNIT_CURR },
-  { FRONIUS_CMD_MAX_POWER_YEAR,                 FRONIUS_UNIT_W },
-  { FRONIUS_CMD_MAX_AC_VOLTAGE_YEAR,            FRONIUS_UNIT_V },
-  { FRONIUS_CMD_MIN_AC_VOLTAGE_YEAR,            FRONIUS_UNIT_V },
-  { FRONIUS_CMD_MAX_DC_VOLTAGE_YEAR,            FRONIUS_UNIT_V },
-  { FRONIUS_CMD_OPERATING_HOURS_YEAR,           FRONIUS_UNIT_MIN },
-  { FRONIUS_CMD_YIELD_TOTAL,                    FRONIUS_UNIT_CURR },
-  { FRONIUS_CMD_MAX_POWER_TOTAL,                FRONIUS_UNIT_W },
-  { FRONIUS_CMD_MAX_AC_VOLTAGE_TOTAL,           FRONIUS_UNIT_V },
-  { FRONIUS_CMD_MIN_AC_VOLTAGE_TOTAL,           FRONIUS_UNIT_V },
-  { FRONIUS_CMD_MAX_DC_VOLTAGE_TOTAL,           FRONIUS_UNIT_V },
-  { FRONIUS_CMD_OPERATING_HOURS_TOTAL,          FRONIUS_UNIT_MIN },
-    /* commands for 3-phase inverters */
-  { FRONIUS_CMD_CURRENT_PHASE1,                 FRONIUS_UNIT_A },
-  { FRONIUS_CMD_CURRENT_PHASE2,                 FRONIUS_UNIT_A },
-  { FRONIUS_CMD_CURRENT_PHASE3,                 FRONIUS_UNIT_A },
-  { FRONIUS_CMD_VOLTAGE_PHASE1,                 FRONIUS_UNIT_V },
-  { FRONIUS_CMD_VOLTAGE_PHASE2,                 FRONIUS_UNIT_V },
-  { FRONIUS_CMD_VOLTAGE_PHASE3,                 FRONIUS_UNIT_V },
-  { FRONIUS_CMD_AMBIENT_TEMPERATUR,             FRONIUS_UNIT_C },
-  { FRONIUS_CMD_FAN_SPEED_FRONT_LEFT,           FRONIUS_UNIT_RPM },
-  { FRONIUS_CMD_FAN_SPEED_FRONT_RIGHT,          FRONIUS_UNIT_RPM },
-  { FRONIUS_CMD_FAN_SPEED_REAR_LEFT,            FRONIUS_UNIT_RPM },
-  { FRONIUS_CMD_FAN_SPEED_REAR_RIGHT,           FRONIUS_UNIT_RPM },
-  /* commands for sensor card/sensor box */
-  { FRONIUS_CMD_TEMPERATURE_CHANNEL1_NOW,       FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_TEMPERATURE_CHANNEL2_NOW,       FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_INSOLATION_NOW,                 FRONIUS_UNIT_WPM2 },
-  { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL1_DAY,   FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL1_DAY,   FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL1_YEAR,  FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL1_YEAR,  FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL1_TOTAL, FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL1_TOTAL, FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL2_DAY,   FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL2_DAY,   FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL2_YEAR,  FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL2_YEAR,  FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL2_TOTAL, FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL2_TOTAL, FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_INSOLATION_DAY,             FRONIUS_UNIT_WPM2 },
-  { FRONIUS_CMD_MAX_INSOLATION_YEAR,            FRONIUS_UNIT_WPM2 },
-  { FRONIUS_CMD_MAX_INSOLATION_TOTAL,           FRONIUS_UNIT_WPM2 },
-  { FRONIUS_CMD_DIGITAL_CHANNEL1_NOW,           FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_DIGITAL_CHANNEL2_NOW,           FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_DIGITAL_CHANNEL1_DAY,       FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_DIGITAL_CHANNEL1_YEAR,      FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_DIGITAL_CHANNEL1_TOTAL,     FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_DIGITAL_CHANNEL2_DAY,       FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_DIGITAL_CHANNEL2_YEAR,      FRONIUS_UNIT_TEMP },
-  { FRONIUS_CMD_MAX_DIGITAL_CHANNEL2_TOTAL,     FRONIUS_UNIT_TEMP },
+/* all value commands of inverters and sensor cards */
+#define FRONIUS_CMDS_COUNT	64
+
+extern const struct fronius_query_value fronius_cmds[FRONIUS_CMDS_COUNT];
+
+/**
+ * Command registry
+ *
+ * Everything known about a command is kept in one table indexed by the
+ * command id, likewise the device types reported by
+ * fronius_cmd_ic_getdevicetype() are indexed by device class and id.
+ **/
+
+struct fronius_cmd_info {
+	uint8_t			command;
+	/* device class the command is meant for, interface card commands
+	   like FRONIUS_CMD_IFCARD_GETDEVICETYPE may be sent to any device */
+	uint8_t			device;
+	/* valid response lengths */
+	uint8_t			min_length;
+	uint8_t			max_length;
+	fronius_unit_t		unit;
+	fronius_cache_class_t	volatility;
 };
 
+/*
+ * Returns the registry entry of a command, or NULL if it is unknown.
+ */
+const struct fronius_cmd_info *fronius_cmd_info(uint8_t);
+
+/*
+ * Returns the name of a command without the FRONIUS_CMD_ prefix, e.g.
+ * "POWER_NOW", or NULL if it is unknown.
+ */
+const char *fronius_cmd_name(uint8_t);
+
+/*
+ * Returns the unit of a command, FRONIUS_UNIT_NONE for unknown commands.
+ */
+fronius_unit_t fronius_cmd_unit(uint8_t);
+
+/*
+ * Returns the volatility class of a command, FRONIUS_CACHE_NOW for
+ * unknown commands.
+ */
+fronius_cache_class_t fronius_cmd_volatility(uint8_t);
+
+/*
+ * Returns the symbol of a unit, e.g. "Wh", or "" if it has none.
+ */
+const char *fronius_unit_name(fronius_unit_t);
+
+/*
+ * Returns name and type of the device type id reported by a device of the
+ * given class. Unknown ids yield a generic name and a NULL type.
+ */
+const char *fronius_device_name(uint8_t, uint8_t);
+const char *fronius_device_type(uint8_t, uint8_t);
+
 FRONIUS_END_DECLS
 
 #endif /* FRONIUS_H */
@@ -0,0 +1,354 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+#define FRONIUS_MAX_RETRIES (3)
+/* while probing, silence most likely means a wrong baudrate */
+#define FRONIUS_PROBE_RETRIES (1)
+
+static void fronius_xfer_arm(struct fronius_dev *dev)
+{
+    long us = fronius_rto(dev, dev->xfer.req->command, dev->xfer.retries);
+
+    clock_gettime(CLOCK_MONOTONIC, &dev->xfer.sent);
+
+    dev->xfer.deadline.tv_sec = dev->xfer.sent.tv_sec + us / 1000000;
+    dev->xfer.deadline.tv_nsec = dev->xfer.sent.tv_nsec + us % 1000000 * 1000;
+    if (dev->xfer.deadline.tv_nsec >= 1000000000) {
+        dev->xfer.deadline.tv_sec++;
+        dev->xfer.deadline.tv_nsec -= 1000000000;
+    }
+}
+
+static int fronius_xfer_expired(struct fronius_dev *dev)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (now.tv_sec != dev->xfer.deadline.tv_sec)
+        return now.tv_sec > dev->xfer.deadline.tv_sec;
+    return now.tv_nsec >= dev->xfer.deadline.tv_nsec;
+}
+
+static void fronius_xfer_complete(struct fronius_dev *dev,
+                                  fronius_error_t error)
+{
+    struct fronius_result res;
+
+    dev->xfer.error = error;
+    dev->xfer.state = FRONIUS_XFER_DONE;
+    fronius_stats_request(dev);
+
+    if (!dev->xfer.callback)
+        return;
+
+    /* device is idle again before the callback runs, so that it can
+       submit the next request right away */
+    dev->xfer.state = FRONIUS_XFER_IDLE;
+    fronius_result(dev, &res);
+    dev->xfer.callback(dev, &res, dev->xfer.arg);
+}
+
+/* complete the request after a transport failure, errno is kept for the
+   caller of fronius_process() */
+static void fronius_xfer_fail(struct fronius_dev *dev)
+{
+    int err = errno;
+
+    dev->xfer.ioerror = err;
+    fronius_xfer_complete(dev, FRONIUS_ERR_INVALID_RESPONSE);
+    errno = err;
+}
+
+/* (re)transmit the request frame; returns -1 on i/o errors */
+static int fronius_xfer_send(struct fronius_dev *dev, int restart)
+{
+    dev->xfer.state = FRONIUS_XFER_SEND;
+    dev->xfer.lost = 0;
+
+    if (fronius_pkt_send(dev, restart ? dev->xfer.req : NULL) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        /* the link is down for now: the frame is lost like a response
+           would be, and sent again after the timeout or once the link is
+           back */
+        if (errno != ENOTCONN)
+            return -1;
+        dev->xfer.lost = 1;
+    }
+
+    /* frame is on the wire, wait for the response */
+    dev->xfer.state = FRONIUS_XFER_RECV;
+    fronius_xfer_arm(dev);
+    fronius_serial_expect(dev);
+
+    return 0;
+}
+
+/* retry after a timeout or invalid data, give up after too many attempts */
+static int fronius_xfer_retry(struct fronius_dev *dev)
+{
+    int max = dev->probing ? FRONIUS_PROBE_RETRIES : FRONIUS_MAX_RETRIES;
+
+    if (dev->xfer.retries++ >= max) {
+        fronius_xfer_complete(dev, FRONIUS_ERR_INVALID_RESPONSE);
+        return 1;
+    }
+
+    FRONIUS_STAT_ADD(dev->stats.retries, 1);
+    if (fronius_xfer_send(dev, 1) < 0) {
+        fronius_xfer_fail(dev);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* consume received data; returns 1 if the request completed */
+static int fronius_xfer_recv(struct fronius_dev *dev)
+{
+    const struct fronius_pkt *req = dev->xfer.req;
+    struct fronius_pkt *rsp = &dev->xfer.response;
+    fronius_error_t err;
+
+    for (;;) {
+        if (fronius_pkt_recv(dev, rsp) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* wake up again for the rest of the frame */
+                fronius_serial_expect(dev);
+                return 0;
+            }
+
+            fronius_xfer_fail(dev);
+            return -1;
+        }
+
+        /* validate response, an error frame names the failed command
+           in its first data byte */
+        err = fronius_pkt_iserror(rsp);
+        if (req->device != rsp->device ||
+            req->number != rsp->number ||
+            req->command != (err == FRONIUS_ERR_NOERROR ? rsp->command :
+                                                          rsp->data[0]))
+            /* late answer to an earlier request, keep waiting */
+            continue;
+
+        /* Karn's rule: the response to a retransmitted request cannot be
+           attributed to one of the attempts */
+        if (!dev->xfer.retries)
+            fronius_rto_sample(dev, req->command, &dev->xfer.sent);
+
+        fronius_xfer_complete(dev, err);
+        return 1;
+    }
+}
+
+int fronius_xfer_start_frame(struct fronius_dev *dev,
+                             const struct fronius_pkt *frame,
+                             fronius_callback_t callback, void *arg)
+{
+    if (dev->xfer.state == FRONIUS_XFER_SEND ||
+        dev->xfer.state == FRONIUS_XFER_RECV) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    dev->xfer.req = frame;
+    dev->xfer.retries = 0;
+    dev->xfer.error = FRONIUS_ERR_NOERROR;
+    dev->xfer.ioerror = 0;
+    clock_gettime(CLOCK_MONOTONIC, &dev->xfer.started);
+    dev->xfer.callback = callback;
+    dev->xfer.arg = arg;
+
+    /* try to put the frame on the wire immediately */
+    if (fronius_xfer_send(dev, 1) < 0) {
+        dev->xfer.state = FRONIUS_XFER_IDLE;
+        return -1;
+    }
+
+    if (dev->mux_entry)
+        fronius_mux_touch(dev->mux_entry);
+
+    return 0;
+}
+
+int fronius_xfer_start(struct fronius_dev *dev, const struct fronius_pkt *pkt,
+                       fronius_callback_t callback, void *arg)
+{
+    if (dev->xfer.state == FRONIUS_XFER_SEND ||
+        dev->xfer.state == FRONIUS_XFER_RECV) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    /* callers may build the request in place */
+    if (pkt != &dev->xfer.request)
+        memcpy(&dev->xfer.request, pkt, FRONIUS_PKT_LEN(pkt));
+    fronius_pkt_checksum(&dev->xfer.request);
+
+    return fronius_xfer_start_frame(dev, &dev->xfer.request, callback, arg);
+}
+
+int fronius_xfer_wait(struct fronius_dev *dev)
+{
+    int revents;
+
+    while (dev->xfer.state == FRONIUS_XFER_SEND ||
+           dev->xfer.state == FRONIUS_XFER_RECV) {
+        revents = dev->transport->wait(dev, fronius_events(dev),
+                                       fronius_timeout(dev));
+        if (revents == -1)
+            return -1;
+
+        if (fronius_process(dev, revents) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int fronius_submit(struct fronius_dev *dev, uint8_t device, uint8_t number,
+                   uint8_t command, fronius_callback_t callback, void *arg)
+{
+    struct fronius_pkt pkt;
+
+    fronius_pkt_init(&pkt);
+    pkt.device = device;
+    pkt.number = number;
+    pkt.command = command;
+
+    return fronius_xfer_start(dev, &pkt, callback, arg);
+}
+
+int fronius_events(struct fronius_dev *dev)
+{
+    int events;
+
+    switch (dev->xfer.state) {
+    case FRONIUS_XFER_SEND:
+        events = POLLOUT;
+        break;
+    case FRONIUS_XFER_RECV:
+        events = POLLIN;
+        break;
+    default:
+        events = 0;
+        break;
+    }
+
+    return dev->transport->events ? dev->transport->events(dev, events) :
+                                    events;
+}
+
+int fronius_timeout(struct fronius_dev *dev)
+{
+    struct timespec now;
+    long ms = -1;
+
+    if (dev->xfer.state == FRONIUS_XFER_RECV) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        /* round up so that the deadline is expired when poll returns */
+        ms = (dev->xfer.deadline.tv_sec - now.tv_sec) * 1000 +
+             (dev->xfer.deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+        if (ms < 0)
+            ms = 0;
+    }
+
+    if (dev->xfer.state == FRONIUS_XFER_SEND ||
+        dev->xfer.state == FRONIUS_XFER_RECV)
+        if (dev->transport->timeout)
+            ms = dev->transport->timeout(dev, ms);
+
+    return ms;
+}
+
+int fronius_process(struct fronius_dev *dev, int revents)
+{
+    switch (dev->xfer.state) {
+    case FRONIUS_XFER_SEND:
+        /* without events only a deadline of the transport is due */
+        if (!revents && fronius_timeout(dev) != 0)
+            return 0;
+        if (fronius_xfer_send(dev, 0) < 0) {
+            fronius_xfer_fail(dev);
+            return -1;
+        }
+        /* the device is most likely not readable yet */
+        return 0;
+
+    case FRONIUS_XFER_RECV:
+        /* without events a deadline of the transport may be due, it acts
+           on its next receive */
+        if (revents || dev->transport->timeout) {
+            int rv = fronius_xfer_recv(dev);
+            if (rv)
+                return rv;
+        }
+        /* a frame lost while the link was down need not wait for its
+           timeout, the link came back */
+        if (dev->xfer.state == FRONIUS_XFER_RECV && dev->xfer.lost &&
+            !fronius_tcp_error(dev)) {
+            if (fronius_xfer_send(dev, 1) < 0) {
+                fronius_xfer_fail(dev);
+                return -1;
+            }
+            return 0;
+        }
+        if (dev->xfer.state == FRONIUS_XFER_RECV && fronius_xfer_expired(dev)) {
+            FRONIUS_STAT_ADD(dev->stats.timeouts, 1);
+            fronius_rto_backoff(dev, dev->xfer.req->command);
+            return fronius_xfer_retry(dev);
+        }
+        return 0;
+
+    default:
+        return 0;
+    }
+}
+
+int fronius_result(struct fronius_dev *dev, struct fronius_result *res)
+{
+    const struct fronius_pkt *pkt;
+
+    if (dev->xfer.state == FRONIUS_XFER_SEND ||
+        dev->xfer.state == FRONIUS_XFER_RECV) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    /* nothing submitted, or the request frame is gone already */
+    if (!dev->xfer.req) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* no response at all if the request failed on the transport level */
+    pkt = dev->xfer.error == FRONIUS_ERR_INVALID_RESPONSE ?
+          dev->xfer.req : &dev->xfer.response;
+
+    res->error = dev->xfer.error;
+    res->device = dev->xfer.req->device;
+    res->number = dev->xfer.req->number;
+    res->command = dev->xfer.req->command;
+    res->length = pkt->length;
+    res->data = pkt->data;
+
+    /* result is consumed */
+    dev->xfer.state = FRONIUS_XFER_IDLE;
+
+    return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * The cache is a small open addressing hash table keyed by
+ * (device, number, command). A key is searched within a few slots after
+ * its hash position; when all of them are taken, the entry which expires
+ * first is evicted.
+ */
+
+#define FRONIUS_CACHE_PROBES	8
+
+struct fronius_cache_entry {
+	/* CLOCK_MONOTONIC in nanoseconds, 0 for an empty slot */
+	uint64_t	expires;
+	uint32_t	key;
+	uint8_t		length;
+	uint8_t		data[FRONIUS_CACHE_DATALEN];
+};
+
+struct fronius_cache {
+	/* time to live per class in nanoseconds, 0 disables caching */
+	uint64_t			ttl[FRONIUS_CACHE_CLASSES];
+	unsigned long			hits, misses, evictions;
+	struct fronius_cache_entry	slot[FRONIUS_CACHE_SLOTS];
+};
+
+/* default time to live per class in milliseconds */
+static const unsigned int fronius_cache_default_ttl[FRONIUS_CACHE_CLASSES] = {
+    [FRONIUS_CACHE_NOW]   = 0,
+    [FRONIUS_CACHE_DAY]   = 10 * 1000,
+    [FRONIUS_CACHE_YEAR]  = 60 * 1000,
+    [FRONIUS_CACHE_TOTAL] = 60 * 1000,
+    [FRONIUS_CACHE_INFO]  = 60 * 60 * 1000,
+};
+
+static uint64_t fronius_cache_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t fronius_cache_key(uint8_t device, uint8_t number,
+                                         uint8_t command)
+{
+    return (uint32_t) device << 16 | (uint32_t) number << 8 | command;
+}
+
+static inline unsigned int fronius_cache_hash(uint32_t key)
+{
+    /* multiplicative hashing, the upper bits are the best mixed ones */
+    return (key * 2654435769u) >> 24;
+}
+
+const uint8_t *fronius_cache_lookup(struct fronius_dev *dev, uint8_t device,
+                                    uint8_t number, uint8_t command,
+                                    uint8_t *length)
+{
+    struct fronius_cache *cache = dev->cache;
+    struct fronius_cache_entry *e;
+    uint32_t key;
+    unsigned int h, i;
+
+    if (!cache->ttl[fronius_cmd_volatility(command)])
+        return NULL;
+
+    key = fronius_cache_key(device, number, command);
+    h = fronius_cache_hash(key);
+
+    for (i = 0; i < FRONIUS_CACHE_PROBES; ++i) {
+        e = &cache->slot[(h + i) & (FRONIUS_CACHE_SLOTS - 1)];
+        if (!e->expires || e->key != key)
+            continue;
+
+        if (fronius_cache_now() >= e->expires)
+            break;
+
+        cache->hits++;
+        *length = e->length;
+        return e->data;
+    }
+
+    cache->misses++;
+    return NULL;
+}
+
+/* wall clock time in milliseconds, for entries which outlive the process */
+static int64_t fronius_cache_wallclock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void fronius_cache_insert(struct fronius_cache *cache,
+                                 const struct fronius_pkt *rsp, uint64_t ttl)
+{
+    struct fronius_cache_entry *e, *victim = NULL;
+    uint64_t now;
+    uint32_t key;
+    unsigned int h, i;
+
+    now = fronius_cache_now();
+    key = fronius_cache_key(rsp->device, rsp->number, rsp->command);
+    h = fronius_cache_hash(key);
+
+    /* reuse the entry of the key, else take the slot expiring first,
+       which is an empty or expired one if there is any */
+    for (i = 0; i < FRONIUS_CACHE_PROBES; ++i) {
+        e = &cache->slot[(h + i) & (FRONIUS_CACHE_SLOTS - 1)];
+        if (e->expires && e->key == key) {
+            victim = e;
+            break;
+        }
+        if (!victim || e->expires < victim->expires)
+            victim = e;
+    }
+
+    if (victim->key != key && victim->expires > now)
+        cache->evictions++;
+
+    victim->expires = now + ttl;
+    victim->key = key;
+    victim->length = rsp->length;
+    memcpy(victim->data, rsp->data, rsp->length);
+}
+
+void fronius_cache_store(struct fronius_dev *dev,
+                         const struct fronius_pkt *rsp)
+{
+    struct fronius_cache *cache = dev->cache;
+    uint64_t ttl;
+
+    /* a short or garbled answer must not be served until it expires */
+    ttl = cache->ttl[fronius_cmd_volatility(rsp->command)];
+    if (!ttl || rsp->length > FRONIUS_CACHE_DATALEN ||
+        !fronius_cmd_length_ok(rsp->command, rsp->length))
+        return;
+
+    fronius_cache_insert(cache, rsp, ttl);
+}
+
+size_t fronius_cache_export(struct fronius_dev *dev,
+                            struct fronius_cache_value *values, size_t max)
+{
+    const struct fronius_cache_entry *e;
+    uint64_t now = fronius_cache_now();
+    int64_t wallclock = fronius_cache_wallclock();
+    size_t i, n = 0;
+
+    for (i = 0; i < FRONIUS_CACHE_SLOTS && n < max; ++i) {
+        e = &dev->cache->slot[i];
+        if (e->expires <= now)
+            continue;
+
+        values[n].expires = wallclock + (int64_t) ((e->expires - now) / 1000000);
+        values[n].device = e->key >> 16;
+        values[n].number = e->key >> 8;
+        values[n].command = e->key;
+        values[n].length = e->length;
+        memcpy(values[n].data, e->data, e->length);
+        n++;
+    }
+
+    return n;
+}
+
+void fronius_cache_import(struct fronius_dev *dev,
+                          const struct fronius_cache_value *values, size_t n)
+{
+    struct fronius_cache *cache = dev->cache;
+    struct fronius_pkt pkt;
+    int64_t wallclock = fronius_cache_wallclock();
+    uint64_t ttl, left;
+    size_t i;
+
+    fronius_pkt_init(&pkt);
+
+    for (i = 0; i < n; ++i) {
+        if (values[i].length > FRONIUS_CACHE_DATALEN ||
+            !fronius_cmd_length_ok(values[i].command, values[i].length) ||
+            values[i].expires <= wallclock)
+            continue;
+
+        /* keep the age the value had, but never more than the current
+           time to live of its class */
+        ttl = cache->ttl[fronius_cmd_volatility(values[i].command)];
+        left = (uint64_t) (values[i].expires - wallclock) * 1000000ULL;
+        if (left < ttl)
+            ttl = left;
+        if (!ttl)
+            continue;
+
+        pkt.device = values[i].device;
+        pkt.number = values[i].number;
+        pkt.command = values[i].command;
+        pkt.length = values[i].length;
+        memcpy(pkt.data, values[i].data, values[i].length);
+        fronius_cache_insert(cache, &pkt, ttl);
+    }
+}
+
+int fronius_cache_enable(struct fronius_dev *dev, int enable)
+{
+    int i;
+
+    if (!enable) {
+        free(dev->cache);
+        dev->cache = NULL;
+        return 0;
+    }
+
+    if (dev->cache)
+        return 0;
+
+    dev->cache = calloc(1, sizeof(*dev->cache));
+    if (!dev->cache)
+        return -1;
+
+    for (i = 0; i < FRONIUS_CACHE_CLASSES; ++i)
+        dev->cache->ttl[i] = fronius_cache_default_ttl[i] * 1000000ULL;
+
+    return 0;
+}
+
+int fronius_cache_set_ttl(struct fronius_dev *dev, fronius_cache_class_t class,
+                          unsigned int ms)
+{
+    if (!dev->cache || (unsigned int) class >= FRONIUS_CACHE_CLASSES) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dev->cache->ttl[class] = ms * 1000000ULL;
+
+    return 0;
+}
+
+int fronius_cache_invalidate(struct fronius_dev *dev, int device, int number,
+                             int command)
+{
+    struct fronius_cache_entry *e;
+    int i;
+
+    if (!dev->cache) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < FRONIUS_CACHE_SLOTS; ++i) {
+        e = &dev->cache->slot[i];
+        if ((device < 0 || (e->key >> 16) == (uint32_t) device) &&
+            (number < 0 || ((e->key >> 8) & 0xff) == (uint32_t) number) &&
+            (command < 0 || (e->key & 0xff) == (uint32_t) command))
+            e->expires = 0;
+    }
+
+    return 0;
+}
+
+int fronius_cache_stats(struct fronius_dev *dev,
+                        struct fronius_cache_stats *stats)
+{
+    uint64_t now;
+    int i;
+
+    if (!dev->cache) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stats->hits = dev->cache->hits;
+    stats->misses = dev->cache->misses;
+    stats->evictions = dev->cache->evictions;
+    stats->entries = 0;
+
+    now = fronius_cache_now();
+    for (i = 0; i < FRONIUS_CACHE_SLOTS; ++i)
+        if (dev->cache->slot[i].expires > now)
+            stats->entries++;
+
+    return 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * The capture file consists of a header followed by the record area, which
+ * is used as a ring. Records are aligned to 8 bytes and never wrap around
+ * the end of the area; the rest of a lap is skipped instead. Offsets in the
+ * header run freely, their position in the area is offset % size.
+ *
+ * Timestamps are monotonic; clock records written on open map them to the
+ * wall clock. When the ring overwrites a clock record, its mapping is kept
+ * in the header for the records following it.
+ */
+
+#define FRONIUS_CAPTURE_MAGIC	0x50435246	/* "FRCP" */
+#define FRONIUS_CAPTURE_VERSION	1
+
+/* record direction of the wall clock records */
+#define FRONIUS_CAPTURE_CLOCK	0xff
+
+/* record length marking the skipped rest of a lap */
+#define FRONIUS_CAPTURE_SKIP	0xffff
+
+struct fronius_capture_hdr {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	hdrsize;
+	/* size of the record area */
+	uint64_t	size;
+	/* offsets of the oldest record and of the next record to write */
+	uint64_t	tail;
+	uint64_t	head;
+	/* total number of records ever written */
+	uint64_t	records;
+	/* wall clock mapping of the records before the first clock record,
+	   taken from the last clock record overwritten; 0 if none was */
+	uint64_t	realtime;
+	uint64_t	monotonic;
+	uint8_t		reserved[8];
+};
+
+struct fronius_capture_rec {
+	uint16_t	len;
+	uint8_t		dir;
+	uint8_t		reserved[5];
+	/* CLOCK_MONOTONIC in nanoseconds */
+	uint64_t	ts;
+};
+
+struct fronius_capture {
+	int				fd;
+	size_t				mapsize;
+	struct fronius_capture_hdr	*hdr;
+	uint8_t				*area;
+};
+
+#define REC_ALIGN(n)	(((n) + 7) & ~(uint64_t) 7)
+#define REC_SIZE(len)	REC_ALIGN(sizeof(struct fronius_capture_rec) + (len))
+
+static uint64_t ts_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* space left in the current lap at the given offset */
+static uint64_t lap_rest(const struct fronius_capture_hdr *hdr, uint64_t off)
+{
+    return hdr->size - off % hdr->size;
+}
+
+/* size a reader has to step over to get to the record after off, 0 if the
+   record at off runs past its lap, i.e. the file is damaged */
+static uint64_t rec_step(const struct fronius_capture *cap, uint64_t off)
+{
+    const struct fronius_capture_hdr *hdr = cap->hdr;
+    const struct fronius_capture_rec *rec;
+    uint64_t rest = lap_rest(hdr, off);
+
+    if (rest < sizeof(*rec))
+        return rest;
+
+    rec = (const struct fronius_capture_rec *) &cap->area[off % hdr->size];
+    if (rec->len == FRONIUS_CAPTURE_SKIP)
+        return rest;
+
+    if (REC_SIZE(rec->len) > rest)
+        return 0;
+
+    return REC_SIZE(rec->len);
+}
+
+/* check that the records from tail to head can be walked */
+static int fronius_capture_walkable(const struct fronius_capture *cap)
+{
+    uint64_t off, step;
+
+    for (off = cap->hdr->tail; off < cap->hdr->head; off += step)
+        if (!(step = rec_step(cap, off)))
+            return 0;
+
+    return off == cap->hdr->head;
+}
+
+/* keep the mapping of a clock record about to be overwritten, it still
+   applies to the records after it */
+static void fronius_capture_drop(struct fronius_capture *cap, uint64_t off)
+{
+    struct fronius_capture_hdr *hdr = cap->hdr;
+    const struct fronius_capture_rec *rec;
+
+    if (lap_rest(hdr, off) < sizeof(*rec))
+        return;
+
+    rec = (const struct fronius_capture_rec *) &cap->area[off % hdr->size];
+    if (rec->dir != FRONIUS_CAPTURE_CLOCK ||
+        rec->len != sizeof(hdr->realtime))
+        return;
+
+    memcpy(&hdr->realtime, rec + 1, sizeof(hdr->realtime));
+    hdr->monotonic = rec->ts;
+}
+
+static void fronius_capture_write(struct fronius_capture *cap, int dir,
+                                  uint64_t ts, const uint8_t *frame,
+                                  size_t len)
+{
+    struct fronius_capture_hdr *hdr = cap->hdr;
+    struct fronius_capture_rec *rec;
+    uint64_t head = hdr->head, need = REC_SIZE(len);
+    uint64_t rest = lap_rest(hdr, head), step;
+
+    /* records do not wrap, skip the rest of the lap if necessary */
+    if (rest < need)
+        head += rest;
+
+    /* drop the oldest records to make room, all of them if they cannot
+       be walked */
+    while (head + need - hdr->tail > hdr->size) {
+        step = rec_step(cap, hdr->tail);
+        if (!step) {
+            hdr->tail = head;
+            break;
+        }
+        fronius_capture_drop(cap, hdr->tail);
+        hdr->tail += step;
+    }
+
+    if (rest < need && rest >= sizeof(*rec)) {
+        rec = (struct fronius_capture_rec *) &cap->area[hdr->head % hdr->size];
+        rec->len = FRONIUS_CAPTURE_SKIP;
+    }
+
+    rec = (struct fronius_capture_rec *) &cap->area[head % hdr->size];
+    rec->len = len;
+    rec->dir = dir;
+    rec->ts = ts;
+    memcpy(rec + 1, frame, len);
+
+    /* publish the record only after it is complete */
+    hdr->records++;
+    __atomic_store_n(&hdr->head, head + need, __ATOMIC_RELEASE);
+}
+
+void fronius_capture_frame(struct fronius_dev *dev, int dir,
+                           const uint8_t *frame, size_t len)
+{
+    fronius_capture_write(dev->capture, dir, ts_ns(CLOCK_MONOTONIC),
+                          frame, len);
+}
+
+static int fronius_capture_valid(const struct fronius_capture_hdr *hdr,
+                                 size_t size)
+{
+    return hdr->magic == FRONIUS_CAPTURE_MAGIC &&
+           hdr->version == FRONIUS_CAPTURE_VERSION &&
+           hdr->hdrsize == sizeof(*hdr) &&
+           hdr->size == size - sizeof(*hdr) &&
+           hdr->tail <= hdr->head && hdr->head - hdr->tail <= hdr->size;
+}
+
+int fronius_capture_open(struct fronius_dev *dev, const char *path,
+                         size_t size)
+{
+    struct fronius_capture *cap;
+    struct stat st;
+    uint64_t realtime;
+
+    /* size of the whole file, rounded to whole records */
+    size = REC_ALIGN(size);
+    if (size < sizeof(struct fronius_capture_hdr) + 2 * REC_SIZE(FRONIUS_MAX_PKTLEN)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (dev->capture) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    cap = calloc(1, sizeof(*cap));
+    if (!cap)
+        return -1;
+
+    cap->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cap->fd == -1)
+        goto free;
+
+    if (fstat(cap->fd, &st) == -1)
+        goto close;
+
+    /* preallocate the file once, so that no write ever extends it */
+    if ((size_t) st.st_size != size &&
+        (ftruncate(cap->fd, 0) == -1 || ftruncate(cap->fd, size) == -1))
+        goto close;
+
+    cap->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    cap->fd, 0);
+    if (cap->hdr == MAP_FAILED)
+        goto close;
+
+    cap->mapsize = size;
+    cap->area = (uint8_t *) (cap->hdr + 1);
+
+    /* continue an existing capture of the same size, unless it is torn */
+    if (!fronius_capture_valid(cap->hdr, size) ||
+        !fronius_capture_walkable(cap)) {
+        memset(cap->hdr, 0, sizeof(*cap->hdr));
+        cap->hdr->magic = FRONIUS_CAPTURE_MAGIC;
+        cap->hdr->version = FRONIUS_CAPTURE_VERSION;
+        cap->hdr->hdrsize = sizeof(*cap->hdr);
+        cap->hdr->size = size - sizeof(*cap->hdr);
+    }
+
+    /* record the wall clock time, so that readers can map the monotonic
+       timestamps of the following records */
+    realtime = ts_ns(CLOCK_REALTIME);
+    fronius_capture_write(cap, FRONIUS_CAPTURE_CLOCK, ts_ns(CLOCK_MONOTONIC),
+                          (const uint8_t *) &realtime, sizeof(realtime));
+
+    dev->capture = cap;
+    return 0;
+
+close:
+    close(cap->fd);
+free:
+    free(cap);
+    return -1;
+}
+
+int fronius_capture_sync(struct fronius_dev *dev)
+{
+    if (!dev->capture) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return msync(dev->capture->hdr, dev->capture->mapsize, MS_SYNC);
+}
+
+int fronius_capture_close(struct fronius_dev *dev)
+{
+    struct fronius_capture *cap = dev->capture;
+    int rv;
+
+    if (!cap)
+        return 0;
+
+    dev->capture = NULL;
+
+    rv = munmap(cap->hdr, cap->mapsize);
+    if (close(cap->fd) == -1)
+        rv = -1;
+    free(cap);
+
+    return rv;
+}
+
+int fronius_capture_read(const char *path, fronius_capture_cb_t callback,
+                         void *arg)
+{
+    struct fronius_capture cap;
+    const struct fronius_capture_rec *rec;
+    struct stat st;
+    uint64_t off, head, step, realtime, monotonic, ts;
+    int rv = -1;
+
+    cap.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (cap.fd == -1)
+        return -1;
+
+    if (fstat(cap.fd, &st) == -1)
+        goto close;
+
+    cap.mapsize = st.st_size;
+    cap.hdr = mmap(NULL, cap.mapsize, PROT_READ, MAP_SHARED, cap.fd, 0);
+    if (cap.hdr == MAP_FAILED)
+        goto close;
+    cap.area = (uint8_t *) (cap.hdr + 1);
+
+    if (cap.mapsize < sizeof(*cap.hdr) ||
+        !fronius_capture_valid(cap.hdr, cap.mapsize)) {
+        errno = EINVAL;
+        goto unmap;
+    }
+
+    head = __atomic_load_n(&cap.hdr->head, __ATOMIC_ACQUIRE);
+
+    /* the records up to the first clock record in the ring */
+    realtime = cap.hdr->realtime;
+    monotonic = cap.hdr->monotonic;
+
+    for (off = cap.hdr->tail; off < head; off += step) {
+        /* a damaged record ends the walk, its length cannot be trusted */
+        if (!(step = rec_step(&cap, off))) {
+            errno = EBADMSG;
+            goto unmap;
+        }
+
+        if (lap_rest(cap.hdr, off) < sizeof(*rec))
+            continue;
+
+        rec = (const struct fronius_capture_rec *) &cap.area[off % cap.hdr->size];
+        if (rec->len == FRONIUS_CAPTURE_SKIP)
+            continue;
+
+        if (rec->dir == FRONIUS_CAPTURE_CLOCK) {
+            memcpy(&realtime, rec + 1, sizeof(realtime));
+            monotonic = rec->ts;
+            continue;
+        }
+
+        /* convert to wall clock time as of the last clock record */
+        ts = rec->ts - monotonic + realtime;
+
+        if (callback(rec->dir, ts, (const uint8_t *) (rec + 1), rec->len,
+                     arg))
+            break;
+    }
+    rv = 0;
+
+unmap:
+    munmap(cap.hdr, cap.mapsize);
+close:
+    close(cap.fd);
+    return rv;
+}
@@ -5,8 +5,6 @@
  */
 
 #include <stdlib.h>
-#include <termios.h>
-#include <unistd.h>
 
 #include <config.h>
 
@@ -14,19 +12,17 @@
 
 int fronius_close(struct fronius_dev *dev)
 {
-    int fd;
+    int rv;
 
-    /* restore original serial settings if saved */
-    if (dev->old_tio) {
-        if (tcflush(dev->fd, TCIOFLUSH) == -1)
-            return -1;
+    /* stop capturing */
+    fronius_capture_close(dev);
+    fronius_cache_enable(dev, 0);
+    fronius_stats_free(dev);
+    fronius_set_lowlatency(dev, 0);
 
-        if (tcsetattr(dev->fd, TCSANOW, dev->old_tio) == -1)
-            return -1;
-    }
-
-    fd = dev->fd;
+    rv = dev->transport->close(dev);
+    free(dev->old_tio);
     free(dev);
 
-    return close(fd);
+    return rv;
 }
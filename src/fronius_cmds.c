@@ -8,47 +8,67 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
-#include <math.h>
 
 #include <config.h>
 
 #include "fronius-private.h"
 
-#define FRONIUS_MAX_RETRIES (3)
+/* run one request to its end; returns -1 with errno set if the transport
+   failed, else the status of the answer */
+static int fronius_cmd_exchange(struct fronius_dev *dev,
+                                struct fronius_pkt *command)
+{
+    const uint8_t *data;
+    uint8_t length;
+
+    /* answer from the cache if the value is still fresh */
+    if (dev->cache &&
+        (data = fronius_cache_lookup(dev, command->device, command->number,
+                                     command->command, &length))) {
+        command->length = length;
+        memcpy(command->data, data, length);
+        return FRONIUS_ERR_NOERROR;
+    }
+
+    /* send/receive straight from the command packet, the engine takes
+       care of timeouts and retries */
+    fronius_pkt_checksum(command);
+    if (fronius_xfer_start_frame(dev, command, NULL, NULL) < 0 ||
+        fronius_xfer_wait(dev) < 0) {
+        /* abandon the transaction, its frame goes out of scope */
+        if (dev->xfer.req == command) {
+            dev->xfer.state = FRONIUS_XFER_IDLE;
+            dev->xfer.req = NULL;
+        }
+        return -1;
+    }
+
+    /* result is consumed, the request frame goes out of scope */
+    dev->xfer.state = FRONIUS_XFER_IDLE;
+    dev->xfer.req = NULL;
+    if (dev->xfer.ioerror) {
+        errno = dev->xfer.ioerror;
+        return -1;
+    }
+    if (dev->xfer.error != FRONIUS_ERR_NOERROR)
+        return dev->xfer.error;
+
+    /* the header matches the request, only the payload is new */
+    command->length = dev->xfer.response.length;
+    memcpy(command->data, dev->xfer.response.data,
+           command->length + FRONIUS_FL_CHECKSUM);
+    if (dev->cache)
+        fronius_cache_store(dev, command);
+    return FRONIUS_ERR_NOERROR;
+}
 
+/* a broken transport is reported like a missing answer, errno tells why */
 fronius_error_t fronius_cmd_sendrecv(struct fronius_dev *dev,
                                      struct fronius_pkt *command)
 {
-    struct fronius_pkt response;
-    int rv;
-    int i = 0;
+    int rv = fronius_cmd_exchange(dev, command);
 
-    /* send/receive */
-    do {
-        /* leave function if error occurs */
-        if ((rv = fronius_pkt_send(dev, command)) < 0)
-            return rv;          /* XXX: Todo map return value */
-
-        /* receive may timeout... */
-        rv = fronius_pkt_recv(dev, &response);
-    } while (rv == -1 && (errno == ETIMEDOUT || errno == EIO)
-             && i++ < FRONIUS_MAX_RETRIES);
-
-    if (i == FRONIUS_MAX_RETRIES || rv < 0)
-        return FRONIUS_ERR_INVALID_RESPONSE;
-
-    /* validate response */
-    rv = fronius_pkt_iserror(&response);
-    if (rv != FRONIUS_ERR_NOERROR)
-        return rv;
-    if (command->device != response.device ||
-        command->number != response.number ||
-        command->command != response.command)
-        return FRONIUS_ERR_INVALID_RESPONSE;
-
-    /* copy response */
-    memcpy(command, &response, sizeof(response));
-    return FRONIUS_ERR_NOERROR;
+    return rv < 0 ? FRONIUS_ERR_INVALID_RESPONSE : rv;
 }
 
 fronius_error_t fronius_cmd_ic_getversion(struct fronius_dev *dev,
@@ -63,9 +83,9 @@ fronius_error_t fronius_cmd_ic_getversion(struct fronius_dev *dev,
     pkt.command = FRONIUS_CMD_IFCARD_GETVERSION;
 
     /* send, recv & validate */
-    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) < 0)
+    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) != FRONIUS_ERR_NOERROR)
         return rv;
-    if (pkt.length != 4)
+    if (!fronius_cmd_length_ok(pkt.command, pkt.length))
         return FRONIUS_ERR_INVALID_RESPONSE;
 
     /* process answer */
@@ -78,49 +98,6 @@ fronius_error_t fronius_cmd_ic_getversion(struct fronius_dev *dev,
     return FRONIUS_ERR_NOERROR;
 }
 
-struct type_map_entry {
-    uint8_t identification;
-    const char *device;
-    const char *type;
-} devicetype_table[] = {
-    /*  id, device/option                    type                         */
-    { 0xfe, "Fronius IG 15",                 "Inverter"                   },
-    { 0xfd, "Fronius IG 20",                 "Inverter"                   },
-    { 0xfc, "Fronius IG 30",                 "Inverter"                   },
-    { 0xfb, "Fronius IG 30 Dummy",           "Inverter"                   },
-    { 0xfa, "Fronius IG 40",                 "Inverter"                   },
-    { 0xf9, "Fronius IG 60 / IG 60 HV",      "Inverter"                   },
-    { 0xf6, "Fronius IG 300",                "3-phase Inverter"           },
-    { 0xf5, "Fronius IG 400",                "3-phase Inverter"           },
-    { 0xf4, "Fronius IG 500",                "3-phase Inverter"           },
-    { 0xf3, "Fronius IG 60 / IG 60 HV",      "Inverter"                   },
-    { 0xee, "Fronius IG 2000",               "Inverter"                   },
-    { 0xed, "Fronius IG 3000",               "Inverter"                   },
-    { 0xeb, "Fronius IG 4000",               "Inverter"                   },
-    { 0xea, "Fronius IG 5100",               "Inverter"                   },
-    { 0xe5, "Fronius IG 2500-LV",            "Inverter"                   },
-    { 0xe3, "Fronius IG 4500-LV",            "Inverter"                   },
-    { 0xdf, "Fronius IG Plus 11.4-3 Delta",  "3-phase Inverter"           },
-    { 0xde, "Fronius IG Plus 11.4-1 UNI",    "Inverter"                   },
-    { 0xdd, "Fronius IG Plus 10.0-1 UNI",    "Inverter"                   },
-    { 0xdc, "Fronius IG Plus 7.5-1 UNI",     "Inverter"                   },
-    { 0xdb, "Fronius IG Plus 6.0-1 UNI",     "Inverter"                   },
-    { 0xda, "Fronius IG Plus 5.0-1 UNI",     "Inverter"                   },
-    { 0xd9, "Fronius IG Plus 3.8-1 UNI",     "Inverter"                   },
-    { 0xd8, "Fronius IG Plus 3.0-1 UNI",     "Inverter"                   },
-    { 0xd7, "Fronius IG Plus 120-3",         "3-phase Inverter"           },
-    { 0xd6, "Fronius IG Plus 70-2",          "2-phase Inverter"           },
-    { 0xd5, "Fronius IG Plus 70-1",          "Inverter"                   },
-    { 0xd4, "Fronius IG Plus 35-1",          "Inverter"                   },
-    { 0xd3, "Fronius IG Plus 150-3",         "3-phase Inverter"           },
-    { 0xd2, "Fronius IG Plus 100-2",         "2-phase Inverter"           },
-    { 0xd1, "Fronius IG Plus 100-1",         "Inverter"                   },
-    { 0xd0, "Fronius IG Plus 50-1",          "Inverter"                   },
-    { 0xcf, "Fronius IG Plus 12.0-3 WYE277", "Inverter"                   },
-    { 0xfe, "Sensor card / Sensor box",      "DatCom component"           },
-    { 0xff, "Unknown device or option, device or option not active", NULL },
-};
-
 fronius_error_t fronius_cmd_ic_getdevicetype(struct fronius_dev *dev,
                                              uint8_t device,
                                              uint8_t number,
@@ -129,7 +106,6 @@ fronius_error_t fronius_cmd_ic_getdevicetype(struct fronius_dev *dev,
 {
     struct fronius_pkt pkt;
     int rv;
-    struct type_map_entry *p = devicetype_table;
 
     /* prepare pkt */
     fronius_pkt_init(&pkt);
@@ -138,27 +114,22 @@ fronius_error_t fronius_cmd_ic_getdevicetype(struct fronius_dev *dev,
     pkt.command = FRONIUS_CMD_IFCARD_GETDEVICETYPE;
 
     /* send, recv & validate */
-    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) < 0)
+    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) != FRONIUS_ERR_NOERROR)
         return rv;
-    if (pkt.length > 1)
+    if (!fronius_cmd_length_ok(pkt.command, pkt.length))
         return FRONIUS_ERR_INVALID_RESPONSE;
 
     /* process answer */
-    for (;
-         (p->identification != pkt.data[0]) && (p->identification != 0xff);
-         p++);
-
     if (device_name)
-        *device_name = p->device;
+        *device_name = fronius_device_name(device, pkt.data[0]);
     if (device_type)
-        *device_type = p->type;
+        *device_type = fronius_device_type(device, pkt.data[0]);
 
     return FRONIUS_ERR_NOERROR;
 }
 
 static fronius_error_t fronius_cmd_ic_querylist(struct fronius_dev *dev,
                                                 uint8_t cmd,
-                                                int maxlistsize,
                                                 char *list, size_t size)
 {
     struct fronius_pkt pkt;
@@ -169,9 +140,9 @@ static fronius_error_t fronius_cmd_ic_querylist(struct fronius_dev *dev,
     pkt.command = cmd;
 
     /* send, recv & validate */
-    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) < 0)
+    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) != FRONIUS_ERR_NOERROR)
         return rv;
-    if (pkt.length > maxlistsize)
+    if (!fronius_cmd_length_ok(pkt.command, pkt.length))
         return FRONIUS_ERR_INVALID_RESPONSE;
 
     /* process answer */
@@ -186,7 +157,7 @@ fronius_error_t fronius_cmd_ic_getactiveinverters(struct fronius_dev *dev,
 {
     return fronius_cmd_ic_querylist(dev,
                                     FRONIUS_CMD_IFCARD_GETACTIVEINVERTERS,
-                                    100, list, size);
+                                    list, size);
 }
 
 fronius_error_t fronius_cmd_ic_getactivesensors(struct fronius_dev *dev,
@@ -194,7 +165,7 @@ fronius_error_t fronius_cmd_ic_getactivesensors(struct fronius_dev *dev,
 {
     return fronius_cmd_ic_querylist(dev,
                                     FRONIUS_CMD_IFCARD_GETACTIVESENSORS,
-                                    10, list, size);
+                                    list, size);
 }
 
 fronius_error_t fronius_cmd_iv_getpowernow(struct fronius_dev *dev,
@@ -210,9 +181,9 @@ fronius_error_t fronius_cmd_iv_getpowernow(struct fronius_dev *dev,
     pkt.command = FRONIUS_CMD_INVERTER_GETPOWERNOW;
 
     /* send, recv & validate */
-    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) < 0)
+    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) != FRONIUS_ERR_NOERROR)
         return rv;
-    if (pkt.length > 3)
+    if (!fronius_cmd_length_ok(pkt.command, pkt.length))
         return FRONIUS_ERR_INVALID_RESPONSE;
 
     /* process answer */
@@ -222,29 +193,34 @@ fronius_error_t fronius_cmd_iv_getpowernow(struct fronius_dev *dev,
     return FRONIUS_ERR_NOERROR;
 }
 
-fronius_error_t fronius_get_value(struct fronius_pkt *pkt, double *value)
+fronius_error_t fronius_cmd_iv_getvalue(struct fronius_dev *dev,
+                                        unsigned char cmd, double *value)
 {
-    signed char e = pkt->data[2];
+    struct fronius_pkt pkt;
+    int rv;
+    double val;
 
-    if (e == FRONIUS_VALUE_OVERFLOW)
-        return FRONIUS_ERR_VALUE_OVERFLOW;
+    fronius_pkt_init(&pkt);
 
-    if (e == FRONIUS_VALUE_UNDERFLOW)
-        return FRONIUS_ERR_VALUE_UNDERFLOW;
+    pkt.device = FRONIUS_DEVICE_INVERTER;
+    pkt.number = 1;
+    pkt.command = cmd;
 
-    if (value)
-        *value = (pkt->data[0] << 8 | pkt->data[1]) * pow(10, e);
+    /* send, recv & validate */
+    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) != FRONIUS_ERR_NOERROR)
+        return rv;
+    if (!fronius_cmd_length_ok(pkt.command, pkt.length))
+        return FRONIUS_ERR_INVALID_RESPONSE;
 
-    return FRONIUS_ERR_NOERROR;
+    return fronius_get_value(&pkt, value);
 }
 
-
-fronius_error_t fronius_cmd_iv_getvalue(struct fronius_dev *dev,
-                                        unsigned char cmd, double *value)
+fronius_error_t fronius_cmd_iv_getfixed(struct fronius_dev *dev,
+                                        unsigned char cmd,
+                                        struct fronius_fixed *fixed)
 {
     struct fronius_pkt pkt;
     int rv;
-    double val;
 
     fronius_pkt_init(&pkt);
 
@@ -253,10 +229,65 @@ fronius_error_t fronius_cmd_iv_getvalue(struct fronius_dev *dev,
     pkt.command = cmd;
 
     /* send, recv & validate */
-    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) < 0)
+    if ((rv = fronius_cmd_sendrecv(dev, &pkt)) != FRONIUS_ERR_NOERROR)
         return rv;
-    if (pkt.length > 3)
+    if (!fronius_cmd_length_ok(pkt.command, pkt.length))
         return FRONIUS_ERR_INVALID_RESPONSE;
 
-    return fronius_get_value(&pkt, value);
+    return fronius_fixed_decode(pkt.data, fixed);
+}
+
+/* fill in both representations of a value */
+static fronius_error_t fronius_cmd_decode(const uint8_t *data,
+                                          struct fronius_value *result)
+{
+    fronius_error_t rv;
+
+    if ((rv = fronius_fixed_decode(data, &result->fixed)))
+        return rv;
+
+    return fronius_decode_value(data, &result->value);
+}
+
+fronius_error_t fronius_cmd_iv_getvalues(struct fronius_dev *dev,
+                                         uint8_t device, uint8_t number,
+                                         const uint8_t *cmds, size_t n,
+                                         struct fronius_value *results)
+{
+    struct fronius_pkt pkt;
+    size_t i;
+    int rv;
+
+    /* the header is the same for all requests of the batch, so build it
+       once and only exchange the command */
+    fronius_pkt_init(&pkt);
+    pkt.device = device;
+    pkt.number = number;
+
+    /* values not queried, e.g. after the transport broke, have none */
+    for (i = 0; i < n; ++i) {
+        results[i].error = FRONIUS_ERR_INVALID_RESPONSE;
+        results[i].value = 0.0;
+        results[i].fixed.mantissa = 0;
+        results[i].fixed.exponent = 0;
+    }
+
+    for (i = 0; i < n; ++i) {
+        pkt.command = cmds[i];
+        pkt.length = 0;
+
+        /* send, recv & validate */
+        if ((rv = fronius_cmd_exchange(dev, &pkt)) < 0)
+            return FRONIUS_ERR_INVALID_RESPONSE;
+
+        /* decode in place, a failed value does not abort the batch */
+        if (rv != FRONIUS_ERR_NOERROR)
+            results[i].error = rv;
+        else if (!fronius_cmd_length_ok(pkt.command, pkt.length))
+            results[i].error = FRONIUS_ERR_INVALID_RESPONSE;
+        else
+            results[i].error = fronius_cmd_decode(pkt.data, &results[i]);
+    }
+
+    return FRONIUS_ERR_NOERROR;
 }
@@ -0,0 +1,657 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * A scrape is answered from what the sampler and the device counters hold
+ * in memory, the bus is never touched. The label sets of all columns and
+ * the histogram bounds are formatted once when the exporter is created;
+ * a scrape only appends numbers to them in a buffer allocated up front.
+ * Scrapes arriving together share one rendering, and a rendering is kept
+ * as long as a slow client is still reading it, so the cost does not grow
+ * with the number of scrapers.
+ */
+
+/* concurrent connections, more are closed right away */
+#define FRONIUS_EXPORTER_CONNS		8
+/* idle or slow connections are dropped after this many ms */
+#define FRONIUS_EXPORTER_TIMEOUT	5000
+#define FRONIUS_EXPORTER_REQUEST	1024
+/* room for the number and the newline appended to a line */
+#define FRONIUS_EXPORTER_NUMBER		48
+
+enum fronius_exporter_state {
+    FRONIUS_CONN_FREE,
+    FRONIUS_CONN_READ,
+    FRONIUS_CONN_WRITE,
+};
+
+struct fronius_conn {
+	int				fd;
+	enum fronius_exporter_state	state;
+	int64_t				deadline;
+	char				request[FRONIUS_EXPORTER_REQUEST];
+	size_t				rxlen;
+	/* response: status line and headers, then the body */
+	char				header[192];
+	size_t				hdrlen;
+	const char			*body;
+	size_t				bodylen;
+	size_t				off;
+	/* reading the shared rendering */
+	int				shared;
+};
+
+struct fronius_exporter {
+	struct fronius_dev	*dev;
+	struct fronius_sampler	*sampler;
+	int			epfd;
+	int			lfd;
+	char			path[108];
+	struct fronius_conn	conns[FRONIUS_EXPORTER_CONNS];
+
+	/* label set of every sampler column, {device="inverter",...} */
+	char			*labels;
+	size_t			*label_off;
+	/* bucket lines of the latency histogram up to the count */
+	char			le[FRONIUS_HIST_BUCKETS][64];
+
+	/* rendering, its connections still reading it and whether it was
+	   made during the current call of fronius_exporter_process() */
+	char			*body;
+	size_t			size, len;
+	int			readers;
+	int			fresh;
+};
+
+static const char fronius_exporter_notfound[] = "Not Found\n";
+static const char fronius_exporter_badmethod[] = "Method Not Allowed\n";
+
+static int64_t fronius_exporter_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void fronius_exporter_puts(struct fronius_exporter *e, const char *s)
+{
+    size_t n = strlen(s);
+
+    if (n > e->size - e->len)
+        n = e->size - e->len;
+    memcpy(e->body + e->len, s, n);
+    e->len += n;
+}
+
+static void fronius_exporter_printf(struct fronius_exporter *e,
+                                    const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(e->body + e->len, e->size - e->len, fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+        e->len += (size_t) n < e->size - e->len ? (size_t) n :
+                  e->size - e->len - 1;
+}
+
+static void fronius_exporter_counter(struct fronius_exporter *e,
+                                     const char *name, const char *help,
+                                     uint64_t value)
+{
+    fronius_exporter_printf(e, "# TYPE %s counter\n# HELP %s %s\n"
+                            "%s_total %" PRIu64 "\n",
+                            name, name, help, name, value);
+}
+
+static void fronius_exporter_render(struct fronius_exporter *e)
+{
+    struct fronius_stats st;
+    struct fronius_sampler_stats ss;
+    struct timespec ts;
+    fronius_error_t error;
+    int64_t now, time;
+    uint64_t cum = 0;
+    double value;
+    size_t i, n = 0;
+
+    e->len = 0;
+
+    if (e->sampler) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        now = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        n = fronius_sampler_ncolumns(e->sampler);
+
+        fronius_exporter_puts(e, "# TYPE fronius_value gauge\n"
+                              "# HELP fronius_value Latest valid sample\n");
+        for (i = 0; i < n; ++i) {
+            if (!fronius_sampler_last(e->sampler, i, &time, &value, &error) ||
+                error != FRONIUS_ERR_NOERROR)
+                continue;
+            fronius_exporter_puts(e, "fronius_value");
+            fronius_exporter_puts(e, e->labels + e->label_off[i]);
+            fronius_exporter_printf(e, " %.10g\n", value);
+        }
+
+        fronius_exporter_puts(e, "# TYPE fronius_value_age_seconds gauge\n"
+                              "# HELP fronius_value_age_seconds "
+                              "Time since the latest sample\n");
+        for (i = 0; i < n; ++i) {
+            if (!fronius_sampler_last(e->sampler, i, &time, &value, &error))
+                continue;
+            fronius_exporter_puts(e, "fronius_value_age_seconds");
+            fronius_exporter_puts(e, e->labels + e->label_off[i]);
+            fronius_exporter_printf(e, " %.3f\n", (now - time) / 1000.0);
+        }
+
+        fronius_exporter_puts(e, "# TYPE fronius_value_status gauge\n"
+                              "# HELP fronius_value_status "
+                              "Error code of the latest sample\n");
+        for (i = 0; i < n; ++i) {
+            if (!fronius_sampler_last(e->sampler, i, &time, &value, &error))
+                continue;
+            fronius_exporter_puts(e, "fronius_value_status");
+            fronius_exporter_puts(e, e->labels + e->label_off[i]);
+            fronius_exporter_printf(e, " %d\n", error);
+        }
+
+        fronius_sampler_stats(e->sampler, &ss);
+        fronius_exporter_counter(e, "fronius_sampler_samples",
+                                 "Samples taken", ss.samples);
+        fronius_exporter_counter(e, "fronius_sampler_errors",
+                                 "Samples failed", ss.errors);
+        fronius_exporter_counter(e, "fronius_sampler_missed",
+                                 "Sampling periods skipped", ss.missed);
+    }
+
+    fronius_stats(e->dev, &st);
+    fronius_exporter_counter(e, "fronius_requests", "Completed requests",
+                             st.requests);
+    fronius_exporter_counter(e, "fronius_timeouts",
+                             "Expired receive timeouts", st.timeouts);
+    fronius_exporter_counter(e, "fronius_retries", "Retransmissions",
+                             st.retries);
+    fronius_exporter_counter(e, "fronius_resyncs",
+                             "Losses of frame synchronisation", st.resyncs);
+    fronius_exporter_counter(e, "fronius_checksum_errors",
+                             "Frames with a bad checksum",
+                             st.checksum_errors);
+    fronius_exporter_counter(e, "fronius_reconnects",
+                             "Network connections re-established",
+                             st.reconnects);
+    fronius_exporter_counter(e, "fronius_sent_bytes", "Bytes sent",
+                             st.bytes_sent);
+    fronius_exporter_counter(e, "fronius_received_bytes", "Bytes received",
+                             st.bytes_received);
+
+    fronius_exporter_puts(e, "# TYPE fronius_request_errors counter\n"
+                          "# HELP fronius_request_errors "
+                          "Completed requests per error code\n");
+    for (i = 0; i < FRONIUS_STATS_ERRORS; ++i)
+        if (st.errors[i])
+            fronius_exporter_printf(e, "fronius_request_errors_total"
+                                    "{code=\"%zu\"} %" PRIu64 "\n",
+                                    i, st.errors[i]);
+
+    fronius_exporter_puts(e, "# TYPE fronius_request_latency_seconds "
+                          "histogram\n"
+                          "# HELP fronius_request_latency_seconds "
+                          "Request latency from submission to completion\n");
+    for (i = 0; i < FRONIUS_HIST_BUCKETS; ++i) {
+        cum += st.latency.buckets[i];
+        /* empty leading buckets add nothing */
+        if (!cum && i < FRONIUS_HIST_BUCKETS - 1)
+            continue;
+        fronius_exporter_puts(e, e->le[i]);
+        fronius_exporter_printf(e, "%" PRIu64 "\n", cum);
+    }
+    fronius_exporter_printf(e, "fronius_request_latency_seconds_count %"
+                            PRIu64 "\n"
+                            "fronius_request_latency_seconds_sum %.6f\n",
+                            st.latency.count, st.latency.sum / 1e6);
+
+    /* the buffer has room for this in any case */
+    e->len = e->len < e->size - 7 ? e->len : e->size - 7;
+    memcpy(e->body + e->len, "# EOF\n", 6);
+    e->len += 6;
+}
+
+static void fronius_exporter_close(struct fronius_exporter *e,
+                                   struct fronius_conn *c)
+{
+    if (c->shared)
+        e->readers--;
+    close(c->fd);
+    c->fd = -1;
+    c->shared = 0;
+    c->state = FRONIUS_CONN_FREE;
+}
+
+static void fronius_exporter_respond(struct fronius_exporter *e,
+                                     struct fronius_conn *c)
+{
+    struct epoll_event ev;
+    const char *status, *type = "application/openmetrics-text; "
+                                "version=1.0.0; charset=utf-8";
+
+    if (!strncmp(c->request, "GET /metrics ", 13) ||
+        !strncmp(c->request, "GET / ", 6)) {
+        /* one rendering per call serves all scrapes, and it cannot
+           change while a client is still reading it */
+        if (!e->fresh && !e->readers) {
+            fronius_exporter_render(e);
+            e->fresh = 1;
+        }
+        status = "200 OK";
+        c->body = e->body;
+        c->bodylen = e->len;
+        c->shared = 1;
+        e->readers++;
+    } else {
+        type = "text/plain";
+        if (strncmp(c->request, "GET ", 4)) {
+            status = "405 Method Not Allowed";
+            c->body = fronius_exporter_badmethod;
+            c->bodylen = sizeof(fronius_exporter_badmethod) - 1;
+        } else {
+            status = "404 Not Found";
+            c->body = fronius_exporter_notfound;
+            c->bodylen = sizeof(fronius_exporter_notfound) - 1;
+        }
+    }
+
+    c->hdrlen = snprintf(c->header, sizeof(c->header),
+                         "HTTP/1.1 %s\r\n"
+                         "Content-Type: %s\r\n"
+                         "Content-Length: %zu\r\n"
+                         "Connection: close\r\n\r\n",
+                         status, type, c->bodylen);
+    c->off = 0;
+    c->state = FRONIUS_CONN_WRITE;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(e->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void fronius_exporter_read(struct fronius_exporter *e,
+                                  struct fronius_conn *c)
+{
+    ssize_t rv;
+
+    rv = recv(c->fd, c->request + c->rxlen,
+              sizeof(c->request) - 1 - c->rxlen, 0);
+    if (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                     errno == EINTR))
+        return;
+    if (rv <= 0) {
+        fronius_exporter_close(e, c);
+        return;
+    }
+
+    c->rxlen += rv;
+    c->request[c->rxlen] = '\0';
+
+    /* the request line is all that matters, but the headers have to be
+       there before the response may be sent */
+    if (strstr(c->request, "\r\n\r\n") || strstr(c->request, "\n\n"))
+        fronius_exporter_respond(e, c);
+    else if (c->rxlen == sizeof(c->request) - 1)
+        fronius_exporter_close(e, c);
+}
+
+static void fronius_exporter_write(struct fronius_exporter *e,
+                                   struct fronius_conn *c)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t total = c->hdrlen + c->bodylen;
+    ssize_t rv;
+    int n = 0;
+
+    if (c->off < c->hdrlen) {
+        iov[n].iov_base = c->header + c->off;
+        iov[n++].iov_len = c->hdrlen - c->off;
+    }
+    iov[n].iov_base = (char *) c->body + (c->off > c->hdrlen ?
+                                          c->off - c->hdrlen : 0);
+    iov[n].iov_len = c->bodylen - (c->off > c->hdrlen ?
+                                   c->off - c->hdrlen : 0);
+    n++;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    rv = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if (rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                     errno == EINTR))
+        return;
+    if (rv == -1) {
+        fronius_exporter_close(e, c);
+        return;
+    }
+
+    c->off += rv;
+    if (c->off == total)
+        fronius_exporter_close(e, c);
+}
+
+static void fronius_exporter_accept(struct fronius_exporter *e)
+{
+    struct epoll_event ev;
+    struct fronius_conn *c;
+    int fd, i;
+
+    while ((fd = accept(e->lfd, NULL, NULL)) != -1) {
+        if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1 ||
+            fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+            close(fd);
+            continue;
+        }
+
+        for (i = 0, c = NULL; i < FRONIUS_EXPORTER_CONNS; ++i)
+            if (e->conns[i].state == FRONIUS_CONN_FREE) {
+                c = &e->conns[i];
+                break;
+            }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (!c || epoll_ctl(e->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        c->state = FRONIUS_CONN_READ;
+        c->rxlen = 0;
+        c->deadline = fronius_exporter_now() + FRONIUS_EXPORTER_TIMEOUT;
+    }
+}
+
+int fronius_exporter_process(struct fronius_exporter *e)
+{
+    struct epoll_event evs[FRONIUS_EXPORTER_CONNS + 1];
+    struct fronius_conn *c;
+    int64_t now;
+    int i, n;
+
+    n = epoll_wait(e->epfd, evs, FRONIUS_EXPORTER_CONNS + 1, 0);
+    if (n == -1)
+        return errno == EINTR ? 0 : -1;
+
+    e->fresh = 0;
+
+    for (i = 0; i < n; ++i) {
+        c = evs[i].data.ptr;
+        if (!c)
+            fronius_exporter_accept(e);
+        else if (c->state == FRONIUS_CONN_READ)
+            fronius_exporter_read(e, c);
+        else if (c->state == FRONIUS_CONN_WRITE)
+            fronius_exporter_write(e, c);
+    }
+
+    now = fronius_exporter_now();
+    for (i = 0; i < FRONIUS_EXPORTER_CONNS; ++i) {
+        c = &e->conns[i];
+        if (c->state != FRONIUS_CONN_FREE && now >= c->deadline)
+            fronius_exporter_close(e, c);
+    }
+
+    return 0;
+}
+
+int fronius_exporter_fd(struct fronius_exporter *e)
+{
+    return e->epfd;
+}
+
+static int fronius_exporter_listen(struct fronius_exporter *e,
+                                   const char *address)
+{
+    struct addrinfo hints, *res, *ai;
+    struct sockaddr_un sun;
+    struct stat sb;
+    char host[255];
+    const char *port;
+    int one = 1;
+
+    if (!strncmp(address, "unix://", 7)) {
+        address += 7;
+        if (strlen(address) >= sizeof(sun.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, address);
+
+        /* a socket left over by an earlier run is in the way */
+        if (!stat(address, &sb) && S_ISSOCK(sb.st_mode))
+            unlink(address);
+
+        e->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+        if (e->lfd == -1)
+            return -1;
+        if (bind(e->lfd, (struct sockaddr *) &sun, sizeof(sun)) == -1)
+            return -1;
+        strcpy(e->path, address);
+
+        return listen(e->lfd, FRONIUS_EXPORTER_CONNS);
+    }
+
+    if (strncmp(address, "tcp://", 6)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    address += 6;
+    port = strrchr(address, ':');
+    if (!port || !port[1] || (size_t) (port - address) >= sizeof(host)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+    port++;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res)) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        e->lfd = socket(ai->ai_family,
+                        ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        ai->ai_protocol);
+        if (e->lfd == -1)
+            continue;
+
+        setsockopt(e->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (!bind(e->lfd, ai->ai_addr, ai->ai_addrlen) &&
+            !listen(e->lfd, FRONIUS_EXPORTER_CONNS))
+            break;
+
+        close(e->lfd);
+        e->lfd = -1;
+    }
+
+    freeaddrinfo(res);
+
+    return e->lfd == -1 ? -1 : 0;
+}
+
+/* format the label set of a column, returns its length */
+static int fronius_exporter_label(struct fronius_exporter *e, size_t i,
+                                  char *buf, size_t size)
+{
+    const struct fronius_pkt *frame = fronius_sampler_frame(e->sampler, i);
+    const char *name = fronius_cmd_name(frame->command);
+    const char *device = frame->device == FRONIUS_DEVICE_SENSORCARD ?
+                         "sensorcard" : "inverter";
+
+    if (!name)
+        return snprintf(buf, size, "{device=\"%s\",number=\"%u\","
+                        "command=\"0x%02x\",unit=\"\"}",
+                        device, frame->number, frame->command);
+
+    return snprintf(buf, size, "{device=\"%s\",number=\"%u\","
+                    "command=\"%s\",unit=\"%s\"}",
+                    device, frame->number, name,
+                    fronius_unit_name(fronius_cmd_unit(frame->command)));
+}
+
+/* format the label sets and size the rendering buffer */
+static int fronius_exporter_prepare(struct fronius_exporter *e)
+{
+    size_t i, n = 0, len = 0;
+
+    if (e->sampler)
+        n = fronius_sampler_ncolumns(e->sampler);
+
+    e->label_off = malloc((n ? n : 1) * sizeof(*e->label_off));
+    if (!e->label_off)
+        return -1;
+
+    for (i = 0; i < n; ++i) {
+        e->label_off[i] = len;
+        len += fronius_exporter_label(e, i, NULL, 0) + 1;
+    }
+
+    e->labels = malloc(len ? len : 1);
+    if (!e->labels)
+        return -1;
+
+    for (i = 0; i < n; ++i)
+        fronius_exporter_label(e, i, e->labels + e->label_off[i],
+                               len - e->label_off[i]);
+
+    for (i = 0; i < FRONIUS_HIST_BUCKETS - 1; ++i)
+        snprintf(e->le[i], sizeof(e->le[i]),
+                 "fronius_request_latency_seconds_bucket{le=\"%g\"} ",
+                 fronius_hist_bucket(i + 1) / 1e6);
+    snprintf(e->le[i], sizeof(e->le[i]),
+             "fronius_request_latency_seconds_bucket{le=\"+Inf\"} ");
+
+    /* three lines per column, the counters and the histogram */
+    e->size = 3 * (len + n * (sizeof("fronius_value_age_seconds") +
+                              FRONIUS_EXPORTER_NUMBER)) +
+              FRONIUS_HIST_BUCKETS * (sizeof(e->le[0]) +
+                                      FRONIUS_EXPORTER_NUMBER) +
+              FRONIUS_STATS_ERRORS * 80 + 4096;
+    e->body = malloc(e->size);
+
+    return e->body ? 0 : -1;
+}
+
+struct fronius_exporter *fronius_exporter_new(struct fronius_dev *dev,
+                                              struct fronius_sampler *sampler,
+                                              const char *address)
+{
+    struct fronius_exporter *e;
+    struct epoll_event ev;
+    int saved, i;
+
+    if (!dev && sampler)
+        dev = fronius_sampler_dev(sampler);
+    if (!dev) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+
+    e->dev = dev;
+    e->sampler = sampler;
+    e->lfd = -1;
+    for (i = 0; i < FRONIUS_EXPORTER_CONNS; ++i)
+        e->conns[i].fd = -1;
+
+    e->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (e->epfd == -1)
+        goto fail;
+
+    if (fronius_exporter_prepare(e) < 0 ||
+        fronius_exporter_listen(e, address) < 0)
+        goto fail;
+
+    /* the listening socket is the only entry without a connection */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, e->lfd, &ev) == -1)
+        goto fail;
+
+    return e;
+
+fail:
+    saved = errno;
+    fronius_exporter_free(e);
+    errno = saved;
+    return NULL;
+}
+
+void fronius_exporter_free(struct fronius_exporter *e)
+{
+    int i;
+
+    if (!e)
+        return;
+
+    for (i = 0; i < FRONIUS_EXPORTER_CONNS; ++i)
+        if (e->conns[i].state != FRONIUS_CONN_FREE)
+            fronius_exporter_close(e, &e->conns[i]);
+
+    if (e->lfd != -1)
+        close(e->lfd);
+    if (e->path[0])
+        unlink(e->path);
+    if (e->epfd != -1)
+        close(e->epfd);
+
+    free(e->labels);
+    free(e->label_off);
+    free(e->body);
+    free(e);
+}
@@ -0,0 +1,462 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * Receive deadlines are kept in a hashed timer wheel with a resolution of
+ * one millisecond. The wheel spans more than the longest receive timeout,
+ * so a deadline normally expires on its first visit; longer ones are put
+ * back until they are due. A bitmap of occupied slots finds the next
+ * deadline without walking empty slots.
+ */
+
+#define FRONIUS_MUX_WHEEL	4096	/* slots of 1 ms, power of two */
+#define FRONIUS_MUX_EVENTS	64	/* events taken per epoll_wait() */
+
+struct fronius_mux_entry {
+	struct fronius_mux		*mux;
+	/* NULL once the device was removed */
+	struct fronius_dev		*dev;
+	struct fronius_mux_entry	*next;
+	/* link in the list of entries to bring up to date */
+	struct fronius_mux_entry	*pnext;
+	int				pending;
+	/* events registered with epoll, request in flight */
+	int				events;
+	int				busy;
+	/* errno of the latest failure, 0 if none */
+	int				error;
+	/* generation of the device's descriptor, another open file behind
+	   it has to be registered anew */
+	unsigned int			fdgen;
+	/* timer wheel linkage and deadline in ms, -1 if not armed; the slot
+	   differs from the deadline's one if that is out of the wheel span */
+	struct fronius_mux_entry	*tnext, **tpprev;
+	int64_t				deadline;
+	unsigned int			slot;
+};
+
+struct fronius_mux {
+	int				epfd;
+	struct fronius_mux_entry	*entries;
+	/* entries whose device started a request since they were updated */
+	struct fronius_mux_entry	*pending;
+	/* entries removed while a run is in progress, freed at its end */
+	struct fronius_mux_entry	*dead;
+	int				running;
+	/* devices with a request in flight */
+	int				busy;
+	/* last millisecond the wheel was processed for */
+	int64_t				tick;
+	struct fronius_mux_entry	*wheel[FRONIUS_MUX_WHEEL];
+	uint64_t			occupied[FRONIUS_MUX_WHEEL / 64];
+};
+
+static int64_t fronius_mux_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void fronius_mux_timer_del(struct fronius_mux *mux,
+                                  struct fronius_mux_entry *e)
+{
+    unsigned int slot;
+
+    if (e->deadline < 0)
+        return;
+
+    *e->tpprev = e->tnext;
+    if (e->tnext)
+        e->tnext->tpprev = e->tpprev;
+
+    slot = e->slot;
+    if (!mux->wheel[slot])
+        mux->occupied[slot / 64] &= ~(1ULL << (slot % 64));
+
+    e->deadline = -1;
+}
+
+static void fronius_mux_timer_add(struct fronius_mux *mux,
+                                  struct fronius_mux_entry *e,
+                                  int64_t deadline)
+{
+    int64_t due = deadline;
+    unsigned int slot;
+
+    /* the slot is never behind the wheel position and never more than a
+       lap ahead; a later deadline is put back on expiry */
+    if (due <= mux->tick)
+        due = mux->tick + 1;
+    if (due >= mux->tick + FRONIUS_MUX_WHEEL)
+        due = mux->tick + FRONIUS_MUX_WHEEL - 1;
+
+    slot = due & (FRONIUS_MUX_WHEEL - 1);
+    e->deadline = deadline;
+    e->slot = slot;
+    e->tnext = mux->wheel[slot];
+    if (e->tnext)
+        e->tnext->tpprev = &e->tnext;
+    e->tpprev = &mux->wheel[slot];
+    mux->wheel[slot] = e;
+    mux->occupied[slot / 64] |= 1ULL << (slot % 64);
+}
+
+/* milliseconds until the next occupied slot, -1 if there is none */
+static int fronius_mux_timer_next(struct fronius_mux *mux, int64_t now)
+{
+    unsigned int start = (mux->tick + 1) & (FRONIUS_MUX_WHEEL - 1);
+    unsigned int i, word, slot;
+    uint64_t bits;
+
+    for (i = 0; i <= FRONIUS_MUX_WHEEL / 64; ++i) {
+        word = (start / 64 + i) % (FRONIUS_MUX_WHEEL / 64);
+        bits = mux->occupied[word];
+        /* skip the slots before the start in its own word */
+        if (i == 0)
+            bits &= ~0ULL << (start % 64);
+        if (!bits)
+            continue;
+
+        slot = word * 64 + __builtin_ctzll(bits);
+        slot = (slot - start) & (FRONIUS_MUX_WHEEL - 1);
+        return mux->tick + 1 + slot > now ? mux->tick + 1 + slot - now : 0;
+    }
+
+    return -1;
+}
+
+/* bring epoll registration and deadline in line with the device state */
+static int fronius_mux_update(struct fronius_mux *mux,
+                              struct fronius_mux_entry *e)
+{
+    struct epoll_event ev;
+    int events = fronius_events(e->dev);
+    int timeout = fronius_timeout(e->dev);
+    int op, rv;
+
+    mux->busy += (events != 0) - e->busy;
+    e->busy = events != 0;
+
+    /* closing the old file behind the descriptor took it out of the epoll
+       set, unless it is still open elsewhere */
+    if (e->dev->fdgen != e->fdgen) {
+        e->fdgen = e->dev->fdgen;
+        e->events = 0;
+    }
+
+    /* idle devices are not registered at all, so that a hangup of an
+       idle connection does not wake us over and over again */
+    if (events != e->events) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = (events & POLLIN ? EPOLLIN : 0) |
+                    (events & POLLOUT ? EPOLLOUT : 0);
+        ev.data.ptr = e;
+        op = !events ? EPOLL_CTL_DEL : e->events ? EPOLL_CTL_MOD :
+                                                   EPOLL_CTL_ADD;
+        rv = epoll_ctl(mux->epfd, op, fronius_fd(e->dev), &ev);
+        if (rv == -1 && op == EPOLL_CTL_ADD && errno == EEXIST)
+            rv = epoll_ctl(mux->epfd, EPOLL_CTL_MOD, fronius_fd(e->dev), &ev);
+        if (rv == -1)
+            return -1;
+        e->events = events;
+    }
+
+    fronius_mux_timer_del(mux, e);
+    if (timeout >= 0)
+        fronius_mux_timer_add(mux, e, fronius_mux_now() + timeout);
+
+    return 0;
+}
+
+void fronius_mux_touch(struct fronius_mux_entry *e)
+{
+    if (e->pending)
+        return;
+
+    e->pending = 1;
+    e->pnext = e->mux->pending;
+    e->mux->pending = e;
+}
+
+/* update the entries of requests started outside of the multiplexer */
+static void fronius_mux_flush(struct fronius_mux *mux)
+{
+    struct fronius_mux_entry *e;
+
+    while ((e = mux->pending)) {
+        mux->pending = e->pnext;
+        e->pending = 0;
+        if (fronius_mux_update(mux, e) < 0)
+            e->error = errno;
+    }
+}
+
+static int fronius_mux_process(struct fronius_mux *mux,
+                               struct fronius_mux_entry *e, int revents)
+{
+    int rv = fronius_process(e->dev, revents);
+
+    if (rv < 0)
+        e->error = errno;
+
+    /* the completion callback may have removed the device */
+    if (!e->dev)
+        return rv;
+
+    /* or submitted the next request */
+    if (fronius_mux_update(mux, e) < 0) {
+        e->error = errno;
+        return -1;
+    }
+
+    return rv;
+}
+
+/* process all deadlines up to now */
+static int fronius_mux_expire(struct fronius_mux *mux, int64_t now)
+{
+    struct fronius_mux_entry *e, *list;
+    unsigned int slot;
+    int completed = 0;
+
+    /* after a long pause every slot has to be visited only once */
+    if (now - mux->tick > FRONIUS_MUX_WHEEL)
+        mux->tick = now - FRONIUS_MUX_WHEEL;
+
+    while (mux->tick < now) {
+        mux->tick++;
+        slot = mux->tick & (FRONIUS_MUX_WHEEL - 1);
+
+        /* detach the slot, entries may be re-armed into it; callbacks may
+           remove entries which are still on the detached list */
+        list = mux->wheel[slot];
+        mux->wheel[slot] = NULL;
+        mux->occupied[slot / 64] &= ~(1ULL << (slot % 64));
+        if (list)
+            list->tpprev = &list;
+
+        while ((e = list)) {
+            list = e->tnext;
+            if (list)
+                list->tpprev = &list;
+
+            if (e->deadline > now) {
+                /* more than a lap ahead */
+                int64_t deadline = e->deadline;
+
+                e->deadline = -1;
+                fronius_mux_timer_add(mux, e, deadline);
+                continue;
+            }
+
+            e->deadline = -1;
+            if (fronius_mux_process(mux, e, 0) > 0)
+                completed++;
+        }
+    }
+
+    return completed;
+}
+
+struct fronius_mux *fronius_mux_new(void)
+{
+    struct fronius_mux *mux;
+
+    mux = calloc(1, sizeof(*mux));
+    if (!mux)
+        return NULL;
+
+    mux->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (mux->epfd == -1) {
+        free(mux);
+        return NULL;
+    }
+
+    mux->tick = fronius_mux_now();
+
+    return mux;
+}
+
+/* free the entries removed during a run */
+static void fronius_mux_reap(struct fronius_mux *mux)
+{
+    struct fronius_mux_entry *e;
+
+    while ((e = mux->dead)) {
+        mux->dead = e->next;
+        free(e);
+    }
+}
+
+void fronius_mux_free(struct fronius_mux *mux)
+{
+    struct fronius_mux_entry *e;
+
+    while ((e = mux->entries)) {
+        mux->entries = e->next;
+        e->dev->mux_entry = NULL;
+        free(e);
+    }
+    fronius_mux_reap(mux);
+
+    close(mux->epfd);
+    free(mux);
+}
+
+int fronius_mux_add(struct fronius_mux *mux, struct fronius_dev *dev)
+{
+    struct fronius_mux_entry *e;
+
+    /* readiness is only known for devices with a descriptor */
+    if (fronius_fd(dev) == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* starting a request has to find the one entry of the device */
+    if (dev->mux_entry) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return -1;
+
+    e->mux = mux;
+    e->dev = dev;
+    e->deadline = -1;
+    e->fdgen = dev->fdgen;
+
+    if (fronius_mux_update(mux, e) == -1) {
+        mux->busy -= e->busy;
+        free(e);
+        return -1;
+    }
+
+    e->next = mux->entries;
+    mux->entries = e;
+    dev->mux_entry = e;
+
+    return 0;
+}
+
+int fronius_mux_del(struct fronius_mux *mux, struct fronius_dev *dev)
+{
+    struct fronius_mux_entry **pe, *e = dev->mux_entry;
+
+    if (!e || e->mux != mux) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    for (pe = &mux->entries; *pe != e; pe = &(*pe)->next);
+    *pe = e->next;
+
+    if (e->pending) {
+        for (pe = &mux->pending; *pe != e; pe = &(*pe)->pnext);
+        *pe = e->pnext;
+    }
+
+    fronius_mux_timer_del(mux, e);
+    if (e->events)
+        epoll_ctl(mux->epfd, EPOLL_CTL_DEL, fronius_fd(dev), NULL);
+    mux->busy -= e->busy;
+    dev->mux_entry = NULL;
+    e->dev = NULL;
+
+    /* events of the current batch may still point to the entry */
+    if (mux->running) {
+        e->next = mux->dead;
+        mux->dead = e;
+    } else {
+        free(e);
+    }
+
+    return 0;
+}
+
+int fronius_mux_error(struct fronius_mux *mux, struct fronius_dev *dev)
+{
+    struct fronius_mux_entry *e = dev->mux_entry;
+    int error;
+
+    if (!e || e->mux != mux) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    error = e->error;
+    e->error = 0;
+
+    return error;
+}
+
+int fronius_mux_fd(struct fronius_mux *mux)
+{
+    return mux->epfd;
+}
+
+int fronius_mux_run(struct fronius_mux *mux, int timeout)
+{
+    struct epoll_event evs[FRONIUS_MUX_EVENTS];
+    struct fronius_mux_entry *e;
+    int i, n, next, revents;
+
+    /* pick up requests submitted since the last run */
+    fronius_mux_flush(mux);
+
+    next = fronius_mux_timer_next(mux, fronius_mux_now());
+    if (next >= 0 && (timeout < 0 || next < timeout))
+        timeout = next;
+
+    n = epoll_wait(mux->epfd, evs, FRONIUS_MUX_EVENTS, timeout);
+    if (n == -1) {
+        if (errno != EINTR)
+            return -1;
+        n = 0;
+    }
+
+    mux->running = 1;
+
+    for (i = 0; i < n; ++i) {
+        e = evs[i].data.ptr;
+        /* removed by a callback earlier in this batch */
+        if (!e->dev)
+            continue;
+
+        revents = (evs[i].events & EPOLLIN ? POLLIN : 0) |
+                  (evs[i].events & EPOLLOUT ? POLLOUT : 0) |
+                  (evs[i].events & EPOLLERR ? POLLERR : 0) |
+                  (evs[i].events & EPOLLHUP ? POLLHUP : 0);
+        fronius_mux_process(mux, e, revents);
+    }
+
+    fronius_mux_expire(mux, fronius_mux_now());
+
+    /* callbacks may have started requests on other devices */
+    fronius_mux_flush(mux);
+
+    mux->running = 0;
+    fronius_mux_reap(mux);
+
+    return mux->busy;
+}
@@ -11,8 +11,13 @@
 #include <errno.h>
 #include <termios.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #include <config.h>
@@ -38,7 +43,10 @@ static int fronius_setserialmode(struct fronius_dev *dev)
     new_tio.c_iflag &= ~(IGNBRK | IGNPAR);
     new_tio.c_iflag |= BRKINT;
     new_tio.c_oflag &= ~OPOST;
-    new_tio.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+    new_tio.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG | IEXTEN);
+
+    /* binary data: no translation of CR/NL and no stripping of bit 7 */
+    new_tio.c_iflag &= ~(ICRNL | INLCR | IGNCR | ISTRIP | INPCK | PARMRK);
     new_tio.c_cflag |= CLOCAL | CREAD;
 
     /* disable software flow control */
@@ -69,16 +77,55 @@ free:
     return rv;
 }
 
-static int fronius_opensocket(struct fronius_dev *dev,
-                              const char *hostname, const char *port)
+/* addresses are raced, each one gets a head start on the next */
+#define FRONIUS_CONNECT_STAGGER	250	/* ms */
+
+/* a dead peer is noticed after idle + count * interval seconds */
+#define FRONIUS_KEEPALIVE_IDLE	10
+#define FRONIUS_KEEPALIVE_INTVL	5
+#define FRONIUS_KEEPALIVE_CNT	3
+
+static long fronius_connect_ms(const struct timespec *from)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000 +
+           (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/* small frames must not wait for more data, and a peer which vanished
+   without a reset has to be noticed eventually */
+void fronius_connect_tune(int fd, int family)
+{
+    int on = 1, idle = FRONIUS_KEEPALIVE_IDLE;
+    int intvl = FRONIUS_KEEPALIVE_INTVL, cnt = FRONIUS_KEEPALIVE_CNT;
+
+    if (family != AF_INET && family != AF_INET6)
+        return;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+}
+
+int fronius_connect(const char *hostname, const char *port, int socktype,
+                    int timeout)
 {
     struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int s;
+    struct addrinfo *result, *rp, *ai[FRONIUS_CONNECT_MAX];
+    struct pollfd pfd[FRONIUS_CONNECT_MAX];
+    struct timespec started;
+    int fd = -1, err = ETIMEDOUT, s, soerr;
+    size_t naddrs = 0, next = 0, pending = 0, i;
+    socklen_t len;
+    long wait, elapsed;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;        /* allow IPv4 or IPv6 */
-    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_socktype = socktype;
 
     s = getaddrinfo(hostname, port, &hints, &result);
     if (s != 0) {
@@ -88,39 +135,185 @@ static int fronius_opensocket(struct fronius_dev *dev,
         return -1;
     }
 
-    /* getaddrinfo() returns a list of address structures. Try each address until
-       we successfully connect. If socket or connect fails, we (close the socket
-       and) try the next address. */
+    for (rp = result; rp && naddrs < FRONIUS_CONNECT_MAX; rp = rp->ai_next)
+        ai[naddrs++] = rp;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    /* start a connect for the next address whenever the previous ones had
+       their head start or failed, the first one to complete wins */
+    while (fd == -1) {
+        elapsed = fronius_connect_ms(&started);
+
+        while (next < naddrs &&
+               (!pending || elapsed >= (long) next * FRONIUS_CONNECT_STAGGER)) {
+            rp = ai[next];
+            pfd[next].fd = -1;
+            pfd[next].events = POLLOUT;
+            pfd[next].revents = 0;
+
+            s = socket(rp->ai_family,
+                       rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                       rp->ai_protocol);
+            next++;
+            if (s == -1) {
+                err = errno;
+                continue;
+            }
+
+            if (connect(s, rp->ai_addr, rp->ai_addrlen) == 0) {
+                fd = s;
+                pfd[next - 1].fd = s;
+                break;
+            }
+
+            if (errno != EINPROGRESS) {
+                err = errno;
+                close(s);
+                continue;
+            }
+
+            pfd[next - 1].fd = s;
+            pending++;
+        }
+
+        if (fd != -1 || !pending || elapsed >= timeout)
+            break;
+
+        wait = timeout - elapsed;
+        if (next < naddrs &&
+            (long) next * FRONIUS_CONNECT_STAGGER - elapsed < wait)
+            wait = (long) next * FRONIUS_CONNECT_STAGGER - elapsed;
+
+        if (poll(pfd, next, wait) == -1 && errno != EINTR) {
+            err = errno;
+            break;
+        }
+
+        for (i = 0; i < next && fd == -1; ++i) {
+            if (pfd[i].fd == -1 || !pfd[i].revents)
+                continue;
+
+            len = sizeof(soerr);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len))
+                soerr = errno;
+
+            if (!soerr) {
+                fd = pfd[i].fd;
+                break;
+            }
+
+            err = soerr;
+            close(pfd[i].fd);
+            pfd[i].fd = -1;
+            pending--;
+        }
+    }
+
+    /* drop the connects which lost the race */
+    for (i = 0; i < next; ++i)
+        if (pfd[i].fd != -1 && pfd[i].fd != fd)
+            close(pfd[i].fd);
+
+    for (i = 0; i < next && fd != -1; ++i)
+        if (pfd[i].fd == fd && socktype == SOCK_STREAM)
+            fronius_connect_tune(fd, ai[i]->ai_family);
 
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-        dev->fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+    freeaddrinfo(result);
 
-        if (dev->fd == -1)
-            continue;
+    if (fd == -1)
+        errno = err;
 
-        if (connect(dev->fd, rp->ai_addr, rp->ai_addrlen) != -1)
-            break;              /* success */
+    return fd;
+}
+
+static int fronius_openunix(struct fronius_dev *dev, const char *path)
+{
+    struct sockaddr_un sun;
 
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    dev->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (dev->fd == -1)
+        return -1;
+
+    if (connect(dev->fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
         close(dev->fd);
+        return -1;
     }
 
-    if (rp == NULL) {           /* no address succeeded */
+    return 0;
+}
+
+/* network transports selected by a prefix of the device name */
+static const struct fronius_scheme {
+    const char *prefix;
+    int socktype;
+    const struct fronius_transport *transport;
+} fronius_schemes[] = {
+    { "raw://", SOCK_STREAM, &fronius_transport_tcp },
+    { "tcp://", SOCK_STREAM, &fronius_transport_tcp },
+    { "udp://", SOCK_DGRAM,  &fronius_transport_dgram },
+};
+
+#define UNIX_PREFIX "unix://"
+
+/* dev_name can contain an inet addr ala proto://hostname:port */
+static int fronius_openinet(struct fronius_dev *dev, const char *dev_name,
+                            const struct fronius_scheme *scheme, int flags)
+{
+    char hostname[255];
+    const char *host = &dev_name[strlen(scheme->prefix)];
+    const char *port = strrchr(host, ':');
+
+    /* find port number */
+    if (port)
+        port++;
+
+    if (!port || !*port || (size_t) (port - 1 - host) >= sizeof(hostname)) {
         errno = EINVAL;
         return -1;
     }
 
-    freeaddrinfo(result);       /* no longer needed */
+    /* fetch hostname */
+    memset(hostname, 0, sizeof(hostname));
+    memcpy(hostname, host, port - 1 - host);
+
+    dev->transport = scheme->transport;
+
+    /* the first request waits for the connect instead */
+    if (scheme->transport == &fronius_transport_tcp &&
+        (flags & FRONIUS_OPEN_NONBLOCK))
+        return fronius_tcp_open(dev, hostname, port);
+
+    dev->fd = fronius_connect(hostname, port, scheme->socktype,
+                              FRONIUS_CONNECT_TIMEOUT);
+    if (dev->fd == -1)
+        return -1;
+
+    /* stream connections are re-established when they break */
+    if (scheme->transport == &fronius_transport_tcp &&
+        fronius_tcp_init(dev, hostname, port)) {
+        close(dev->fd);
+        return -1;
+    }
 
     return 0;
 }
 
-#define SOCKET_PREFIX "raw://"
-
-struct fronius_dev *fronius_open(const char *dev_name,
-                                 const fronius_ifc_type_t ifc_type,
-                                 const fronius_baudrate_t baud)
+struct fronius_dev *fronius_open_flags(const char *dev_name,
+                                       fronius_ifc_type_t ifc_type,
+                                       fronius_baudrate_t baud, int flags)
 {
     struct fronius_dev *dev;
+    size_t i;
 
     /* require baudrate setting for Interface Card; Interface Card Easy will
        auto-detect baudrate */
@@ -143,35 +336,25 @@ struct fronius_dev *fronius_open(const char *dev_name,
             baud == FRONIUS_BAUDRATE_AUTO)
             dev->baudrate = FRONIUS_BAUDRATE_B19200;
 
-        /* dev_name can contain an inet addr ala
-           raw://hostname:port */
-        if (strstr(dev_name, SOCKET_PREFIX) == dev_name) {
-            /* use a socket for device communication */
-            char hostname[255];
-            char *port = rindex(dev_name, ':');
-
-            /* find port number */
-            if (port)
-                port++;
+        for (i = 0; i < sizeof(fronius_schemes) / sizeof(fronius_schemes[0]); ++i)
+            if (!strncmp(dev_name, fronius_schemes[i].prefix,
+                         strlen(fronius_schemes[i].prefix)))
+                break;
 
-            if (!port || (port && !*port)) {
-                errno = EINVAL;
+        if (i < sizeof(fronius_schemes) / sizeof(fronius_schemes[0])) {
+            /* use a socket for device communication */
+            if (fronius_openinet(dev, dev_name, &fronius_schemes[i], flags))
                 goto free;
-            }
 
-            /* fetch hostname */
-            memset(hostname, 0, sizeof(hostname));
-            strncpy(hostname, &dev_name[strlen(SOCKET_PREFIX)],
-                    strlen(dev_name) - strlen(SOCKET_PREFIX) -
-                    strlen(":") - strlen(port));
-#if 0
-            fprintf(stderr, "Got hostname: %s, port %s\n", hostname, port);
-#endif
-            if (fronius_opensocket(dev, hostname, port))
+        } else if (!strncmp(dev_name, UNIX_PREFIX, strlen(UNIX_PREFIX))) {
+            /* a local socket, e.g. of a serial server */
+            dev->transport = &fronius_transport_stream;
+            if (fronius_openunix(dev, &dev_name[strlen(UNIX_PREFIX)]))
                 goto free;
 
         } else {
             /* use a serial port for device communication */
+            dev->transport = &fronius_transport_serial;
             dev->fd =
                 open(dev_name, O_RDWR | O_CLOEXEC | O_NOCTTY | O_NDELAY);
             if (dev->fd == -1)
@@ -182,17 +365,67 @@ struct fronius_dev *fronius_open(const char *dev_name,
                 goto close;
         }
 
-        /* blocking i/o */
-        if (fcntl(dev->fd, F_SETFL, 0))
+        /* non-blocking i/o, the request engine waits for readiness */
+        if (fcntl(dev->fd, F_SETFL, O_NONBLOCK))
             goto close;
     }
 
     return dev;
 
 close:
-    close(dev->fd);
+    if (dev->transport == &fronius_transport_tcp && dev->transport_priv)
+        dev->transport->close(dev);
+    else
+        close(dev->fd);
 
 free:
     free(dev);
     return NULL;
 }
+
+struct fronius_dev *fronius_open(const char *dev_name,
+                                 const fronius_ifc_type_t ifc_type,
+                                 const fronius_baudrate_t baud)
+{
+    return fronius_open_flags(dev_name, ifc_type, baud, 0);
+}
+
+static int fronius_open_socktype(int fd)
+{
+    socklen_t len = sizeof(int);
+    int type;
+
+    /* not a socket at all, e.g. a pipe */
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == -1)
+        return -1;
+
+    return type;
+}
+
+struct fronius_dev *fronius_open_fd(int fd, const fronius_ifc_type_t ifc_type)
+{
+    struct fronius_dev *dev;
+    int flags;
+
+    if (ifc_type == FRONIUS_IFC_TYPE_PROBE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* the request engine needs non-blocking i/o */
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return NULL;
+
+    dev = calloc(1, sizeof(struct fronius_dev));
+    if (!dev)
+        return NULL;
+
+    dev->fd = fd;
+    dev->transport = fronius_open_socktype(fd) == SOCK_DGRAM ?
+                     &fronius_transport_dgram : &fronius_transport_stream;
+    dev->ifc_type = ifc_type;
+    dev->baudrate = FRONIUS_BAUDRATE_AUTO;
+
+    return dev;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+#define RING_MASK (FRONIUS_RXRING_SIZE - 1)
+
+#if (FRONIUS_RXRING_SIZE & RING_MASK) || FRONIUS_RXRING_SIZE < 2 * FRONIUS_MAX_PKTLEN
+#error "FRONIUS_RXRING_SIZE must be a power of two holding at least two packets"
+#endif
+
+static inline uint8_t ring_at(const struct fronius_parser *p, size_t off)
+{
+    return p->ring[(p->tail + off) & RING_MASK];
+}
+
+/* copy n bytes starting at offset off from the read position */
+static void ring_copy(const struct fronius_parser *p, size_t off,
+                      uint8_t *dst, size_t n)
+{
+    size_t pos = (p->tail + off) & RING_MASK;
+    size_t chunk = FRONIUS_RXRING_SIZE - pos;
+
+    if (chunk > n)
+        chunk = n;
+
+    memcpy(dst, &p->ring[pos], chunk);
+    memcpy(dst + chunk, p->ring, n - chunk);
+}
+
+/* byte sum as used by the frame checksum; simple enough to be vectorised */
+static inline uint8_t sum8(const uint8_t *p, size_t n)
+{
+    unsigned int sum = 0;
+
+    while (n--)
+        sum += *p++;
+
+    return sum;
+}
+
+/* drop bytes, each loss of synchronisation is counted once */
+static void fronius_parser_drop(struct fronius_parser *p, size_t n)
+{
+    if (!n)
+        return;
+
+    p->tail += n;
+    FRONIUS_STAT_ADD(p->skipped, n);
+    if (!p->lost) {
+        p->lost = 1;
+        FRONIUS_STAT_ADD(p->resyncs, 1);
+    }
+}
+
+/* skip to the next start byte, using memchr() on the contiguous parts of
+   the ring instead of testing byte by byte */
+static void fronius_parser_sync(struct fronius_parser *p)
+{
+    size_t avail = fronius_parser_pending(p);
+    size_t pos = p->tail & RING_MASK;
+    size_t chunk = FRONIUS_RXRING_SIZE - pos, skip;
+    const uint8_t *s;
+
+    if (chunk > avail)
+        chunk = avail;
+
+    s = memchr(&p->ring[pos], FRONIUS_START_SEQUENCE, chunk);
+    if (s) {
+        skip = s - &p->ring[pos];
+    } else {
+        s = memchr(p->ring, FRONIUS_START_SEQUENCE, avail - chunk);
+        skip = s ? chunk + (s - p->ring) : avail;
+    }
+
+    fronius_parser_drop(p, skip);
+}
+
+void fronius_parser_init(struct fronius_parser *p)
+{
+    memset(p, 0, sizeof(*p));
+}
+
+void fronius_parser_flush(struct fronius_parser *p)
+{
+    p->tail = p->head;
+    p->lost = 0;
+}
+
+size_t fronius_parser_pending(const struct fronius_parser *p)
+{
+    return p->head - p->tail;
+}
+
+size_t fronius_parser_missing(const struct fronius_parser *p, size_t datalen)
+{
+    size_t avail = fronius_parser_pending(p), i, pktlen;
+
+    /* bytes not starting a frame are dropped by the next parse anyway */
+    for (i = 0; i < avail && i < FRONIUS_FL_START; ++i)
+        if (ring_at(p, i) != FRONIUS_START_SEQUENCE)
+            return 1;
+
+    if (avail > FRONIUS_OF_LENGTH &&
+        ring_at(p, FRONIUS_OF_LENGTH) <= FRONIUS_MAX_DATALEN)
+        datalen = ring_at(p, FRONIUS_OF_LENGTH);
+
+    pktlen = FRONIUS_MIN_PKTLEN + datalen;
+    return pktlen > avail ? pktlen - avail : 1;
+}
+
+size_t fronius_parser_feed(struct fronius_parser *p, const uint8_t *data,
+                           size_t len)
+{
+    size_t space = FRONIUS_RXRING_SIZE - fronius_parser_pending(p);
+    size_t pos = p->head & RING_MASK;
+    size_t chunk = FRONIUS_RXRING_SIZE - pos;
+
+    if (len > space)
+        len = space;
+    if (chunk > len)
+        chunk = len;
+
+    memcpy(&p->ring[pos], data, chunk);
+    memcpy(p->ring, data + chunk, len - chunk);
+    p->head += len;
+
+    return len;
+}
+
+ssize_t fronius_parser_fill(struct fronius_parser *p, int fd)
+{
+    size_t space = FRONIUS_RXRING_SIZE - fronius_parser_pending(p);
+    size_t pos = p->head & RING_MASK;
+    struct iovec iov[2];
+    ssize_t rv;
+
+    /* free space may wrap around the end of the ring */
+    iov[0].iov_base = &p->ring[pos];
+    iov[0].iov_len = FRONIUS_RXRING_SIZE - pos;
+    if (iov[0].iov_len > space)
+        iov[0].iov_len = space;
+    iov[1].iov_base = p->ring;
+    iov[1].iov_len = space - iov[0].iov_len;
+
+    rv = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+    if (rv > 0)
+        p->head += rv;
+
+    return rv;
+}
+
+int fronius_parser_next(struct fronius_parser *p, struct fronius_pkt *pkt)
+{
+    size_t avail, pktlen;
+    uint8_t length;
+
+    while ((avail = fronius_parser_pending(p)) >= FRONIUS_FL_START) {
+        /* scan for the start sequence */
+        if (ring_at(p, 0) != FRONIUS_START_SEQUENCE) {
+            fronius_parser_sync(p);
+            continue;
+        }
+        if (ring_at(p, 1) != FRONIUS_START_SEQUENCE ||
+            ring_at(p, 2) != FRONIUS_START_SEQUENCE)
+            goto skip;
+
+        if (avail < FRONIUS_MIN_PKTLEN)
+            return 0;
+
+        /* a start byte in the length field means we are not aligned yet */
+        length = ring_at(p, FRONIUS_OF_LENGTH);
+        if (length > FRONIUS_MAX_DATALEN)
+            goto skip;
+
+        pktlen = FRONIUS_MIN_PKTLEN + length;
+        if (avail < pktlen)
+            return 0;
+
+        /* the packet has the wire layout, extract the frame in one go
+           and validate it */
+        ring_copy(p, 0, pkt->start, pktlen);
+
+        if (fronius_pkt_validate(pkt) == FRONIUS_ERR_NOERROR) {
+            /* consume frame, trailing bytes stay for the next one */
+            p->tail += pktlen;
+            p->lost = 0;
+            return 1;
+        }
+
+        FRONIUS_STAT_ADD(p->checksum_errors, 1);
+
+    skip:
+        /* drop one byte and resynchronise */
+        fronius_parser_drop(p, 1);
+    }
+
+    return 0;
+}
+
+size_t fronius_frames_scan(const uint8_t *buf, size_t len,
+                           fronius_frame_cb_t callback, void *arg,
+                           unsigned long *skipped)
+{
+    const uint8_t *p = buf, *end = buf + len, *s;
+    unsigned long skip = 0;
+    size_t pktlen;
+
+    while ((size_t) (end - p) >= FRONIUS_MIN_PKTLEN) {
+        /* find the next start byte */
+        if (p[0] != FRONIUS_START_SEQUENCE) {
+            s = memchr(p, FRONIUS_START_SEQUENCE, end - p);
+            if (!s)
+                s = end;
+            skip += s - p;
+            p = s;
+            continue;
+        }
+
+        if (p[1] != FRONIUS_START_SEQUENCE ||
+            p[2] != FRONIUS_START_SEQUENCE ||
+            p[FRONIUS_OF_LENGTH] > FRONIUS_MAX_DATALEN)
+            goto skip;
+
+        pktlen = FRONIUS_MIN_PKTLEN + p[FRONIUS_OF_LENGTH];
+        if ((size_t) (end - p) < pktlen)
+            break;
+
+        /* the checksum covers everything between start sequence and itself */
+        if (sum8(p + FRONIUS_OF_LENGTH, pktlen - FRONIUS_FL_START -
+                 FRONIUS_FL_CHECKSUM) != p[pktlen - 1])
+            goto skip;
+
+        /* hand out the frame in place */
+        if (callback(p, pktlen, arg)) {
+            p += pktlen;
+            break;
+        }
+        p += pktlen;
+        continue;
+
+    skip:
+        p++;
+        skip++;
+    }
+
+    if (skipped)
+        *skipped += skip;
+
+    return p - buf;
+}
@@ -7,7 +7,6 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
-#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -15,41 +14,41 @@
 
 #include "fronius-private.h"
 
-int fronius_pkt_send(struct fronius_dev *dev, struct fronius_pkt *pkt)
+int fronius_pkt_send(struct fronius_dev *dev, const struct fronius_pkt *pkt)
 {
-    uint8_t buf[FRONIUS_MAX_PKTLEN];
-    int bytes_sent = 0, count;
-
-    /* calculate checksum */
-    fronius_pkt_checksum(pkt);
-
-    /* copy to buffer */
-    memcpy(&buf[FRONIUS_OF_START], pkt->start,
-           FRONIUS_FL_START + FRONIUS_HEADERLEN);
-    memcpy(&buf[FRONIUS_OF_DATA], pkt->data, pkt->length);
-    buf[FRONIUS_OF_DATA + pkt->length] = pkt->checksum;
-
-    /* transmit data stream */
-    count = FRONIUS_MIN_PKTLEN + pkt->length;
-    do {
-        ssize_t rv = write(dev->fd, &buf[bytes_sent], count - bytes_sent);
-        if (rv < 0) {
-            if (errno == EINTR)
-                continue;
+    const uint8_t *frame;
+
+    if (pkt) {
+        dev->txpkt = pkt;
+        dev->txlen = FRONIUS_PKT_LEN(pkt);
+        dev->txoff = 0;
+    }
+
+    /* the packet is in wire order, write it out as it is */
+    frame = dev->txpkt->start;
+
+    /* transmit data stream as far as the device accepts it */
+    while (dev->txoff < dev->txlen) {
+        ssize_t rv = dev->transport->send(dev, &frame[dev->txoff],
+                                          dev->txlen - dev->txoff);
+        if (rv < 0)
             return rv;
-        }
         /* update byte counter */
-        bytes_sent += rv;
-        dev->bytes_sent += rv;
-    } while (bytes_sent < count);
+        dev->txoff += rv;
+        FRONIUS_STAT_ADD(dev->stats.bytes_sent, rv);
+    }
 
     /* update packet counter */
-    dev->pkts_sent++;
+    FRONIUS_STAT_ADD(dev->stats.pkts_sent, 1);
     gettimeofday(&dev->last_sent, NULL);
 
-    /* dump packet */
-    if (dev->debug)
-        fronius_pkt_dump(NULL, "fronius_pkt_send", pkt, dev->rawdump);
+    /* capture, trace or dump packet */
+    if (dev->capture)
+        fronius_capture_frame(dev, FRONIUS_TRACE_TX, frame, dev->txlen);
+    if (dev->trace)
+        fronius_pkt_trace(dev, FRONIUS_TRACE_TX, frame, dev->txlen);
+    else if (dev->debug)
+        fronius_pkt_dump(NULL, "fronius_pkt_send", dev->txpkt, dev->rawdump);
 
     return 0;
 }
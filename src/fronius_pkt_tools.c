@@ -23,12 +23,13 @@ void fronius_pkt_init(struct fronius_pkt *pkt)
 void fronius_pkt_checksum(struct fronius_pkt *pkt)
 {
     uint8_t *p = &pkt->length;
+    uint8_t checksum = 0;
     int i = FRONIUS_HEADERLEN + pkt->length;
 
-    pkt->checksum = 0;
-
     while (i--)
-        pkt->checksum += *p++;
+        checksum += *p++;
+
+    FRONIUS_PKT_CHECKSUM(pkt) = checksum;
 }
 
 fronius_error_t fronius_pkt_validate_header(const struct fronius_pkt *pkt)
@@ -65,7 +66,7 @@ fronius_error_t fronius_pkt_validate(const struct fronius_pkt *pkt)
     while (i--)
         checksum += *p++;
 
-    if (pkt->checksum != checksum)
+    if (FRONIUS_PKT_CHECKSUM(pkt) != checksum)
         return FRONIUS_ERR_CHECKSUM;
 
     /* packet is valid */
@@ -81,51 +82,18 @@ fronius_error_t fronius_pkt_iserror(const struct fronius_pkt * pkt)
     return (fronius_error_t) pkt->data[1];
 }
 
-#define FRONIUS_RAWDUMP_FMT1 ": "
-#define FRONIUS_RAWDUMP_FMT1_STRLEN (2)
-#define FRONIUS_RAWDUMP_FMT2 "0x%02x "
-#define FRONIUS_RAWDUMP_FMT2_STRLEN (5)
-#define FRONIUS_RAWDUMP_FMT3 "0x%02x\n"
-#define FRONIUS_RAWDUMP_FMT3_STRLEN (5)
-
 int fronius_pkt_rawdump(FILE *stream, const char *prefix,
                         const struct fronius_pkt *pkt)
 {
-    char *buf1;
-    char buf2[8];               /* must be at least max(FRONIUS_RAWDUMP_FMT2_STRLEN, FRONIUS_RAWDUMP_FMT3_STRLEN) */
-    int i = FRONIUS_MIN_PKTLEN + pkt->length - FRONIUS_FL_CHECKSUM, c = 0;
-    uint8_t *p = (uint8_t *) & pkt->start;
-
-    if (prefix)
-        c += strlen(prefix) + FRONIUS_RAWDUMP_FMT1_STRLEN;
+    char buf[FRONIUS_TRACE_BUFSIZE];
+    int c;
 
-    c += i * FRONIUS_RAWDUMP_FMT2_STRLEN;       /* i bytes * [strlen] chars */
-    c += FRONIUS_RAWDUMP_FMT3_STRLEN + 1;       /* trailing crc + nul byte */
-
-    buf1 = (char *) malloc(c);
-    if (!buf1) {
-        errno = ENOMEM;
+    c = fronius_trace_format(buf, sizeof(buf), prefix, pkt->start,
+                             FRONIUS_PKT_LEN(pkt));
+    if (c < 0)
         return -1;
-    }
-
-    if (prefix) {
-        strcpy(buf1, prefix);
-        strcat(buf1, FRONIUS_RAWDUMP_FMT1);
-    }
-
-    while (i--) {
-        sprintf(buf2, FRONIUS_RAWDUMP_FMT2, *p++);
-        strcat(buf1, buf2);
-    }
-
-    sprintf(buf2, FRONIUS_RAWDUMP_FMT3, pkt->checksum);
-    strcat(buf1, buf2);
-
-    c = fprintf(stream ? stream : stderr, "%s", buf1);
-
-    free(buf1);
 
-    return c;
+    return fwrite(buf, 1, c, stream ? stream : stderr) == (size_t) c ? c : -1;
 }
 
 #define FRONIUS_HEADERDUMP_FMT "%s%slength=%d, device=%d, number=%d, command=0x%02x, checksum=%d\n"
@@ -136,7 +104,7 @@ int fronius_pkt_headerdump(FILE *stream, const char *prefix,
     return fprintf(stream ? stream : stderr, FRONIUS_HEADERDUMP_FMT,
                    prefix ? prefix : "", prefix ? ": " : "",
                    pkt->length, pkt->device, pkt->number, pkt->command,
-                   pkt->checksum);
+                   FRONIUS_PKT_CHECKSUM(pkt));
 }
 
 int fronius_pkt_dump(FILE *stream, const char *prefix,
@@ -0,0 +1,204 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+struct fronius_plan {
+	struct fronius_dev	*dev;
+	uint8_t			device;
+	/* inverter/sensor numbers and commands to walk */
+	uint8_t			*numbers;
+	size_t			nnumbers;
+	uint8_t			*cmds;
+	size_t			ncmds;
+	/* request frames of all pairs, checksums included */
+	struct fronius_pkt	*frames;
+	/* position of the next (number, command) pair */
+	size_t			pos;
+	/* remaining cycles, 0 runs until stopped */
+	unsigned int		cycles_left;
+	int			running;
+	/* user notification */
+	fronius_callback_t	callback;
+	void			*arg;
+	/* statistical values */
+	struct timespec		started, stopped;
+	unsigned long		transactions, errors, cycles;
+};
+
+static void fronius_plan_complete(struct fronius_dev *,
+                                  const struct fronius_result *, void *);
+
+static int fronius_plan_submit(struct fronius_plan *plan)
+{
+    return fronius_xfer_start_frame(plan->dev, &plan->frames[plan->pos],
+                                    fronius_plan_complete, plan);
+}
+
+static void fronius_plan_complete(struct fronius_dev *dev,
+                                  const struct fronius_result *res,
+                                  void *arg)
+{
+    struct fronius_plan *plan = arg;
+
+    plan->transactions++;
+    if (res->error != FRONIUS_ERR_NOERROR)
+        plan->errors++;
+
+    /* advance to the next pair and count finished cycles */
+    if (++plan->pos == plan->nnumbers * plan->ncmds) {
+        plan->pos = 0;
+        plan->cycles++;
+        if (plan->cycles_left && !--plan->cycles_left)
+            plan->running = 0;
+    }
+
+    /* a broken device fails every further request as well, so the plan
+       ends here and fronius_process() reports the error */
+    if (dev->xfer.ioerror)
+        plan->running = 0;
+
+    if (plan->callback)
+        plan->callback(dev, res, plan->arg);
+
+    /* keep the bus busy: put the next request on the wire right away */
+    if (plan->running && fronius_plan_submit(plan) < 0)
+        plan->running = 0;
+
+    if (!plan->running)
+        clock_gettime(CLOCK_MONOTONIC, &plan->stopped);
+}
+
+struct fronius_plan *fronius_plan_new(struct fronius_dev *dev, uint8_t device,
+                                      const char *list, size_t size,
+                                      const uint8_t *cmds, size_t ncmds,
+                                      fronius_callback_t callback, void *arg)
+{
+    struct fronius_plan *plan;
+    size_t n, i;
+
+    /* the list is terminated by a zero entry or by its size */
+    for (n = 0; n < size && list[n] != 0; ++n);
+
+    if (!n || !ncmds) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    plan = calloc(1, sizeof(*plan));
+    if (!plan)
+        return NULL;
+
+    plan->numbers = malloc(n);
+    plan->cmds = malloc(ncmds);
+    plan->frames = malloc(n * ncmds * sizeof(*plan->frames));
+    if (!plan->numbers || !plan->cmds || !plan->frames) {
+        fronius_plan_free(plan);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memcpy(plan->numbers, list, n);
+    memcpy(plan->cmds, cmds, ncmds);
+    plan->nnumbers = n;
+    plan->ncmds = ncmds;
+    plan->dev = dev;
+    plan->device = device;
+    plan->callback = callback;
+    plan->arg = arg;
+
+    /* the pairs never change, so their frames are built only once */
+    for (i = 0; i < n * ncmds; ++i) {
+        fronius_pkt_init(&plan->frames[i]);
+        plan->frames[i].device = device;
+        plan->frames[i].number = plan->numbers[i / ncmds];
+        plan->frames[i].command = plan->cmds[i % ncmds];
+        fronius_pkt_checksum(&plan->frames[i]);
+    }
+
+    return plan;
+}
+
+void fronius_plan_free(struct fronius_plan *plan)
+{
+    if (!plan)
+        return;
+
+    free(plan->numbers);
+    free(plan->cmds);
+    free(plan->frames);
+    free(plan);
+}
+
+int fronius_plan_start(struct fronius_plan *plan, unsigned int cycles)
+{
+    if (plan->running) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    plan->pos = 0;
+    plan->cycles_left = cycles;
+    plan->transactions = plan->errors = plan->cycles = 0;
+    clock_gettime(CLOCK_MONOTONIC, &plan->started);
+
+    plan->running = 1;
+    if (fronius_plan_submit(plan) < 0) {
+        plan->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+void fronius_plan_stop(struct fronius_plan *plan)
+{
+    /* the request in flight completes, but no further one is submitted */
+    if (plan->running)
+        clock_gettime(CLOCK_MONOTONIC, &plan->stopped);
+    plan->running = 0;
+}
+
+int fronius_plan_run(struct fronius_plan *plan, unsigned int cycles)
+{
+    if (!cycles) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fronius_plan_start(plan, cycles) < 0)
+        return -1;
+
+    /* completions chain the next request, so this returns when done */
+    return fronius_xfer_wait(plan->dev);
+}
+
+int fronius_plan_stats(struct fronius_plan *plan,
+                       struct fronius_plan_stats *stats)
+{
+    struct timespec now = plan->stopped;
+
+    /* a running plan is measured up to now */
+    if (plan->running)
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+    stats->transactions = plan->transactions;
+    stats->errors = plan->errors;
+    stats->cycles = plan->cycles;
+    stats->elapsed = (now.tv_sec - plan->started.tv_sec) +
+                     (now.tv_nsec - plan->started.tv_nsec) / 1e9;
+    stats->rate = stats->elapsed > 0 ?
+                  plan->transactions / stats->elapsed : 0.0;
+
+    return 0;
+}
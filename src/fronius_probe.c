@@ -4,12 +4,260 @@
  * SPDX-License-Identifier: LGPL-2.1+
  */
 
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
 #include <config.h>
 
 #include "fronius-private.h"
 
+/*
+ * Every port walks the same steps: ask for the version at one baudrate
+ * after the other until the card answers, then fetch the lists of active
+ * inverters and sensor cards. All ports are driven by one multiplexer, so
+ * the probe takes about as long as the slowest port instead of the sum;
+ * network ports are connected in parallel as well, their first request
+ * waits for the connect.
+ */
+
+/* Interface Card easy and IG Plus default to 19200, the rest is rare */
+static const fronius_baudrate_t fronius_probe_baudrates[] = {
+    FRONIUS_BAUDRATE_B19200,
+    FRONIUS_BAUDRATE_B9600,
+    FRONIUS_BAUDRATE_B4800,
+    FRONIUS_BAUDRATE_B2400,
+};
+
+#define FRONIUS_PROBE_BAUDRATES \
+    (sizeof(fronius_probe_baudrates) / sizeof(fronius_probe_baudrates[0]))
+
+struct fronius_prober {
+	struct fronius_dev		*dev;
+	struct fronius_probe_result	*res;
+	/* index of the baudrate being tried */
+	size_t				baud;
+	/* command in flight, 0 once the port is done */
+	uint8_t				command;
+	struct timespec			started;
+	int				*active;
+};
+
+static void fronius_probe_complete(struct fronius_dev *,
+                                   const struct fronius_result *, void *);
+
+static unsigned int fronius_probe_ms(const struct timespec *from)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) * 1000 +
+           (now.tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static void fronius_probe_done(struct fronius_prober *pr, int error)
+{
+    pr->res->error = error;
+    pr->res->elapsed_ms = fronius_probe_ms(&pr->started);
+    pr->command = 0;
+    (*pr->active)--;
+}
+
+static void fronius_probe_next(struct fronius_prober *pr, uint8_t command)
+{
+    pr->command = command;
+    if (fronius_submit(pr->dev, FRONIUS_DEVICE_INTERFACECARD, 0, command,
+                       fronius_probe_complete, pr) < 0)
+        fronius_probe_done(pr, errno);
+}
+
+/* the card is silent at this baudrate, go on with the next one */
+static void fronius_probe_silent(struct fronius_prober *pr)
+{
+    int error;
+
+    /* a network port which could not be connected tells why */
+    if (!pr->dev->old_tio) {
+        error = fronius_tcp_error(pr->dev);
+        fronius_probe_done(pr, error && error != EINPROGRESS ? error : ENODEV);
+        return;
+    }
+
+    if (++pr->baud == FRONIUS_PROBE_BAUDRATES) {
+        fronius_probe_done(pr, ENODEV);
+        return;
+    }
+
+    if (fronius_serial_baudrate(pr->dev,
+                                fronius_probe_baudrates[pr->baud]) < 0) {
+        fronius_probe_done(pr, errno);
+        return;
+    }
+
+    fronius_probe_next(pr, FRONIUS_CMD_IFCARD_GETVERSION);
+}
+
+static void fronius_probe_complete(struct fronius_dev *dev,
+                                   const struct fronius_result *res,
+                                   void *arg)
+{
+    struct fronius_prober *pr = arg;
+    struct fronius_probe_result *r = pr->res;
+    int ok = res->error == FRONIUS_ERR_NOERROR &&
+             fronius_cmd_length_ok(res->command, res->length);
+
+    switch (res->command) {
+    case FRONIUS_CMD_IFCARD_GETVERSION:
+        /* an error frame proves a card at this baudrate as well, it just
+           does not tell its type */
+        if (res->error == FRONIUS_ERR_INVALID_RESPONSE ||
+            (res->error == FRONIUS_ERR_NOERROR && !ok)) {
+            fronius_probe_silent(pr);
+            return;
+        }
+
+        r->baudrate = dev->old_tio ? dev->baudrate : FRONIUS_BAUDRATE_AUTO;
+        if (ok) {
+            r->ifc_type = res->data[0];
+            snprintf(r->version, sizeof(r->version), "%d.%d.%d",
+                     res->data[1], res->data[2], res->data[3]);
+        }
+
+        /* the line is known now, the estimator takes over */
+        dev->probing = 0;
+        fronius_probe_next(pr, FRONIUS_CMD_IFCARD_GETACTIVEINVERTERS);
+        return;
+
+    case FRONIUS_CMD_IFCARD_GETACTIVEINVERTERS:
+        /* a card without inverters may answer with an error */
+        if (ok) {
+            r->ninverters = res->length;
+            memcpy(r->inverters, res->data, res->length);
+        }
+        fronius_probe_next(pr, FRONIUS_CMD_IFCARD_GETACTIVESENSORS);
+        return;
+
+    default:
+        if (ok) {
+            r->nsensors = res->length;
+            memcpy(r->sensors, res->data, res->length);
+        }
+        fronius_probe_done(pr, 0);
+        return;
+    }
+}
+
+static int fronius_probe_start(struct fronius_prober *pr, const char *name)
+{
+    /* any baudrate will do for an Interface Card easy, the first one tried
+       is needed for the others */
+    pr->dev = fronius_open_flags(name, FRONIUS_IFC_TYPE_INTERFACECARD,
+                                 fronius_probe_baudrates[0],
+                                 FRONIUS_OPEN_NONBLOCK);
+    if (!pr->dev)
+        return -1;
+
+    /* the line speed behind a network port is unknown */
+    if (!pr->dev->old_tio)
+        pr->dev->baudrate = FRONIUS_BAUDRATE_AUTO;
+
+    pr->dev->probing = 1;
+    pr->command = FRONIUS_CMD_IFCARD_GETVERSION;
+
+    return fronius_submit(pr->dev, FRONIUS_DEVICE_INTERFACECARD, 0,
+                          pr->command, fronius_probe_complete, pr);
+}
+
+int fronius_probe_many(const char *const *names, size_t n,
+                       struct fronius_probe_result *results, int timeout)
+{
+    struct fronius_prober *probers;
+    struct fronius_mux *mux;
+    struct timespec started;
+    int active = 0, found = 0, error = ETIMEDOUT, left;
+    size_t i;
+
+    probers = calloc(n ? n : 1, sizeof(*probers));
+    if (!probers)
+        return -1;
+
+    mux = fronius_mux_new();
+    if (!mux) {
+        free(probers);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    for (i = 0; i < n; ++i) {
+        struct fronius_prober *pr = &probers[i];
+
+        memset(&results[i], 0, sizeof(results[i]));
+        pr->res = &results[i];
+        pr->started = started;
+        pr->active = &active;
+        active++;
+
+        if (fronius_probe_start(pr, names[i]) < 0 ||
+            fronius_mux_add(mux, pr->dev) < 0)
+            fronius_probe_done(pr, errno);
+    }
+
+    while (active > 0) {
+        left = -1;
+        if (timeout >= 0) {
+            left = timeout - (int) fronius_probe_ms(&started);
+            if (left <= 0)
+                break;
+        }
+
+        if (fronius_mux_run(mux, left) < 0) {
+            error = errno;
+            break;
+        }
+    }
+
+    for (i = 0; i < n; ++i) {
+        struct fronius_prober *pr = &probers[i];
+
+        /* out of time, or the multiplexer failed */
+        if (pr->command)
+            fronius_probe_done(pr, error);
+
+        if (pr->dev) {
+            fronius_mux_del(mux, pr->dev);
+            fronius_close(pr->dev);
+        }
+
+        if (!results[i].error)
+            found++;
+    }
+
+    fronius_mux_free(mux);
+    free(probers);
+
+    return found;
+}
+
 int fronius_probe(const char *dev_name, fronius_ifc_type_t *ifc_type,
                   fronius_baudrate_t *baudrate)
 {
-    return -1;
+    struct fronius_probe_result res;
+
+    if (fronius_probe_many(&dev_name, 1, &res, -1) < 0)
+        return -1;
+
+    if (res.error) {
+        errno = res.error;
+        return -1;
+    }
+
+    if (ifc_type)
+        *ifc_type = res.ifc_type;
+    if (baudrate)
+        *baudrate = res.baudrate;
+
+    return 0;
 }
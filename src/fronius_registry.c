@@ -0,0 +1,278 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * The value commands are listed once as (command, device class, unit,
+ * volatility); the command table indexed by id and the public fronius_cmds
+ * list are both expanded from it at compile time.
+ */
+
+#define FRONIUS_VALUE_CMDS(X)						\
+    /* commands for inverters */					\
+    X(POWER_NOW,                      INVERTER,   W,    NOW)		\
+    X(ENERGY_TOTAL,                   INVERTER,   WH,   TOTAL)	\
+    X(ENERGY_DAY,                     INVERTER,   WH,   DAY)		\
+    X(ENERGY_YEAR,                    INVERTER,   WH,   YEAR)		\
+    X(AC_CURRENT_NOW,                 INVERTER,   A,    NOW)		\
+    X(AC_VOLTAGE_NOW,                 INVERTER,   V,    NOW)		\
+    X(AC_FREQUENCY_NOW,               INVERTER,   HZ,   NOW)		\
+    X(DC_CURRENT_NOW,                 INVERTER,   A,    NOW)		\
+    X(DC_VOLTAGE_NOW,                 INVERTER,   V,    NOW)		\
+    X(YIELD_DAY,                      INVERTER,   CURR, DAY)		\
+    X(MAX_POWER_DAY,                  INVERTER,   W,    DAY)		\
+    X(MAX_AC_VOLTAGE_DAY,             INVERTER,   V,    DAY)		\
+    X(MIN_AC_VOLTAGE_DAY,             INVERTER,   V,    DAY)		\
+    X(MAX_DC_VOLTAGE_DAY,             INVERTER,   V,    DAY)		\
+    X(OPERATING_HOURS_DAY,            INVERTER,   MIN,  DAY)		\
+    X(YIELD_YEAR,                     INVERTER,   CURR, YEAR)		\
+    X(MAX_POWER_YEAR,                 INVERTER,   W,    YEAR)		\
+    X(MAX_AC_VOLTAGE_YEAR,            INVERTER,   V,    YEAR)		\
+    X(MIN_AC_VOLTAGE_YEAR,            INVERTER,   V,    YEAR)		\
+    X(MAX_DC_VOLTAGE_YEAR,            INVERTER,   V,    YEAR)		\
+    X(OPERATING_HOURS_YEAR,           INVERTER,   MIN,  YEAR)		\
+    X(YIELD_TOTAL,                    INVERTER,   CURR, TOTAL)	\
+    X(MAX_POWER_TOTAL,                INVERTER,   W,    TOTAL)	\
+    X(MAX_AC_VOLTAGE_TOTAL,           INVERTER,   V,    TOTAL)	\
+    X(MIN_AC_VOLTAGE_TOTAL,           INVERTER,   V,    TOTAL)	\
+    X(MAX_DC_VOLTAGE_TOTAL,           INVERTER,   V,    TOTAL)	\
+    X(OPERATING_HOURS_TOTAL,          INVERTER,   MIN,  TOTAL)	\
+    /* commands for 3-phase inverters */				\
+    X(CURRENT_PHASE1,                 INVERTER,   A,    NOW)		\
+    X(CURRENT_PHASE2,                 INVERTER,   A,    NOW)		\
+    X(CURRENT_PHASE3,                 INVERTER,   A,    NOW)		\
+    X(VOLTAGE_PHASE1,                 INVERTER,   V,    NOW)		\
+    X(VOLTAGE_PHASE2,                 INVERTER,   V,    NOW)		\
+    X(VOLTAGE_PHASE3,                 INVERTER,   V,    NOW)		\
+    X(AMBIENT_TEMPERATUR,             INVERTER,   C,    NOW)		\
+    X(FAN_SPEED_FRONT_LEFT,           INVERTER,   RPM,  NOW)		\
+    X(FAN_SPEED_FRONT_RIGHT,          INVERTER,   RPM,  NOW)		\
+    X(FAN_SPEED_REAR_LEFT,            INVERTER,   RPM,  NOW)		\
+    X(FAN_SPEED_REAR_RIGHT,           INVERTER,   RPM,  NOW)		\
+    /* commands for sensor card/sensor box */				\
+    X(TEMPERATURE_CHANNEL1_NOW,       SENSORCARD, TEMP, NOW)		\
+    X(TEMPERATURE_CHANNEL2_NOW,       SENSORCARD, TEMP, NOW)		\
+    X(INSOLATION_NOW,                 SENSORCARD, WPM2, NOW)		\
+    X(MIN_TEMPERATURE_CHANNEL1_DAY,   SENSORCARD, TEMP, DAY)		\
+    X(MAX_TEMPERATURE_CHANNEL1_DAY,   SENSORCARD, TEMP, DAY)		\
+    X(MIN_TEMPERATURE_CHANNEL1_YEAR,  SENSORCARD, TEMP, YEAR)		\
+    X(MAX_TEMPERATURE_CHANNEL1_YEAR,  SENSORCARD, TEMP, YEAR)		\
+    X(MIN_TEMPERATURE_CHANNEL1_TOTAL, SENSORCARD, TEMP, TOTAL)	\
+    X(MAX_TEMPERATURE_CHANNEL1_TOTAL, SENSORCARD, TEMP, TOTAL)	\
+    X(MIN_TEMPERATURE_CHANNEL2_DAY,   SENSORCARD, TEMP, DAY)		\
+    X(MAX_TEMPERATURE_CHANNEL2_DAY,   SENSORCARD, TEMP, DAY)		\
+    X(MIN_TEMPERATURE_CHANNEL2_YEAR,  SENSORCARD, TEMP, YEAR)		\
+    X(MAX_TEMPERATURE_CHANNEL2_YEAR,  SENSORCARD, TEMP, YEAR)		\
+    X(MIN_TEMPERATURE_CHANNEL2_TOTAL, SENSORCARD, TEMP, TOTAL)	\
+    X(MAX_TEMPERATURE_CHANNEL2_TOTAL, SENSORCARD, TEMP, TOTAL)	\
+    X(MAX_INSOLATION_DAY,             SENSORCARD, WPM2, DAY)		\
+    X(MAX_INSOLATION_YEAR,            SENSORCARD, WPM2, YEAR)		\
+    X(MAX_INSOLATION_TOTAL,           SENSORCARD, WPM2, TOTAL)	\
+    X(DIGITAL_CHANNEL1_NOW,           SENSORCARD, TEMP, NOW)		\
+    X(DIGITAL_CHANNEL2_NOW,           SENSORCARD, TEMP, NOW)		\
+    X(MAX_DIGITAL_CHANNEL1_DAY,       SENSORCARD, TEMP, DAY)		\
+    X(MAX_DIGITAL_CHANNEL1_YEAR,      SENSORCARD, TEMP, YEAR)		\
+    X(MAX_DIGITAL_CHANNEL1_TOTAL,     SENSORCARD, TEMP, TOTAL)	\
+    X(MAX_DIGITAL_CHANNEL2_DAY,       SENSORCARD, TEMP, DAY)		\
+    X(MAX_DIGITAL_CHANNEL2_YEAR,      SENSORCARD, TEMP, YEAR)		\
+    X(MAX_DIGITAL_CHANNEL2_TOTAL,     SENSORCARD, TEMP, TOTAL)
+
+/* values are a 16 bit mantissa followed by the exponent */
+#define FRONIUS_VALUE_LENGTH	3
+
+#define FRONIUS_CMD_ENTRY(cmd, dev, min, max, unit, vol)		\
+    [cmd] = { cmd, FRONIUS_DEVICE_##dev, min, max,			\
+              FRONIUS_UNIT_##unit, FRONIUS_CACHE_##vol },
+
+#define FRONIUS_VALUE_ENTRY(cmd, dev, unit, vol)			\
+    FRONIUS_CMD_ENTRY(FRONIUS_CMD_##cmd, dev, FRONIUS_VALUE_LENGTH,	\
+                      FRONIUS_VALUE_LENGTH, unit, vol)
+
+#define FRONIUS_QUERY_ENTRY(cmd, dev, unit, vol)			\
+    { FRONIUS_CMD_##cmd, FRONIUS_UNIT_##unit },
+
+/* unused ids are all zero, there is no command 0x00 */
+static const struct fronius_cmd_info fronius_cmd_table[256] = {
+    /* commands for the interface card */
+    FRONIUS_CMD_ENTRY(FRONIUS_CMD_IFCARD_GETVERSION,
+                      INTERFACECARD, 4, 4, NONE, INFO)
+    FRONIUS_CMD_ENTRY(FRONIUS_CMD_IFCARD_GETDEVICETYPE,
+                      INTERFACECARD, 1, 1, NONE, INFO)
+    FRONIUS_CMD_ENTRY(FRONIUS_CMD_IFCARD_GETTIME,
+                      INTERFACECARD, 6, 6, NONE, NOW)
+    FRONIUS_CMD_ENTRY(FRONIUS_CMD_IFCARD_GETACTIVEINVERTERS,
+                      INTERFACECARD, 0, FRONIUS_MAX_INVERTERS, NONE, NOW)
+    FRONIUS_CMD_ENTRY(FRONIUS_CMD_IFCARD_GETACTIVESENSORS,
+                      INTERFACECARD, 0, FRONIUS_MAX_SENSORS, NONE, NOW)
+    FRONIUS_CMD_ENTRY(FRONIUS_CMD_IFCARD_GETLOCALNETSTATUS,
+                      INTERFACECARD, 1, 1, NONE, NOW)
+    FRONIUS_VALUE_CMDS(FRONIUS_VALUE_ENTRY)
+};
+
+const struct fronius_query_value fronius_cmds[] = {
+    FRONIUS_VALUE_CMDS(FRONIUS_QUERY_ENTRY)
+};
+
+/* the public declaration carries the size */
+typedef char fronius_cmds_count_check[
+    sizeof(fronius_cmds) / sizeof(fronius_cmds[0]) == FRONIUS_CMDS_COUNT ?
+    1 : -1];
+
+#define FRONIUS_NAME_ENTRY(cmd, dev, unit, vol)			\
+    [FRONIUS_CMD_##cmd] = #cmd,
+
+static const char *const fronius_cmd_names[256] = {
+    [FRONIUS_CMD_IFCARD_GETVERSION]         = "IFCARD_GETVERSION",
+    [FRONIUS_CMD_IFCARD_GETDEVICETYPE]      = "IFCARD_GETDEVICETYPE",
+    [FRONIUS_CMD_IFCARD_GETTIME]            = "IFCARD_GETTIME",
+    [FRONIUS_CMD_IFCARD_GETACTIVEINVERTERS] = "IFCARD_GETACTIVEINVERTERS",
+    [FRONIUS_CMD_IFCARD_GETACTIVESENSORS]   = "IFCARD_GETACTIVESENSORS",
+    [FRONIUS_CMD_IFCARD_GETLOCALNETSTATUS]  = "IFCARD_GETLOCALNETSTATUS",
+    FRONIUS_VALUE_CMDS(FRONIUS_NAME_ENTRY)
+};
+
+const char *const fronius_unit_str[] = {
+    [FRONIUS_UNIT_W]    = "W",
+    [FRONIUS_UNIT_WH]   = "Wh",
+    [FRONIUS_UNIT_A]    = "A",
+    [FRONIUS_UNIT_V]    = "V",
+    [FRONIUS_UNIT_HZ]   = "Hz",
+    [FRONIUS_UNIT_MIN]  = "min",
+    [FRONIUS_UNIT_C]    = "°C",
+    [FRONIUS_UNIT_RPM]  = "rpm",
+    [FRONIUS_UNIT_WPM2] = "W/m²",
+    [FRONIUS_UNIT_CURR] = "",
+    [FRONIUS_UNIT_TEMP] = "",
+    [FRONIUS_UNIT_NONE] = "",
+};
+
+struct fronius_devtype {
+    const char *device;
+    const char *type;
+};
+
+static const struct fronius_devtype fronius_devtype_unknown = {
+    "Unknown device or option, device or option not active", NULL
+};
+
+static const struct fronius_devtype fronius_inverter_types[256] = {
+    /*  id,     device/option                    type                 */
+    [0xfe] = { "Fronius IG 15",                 "Inverter"         },
+    [0xfd] = { "Fronius IG 20",                 "Inverter"         },
+    [0xfc] = { "Fronius IG 30",                 "Inverter"         },
+    [0xfb] = { "Fronius IG 30 Dummy",           "Inverter"         },
+    [0xfa] = { "Fronius IG 40",                 "Inverter"         },
+    [0xf9] = { "Fronius IG 60 / IG 60 HV",      "Inverter"         },
+    [0xf6] = { "Fronius IG 300",                "3-phase Inverter" },
+    [0xf5] = { "Fronius IG 400",                "3-phase Inverter" },
+    [0xf4] = { "Fronius IG 500",                "3-phase Inverter" },
+    [0xf3] = { "Fronius IG 60 / IG 60 HV",      "Inverter"         },
+    [0xee] = { "Fronius IG 2000",               "Inverter"         },
+    [0xed] = { "Fronius IG 3000",               "Inverter"         },
+    [0xeb] = { "Fronius IG 4000",               "Inverter"         },
+    [0xea] = { "Fronius IG 5100",               "Inverter"         },
+    [0xe5] = { "Fronius IG 2500-LV",            "Inverter"         },
+    [0xe3] = { "Fronius IG 4500-LV",            "Inverter"         },
+    [0xdf] = { "Fronius IG Plus 11.4-3 Delta",  "3-phase Inverter" },
+    [0xde] = { "Fronius IG Plus 11.4-1 UNI",    "Inverter"         },
+    [0xdd] = { "Fronius IG Plus 10.0-1 UNI",    "Inverter"         },
+    [0xdc] = { "Fronius IG Plus 7.5-1 UNI",     "Inverter"         },
+    [0xdb] = { "Fronius IG Plus 6.0-1 UNI",     "Inverter"         },
+    [0xda] = { "Fronius IG Plus 5.0-1 UNI",     "Inverter"         },
+    [0xd9] = { "Fronius IG Plus 3.8-1 UNI",     "Inverter"         },
+    [0xd8] = { "Fronius IG Plus 3.0-1 UNI",     "Inverter"         },
+    [0xd7] = { "Fronius IG Plus 120-3",         "3-phase Inverter" },
+    [0xd6] = { "Fronius IG Plus 70-2",          "2-phase Inverter" },
+    [0xd5] = { "Fronius IG Plus 70-1",          "Inverter"         },
+    [0xd4] = { "Fronius IG Plus 35-1",          "Inverter"         },
+    [0xd3] = { "Fronius IG Plus 150-3",         "3-phase Inverter" },
+    [0xd2] = { "Fronius IG Plus 100-2",         "2-phase Inverter" },
+    [0xd1] = { "Fronius IG Plus 100-1",         "Inverter"         },
+    [0xd0] = { "Fronius IG Plus 50-1",          "Inverter"         },
+    [0xcf] = { "Fronius IG Plus 12.0-3 WYE277", "Inverter"         },
+};
+
+static const struct fronius_devtype fronius_sensor_types[256] = {
+    [0xfe] = { "Sensor card / Sensor box",      "DatCom component" },
+};
+
+const struct fronius_cmd_info *fronius_cmd_info(uint8_t command)
+{
+    const struct fronius_cmd_info *info = &fronius_cmd_table[command];
+
+    return info->command ? info : NULL;
+}
+
+const char *fronius_cmd_name(uint8_t command)
+{
+    return fronius_cmd_names[command];
+}
+
+fronius_unit_t fronius_cmd_unit(uint8_t command)
+{
+    return fronius_cmd_table[command].command ?
+           fronius_cmd_table[command].unit : FRONIUS_UNIT_NONE;
+}
+
+fronius_cache_class_t fronius_cmd_volatility(uint8_t command)
+{
+    /* unknown commands are FRONIUS_CACHE_NOW as well */
+    return fronius_cmd_table[command].volatility;
+}
+
+int fronius_cmd_length_ok(uint8_t command, uint8_t length)
+{
+    const struct fronius_cmd_info *info = &fronius_cmd_table[command];
+
+    /* anything else queried is taken as a value */
+    if (!info->command)
+        return length == FRONIUS_VALUE_LENGTH;
+
+    return length >= info->min_length && length <= info->max_length;
+}
+
+const char *fronius_unit_name(fronius_unit_t unit)
+{
+    if ((unsigned int) unit > FRONIUS_UNIT_NONE)
+        return "";
+
+    return fronius_unit_str[unit];
+}
+
+static const struct fronius_devtype *fronius_devtype(uint8_t device,
+                                                     uint8_t id)
+{
+    const struct fronius_devtype *t;
+
+    switch (device) {
+    case FRONIUS_DEVICE_INVERTER:
+        t = &fronius_inverter_types[id];
+        break;
+    case FRONIUS_DEVICE_SENSORCARD:
+        t = &fronius_sensor_types[id];
+        break;
+    default:
+        return &fronius_devtype_unknown;
+    }
+
+    return t->device ? t : &fronius_devtype_unknown;
+}
+
+const char *fronius_device_name(uint8_t device, uint8_t id)
+{
+    return fronius_devtype(device, id)->device;
+}
+
+const char *fronius_device_type(uint8_t device, uint8_t id)
+{
+    return fronius_devtype(device, id)->type;
+}
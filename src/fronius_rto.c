@@ -0,0 +1,158 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * Receive timeout estimation as done for the TCP retransmission timer
+ * (RFC 6298): a smoothed round-trip time and its mean deviation are kept
+ * per baudrate and command, the timeout is srtt + 4 * rttvar. Commands
+ * without samples yet use the estimate of all commands at that baudrate.
+ * Retransmissions back off exponentially. A timeout also doubles the
+ * timeout of the estimate for the following requests, up to a bound,
+ * until one is answered without retransmission (RFC 6298, 5.7); else a
+ * line grown slower than the estimate would time out every first
+ * transmission and never yield a sample. The bound keeps a dead device
+ * from stretching every request to the maximum.
+ */
+
+/* bounds of the receive timeout in microseconds */
+#define FRONIUS_RTO_MIN		(20 * 1000)
+#define FRONIUS_RTO_MAX		(3 * 1000 * 1000)
+
+/* doublings carried over to the following requests */
+#define FRONIUS_RTO_BACKOFF_MAX	3
+
+/* clock granularity added to the deviation term */
+#define FRONIUS_RTO_GRANULARITY	1000
+
+/* receive timeout while probing: the turnaround of the Interface Card added
+   to the line time, or a fixed bound if the line speed is unknown */
+#define FRONIUS_RTO_PROBE_TURNAROUND	(150 * 1000)
+#define FRONIUS_RTO_PROBE_UNKNOWN	(500 * 1000)
+
+static unsigned int fronius_rto_baudidx(fronius_baudrate_t baudrate)
+{
+    switch (baudrate) {
+    case FRONIUS_BAUDRATE_B2400:
+        return 1;
+    case FRONIUS_BAUDRATE_B4800:
+        return 2;
+    case FRONIUS_BAUDRATE_B9600:
+        return 3;
+    case FRONIUS_BAUDRATE_B19200:
+        return 4;
+    default:
+        /* unknown or no serial line */
+        return 0;
+    }
+}
+
+static void fronius_rtt_update(struct fronius_rtt *rtt, uint32_t sample)
+{
+    uint32_t delta;
+
+    if (!rtt->srtt) {
+        rtt->srtt = sample ? sample : 1;
+        rtt->rttvar = sample / 2;
+        return;
+    }
+
+    delta = sample > rtt->srtt ? sample - rtt->srtt : rtt->srtt - sample;
+
+    /* rttvar = 3/4 rttvar + 1/4 delta, srtt = 7/8 srtt + 1/8 sample */
+    rtt->rttvar = rtt->rttvar - rtt->rttvar / 4 + delta / 4;
+    rtt->srtt = rtt->srtt - rtt->srtt / 8 + sample / 8;
+    if (!rtt->srtt)
+        rtt->srtt = 1;
+}
+
+void fronius_rto_sample(struct fronius_dev *dev, uint8_t command,
+                        const struct timespec *sent)
+{
+    struct fronius_rtt_table *t =
+        &dev->rtt[fronius_rto_baudidx(dev->baudrate)];
+    struct timespec now;
+    int64_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (int64_t) (now.tv_sec - sent->tv_sec) * 1000000 +
+         (now.tv_nsec - sent->tv_nsec) / 1000;
+    if (us < 0)
+        us = 0;
+    if (us > FRONIUS_RTO_MAX)
+        us = FRONIUS_RTO_MAX;
+
+    fronius_rtt_update(&t->cmd[command], us);
+    fronius_rtt_update(&t->any, us);
+    t->cmd[command].backoff = 0;
+    t->any.backoff = 0;
+}
+
+/* the estimate the timeout of a command is derived from */
+static struct fronius_rtt *fronius_rto_estimate(struct fronius_dev *dev,
+                                                uint8_t command)
+{
+    struct fronius_rtt_table *t =
+        &dev->rtt[fronius_rto_baudidx(dev->baudrate)];
+
+    return t->cmd[command].srtt ? &t->cmd[command] : &t->any;
+}
+
+void fronius_rto_backoff(struct fronius_dev *dev, uint8_t command)
+{
+    struct fronius_rtt *rtt = fronius_rto_estimate(dev, command);
+
+    if (rtt->srtt && rtt->backoff < FRONIUS_RTO_BACKOFF_MAX)
+        rtt->backoff++;
+}
+
+static long fronius_rto_probe(struct fronius_dev *dev, uint8_t command)
+{
+    const struct fronius_cmd_info *info = fronius_cmd_info(command);
+    unsigned int bps = fronius_serial_bps(dev->baudrate);
+    long bytes = 2 * FRONIUS_MIN_PKTLEN +
+                 (info ? info->max_length : FRONIUS_MAX_DATALEN);
+
+    if (!bps)
+        return FRONIUS_RTO_PROBE_UNKNOWN;
+
+    /* request and longest response, 8N1 makes ten bit times per byte */
+    return bytes * 10 * 1000000L / bps + FRONIUS_RTO_PROBE_TURNAROUND;
+}
+
+long fronius_rto(struct fronius_dev *dev, uint8_t command, int retries)
+{
+    const struct fronius_rtt *rtt = fronius_rto_estimate(dev, command);
+    unsigned int backoff;
+    long rto, var;
+
+    /* be conservative as long as nothing is known, unless a silent port
+       is the expected case */
+    if (!rtt->srtt)
+        return dev->probing ? fronius_rto_probe(dev, command) :
+                              FRONIUS_RTO_MAX;
+
+    var = 4L * rtt->rttvar;
+    if (var < FRONIUS_RTO_GRANULARITY)
+        var = FRONIUS_RTO_GRANULARITY;
+    rto = rtt->srtt + var;
+
+    if (rto < FRONIUS_RTO_MIN)
+        rto = FRONIUS_RTO_MIN;
+
+    /* exponential backoff of retransmissions */
+    for (backoff = rtt->backoff + retries;
+         backoff > 0 && rto < FRONIUS_RTO_MAX; --backoff)
+        rto *= 2;
+
+    return rto < FRONIUS_RTO_MAX ? rto : FRONIUS_RTO_MAX;
+}
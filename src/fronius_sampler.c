@@ -0,0 +1,479 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * Every (number, command) pair is a column with its own period. Columns
+ * are kept in a binary heap ordered by their next due time, and the bus
+ * always serves the most overdue one first. Columns sharing a period are
+ * spread evenly over it, so that they do not queue up behind each other
+ * at the same instant. Due times advance on a fixed grid from the start,
+ * so a late sample does not shift the following ones; periods which pass
+ * completely while the bus is busy are skipped and counted as missed.
+ *
+ * The samples of all columns live in one block per field, timestamps,
+ * values, fixed-point values and status codes, each column owning a
+ * power-of-two slice of it.
+ */
+
+struct fronius_column {
+	/* request frame, checksum included */
+	struct fronius_pkt	frame;
+	/* period and next due time in us (CLOCK_MONOTONIC) */
+	int64_t			period;
+	int64_t			due;
+	/* heap position */
+	size_t			slot;
+	/* start of the ring slice, its size - 1 and samples written */
+	size_t			base;
+	size_t			mask;
+	uint64_t		head;
+};
+
+struct fronius_sampler {
+	struct fronius_dev	*dev;
+	struct fronius_column	*columns;
+	size_t			ncolumns;
+	size_t			nrates;
+	/* column index of a number is numidx[number] * nrates + rate index
+	   of the command, 0xff marks numbers and commands not sampled */
+	uint8_t			numidx[256];
+	uint8_t			cmdidx[256];
+	/* columns ordered by due time */
+	struct fronius_column	**heap;
+	/* columnar sample store */
+	int64_t			*time;
+	double			*value;
+	struct fronius_fixed	*fixed;
+	uint8_t			*error;
+	/* column in flight and the wall clock time its request went out */
+	struct fronius_column	*busy;
+	int64_t			sent;
+	/* wall clock minus monotonic clock at start, in us */
+	int64_t			epoch;
+	int			running;
+	/* statistical values */
+	struct fronius_sampler_stats	stats;
+};
+
+static int64_t fronius_sampler_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fronius_sampler_swap(struct fronius_sampler *s, size_t a, size_t b)
+{
+    struct fronius_column *c = s->heap[a];
+
+    s->heap[a] = s->heap[b];
+    s->heap[b] = c;
+    s->heap[a]->slot = a;
+    s->heap[b]->slot = b;
+}
+
+/* restore the heap order after the due time of a column grew */
+static void fronius_sampler_sift(struct fronius_sampler *s, size_t i)
+{
+    size_t l, min;
+
+    for (;;) {
+        l = 2 * i + 1;
+        min = i;
+        if (l < s->ncolumns && s->heap[l]->due < s->heap[min]->due)
+            min = l;
+        if (l + 1 < s->ncolumns && s->heap[l + 1]->due < s->heap[min]->due)
+            min = l + 1;
+        if (min == i)
+            return;
+        fronius_sampler_swap(s, i, min);
+        i = min;
+    }
+}
+
+static void fronius_sampler_heapify(struct fronius_sampler *s)
+{
+    size_t i;
+
+    for (i = 0; i < s->ncolumns; ++i) {
+        s->heap[i] = &s->columns[i];
+        s->columns[i].slot = i;
+    }
+
+    for (i = s->ncolumns / 2; i-- > 0;)
+        fronius_sampler_sift(s, i);
+}
+
+static void fronius_sampler_complete(struct fronius_dev *,
+                                     const struct fronius_result *, void *);
+
+/* put the most overdue column on the bus if it is due */
+static int fronius_sampler_next(struct fronius_sampler *s)
+{
+    struct fronius_column *c = s->heap[0];
+    int64_t now, late;
+
+    if (!s->running || s->busy)
+        return 0;
+
+    now = fronius_sampler_now();
+    if (c->due > now)
+        return 0;
+
+    if (fronius_xfer_start_frame(s->dev, &c->frame,
+                                 fronius_sampler_complete, s) < 0)
+        return -1;
+
+    s->busy = c;
+    s->sent = now + s->epoch;
+    fronius_hist_add(&s->stats.lateness, now - c->due);
+
+    /* stay on the grid, skip the periods which are gone already */
+    c->due += c->period;
+    if (c->due <= now) {
+        late = (now - c->due) / c->period + 1;
+        s->stats.missed += late;
+        c->due += late * c->period;
+    }
+    fronius_sampler_sift(s, 0);
+
+    return 0;
+}
+
+static void fronius_sampler_complete(struct fronius_dev *dev,
+                                     const struct fronius_result *res,
+                                     void *arg)
+{
+    struct fronius_sampler *s = arg;
+    struct fronius_column *c = s->busy;
+    size_t i = c->base + (c->head & c->mask);
+    fronius_error_t err = res->error;
+
+    (void) dev;
+
+    if (err == FRONIUS_ERR_NOERROR &&
+        !fronius_cmd_length_ok(res->command, res->length))
+        err = FRONIUS_ERR_INVALID_RESPONSE;
+    if (err == FRONIUS_ERR_NOERROR)
+        err = fronius_fixed_decode(res->data, &s->fixed[i]);
+    if (err == FRONIUS_ERR_NOERROR)
+        fronius_decode_value(res->data, &s->value[i]);
+
+    if (err != FRONIUS_ERR_NOERROR) {
+        s->value[i] = 0.0;
+        s->fixed[i].mantissa = 0;
+        s->fixed[i].exponent = 0;
+        s->stats.errors++;
+    }
+
+    s->time[i] = s->sent / 1000;
+    s->error[i] = err;
+    c->head++;
+    s->stats.samples++;
+    s->busy = NULL;
+
+    /* the next column may be overdue already */
+    fronius_sampler_next(s);
+}
+
+struct fronius_sampler *fronius_sampler_new(struct fronius_dev *dev,
+                                            uint8_t device,
+                                            const char *list, size_t size,
+                                            const struct fronius_sample_rate *rates,
+                                            size_t nrates)
+{
+    struct fronius_sampler *s;
+    struct fronius_column *c;
+    size_t n, i, r, depth, total = 0;
+
+    /* the list is terminated by a zero entry or by its size */
+    for (n = 0; n < size && list[n] != 0; ++n);
+
+    if (!n || n > 0xff || !nrates || nrates > 0xff) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+
+    memset(s->numidx, 0xff, sizeof(s->numidx));
+    memset(s->cmdidx, 0xff, sizeof(s->cmdidx));
+    s->dev = dev;
+    s->nrates = nrates;
+    s->ncolumns = n * nrates;
+
+    for (r = 0; r < nrates; ++r) {
+        if (!rates[r].period || !rates[r].depth ||
+            s->cmdidx[rates[r].command] != 0xff) {
+            free(s);
+            errno = EINVAL;
+            return NULL;
+        }
+        s->cmdidx[rates[r].command] = r;
+    }
+
+    s->columns = calloc(s->ncolumns, sizeof(*s->columns));
+    s->heap = calloc(s->ncolumns, sizeof(*s->heap));
+    if (!s->columns || !s->heap)
+        goto nomem;
+
+    for (i = 0; i < n; ++i) {
+        s->numidx[(uint8_t) list[i]] = i;
+
+        for (r = 0; r < nrates; ++r) {
+            c = &s->columns[i * nrates + r];
+
+            /* the pairs never change, so their frames are built once */
+            fronius_pkt_init(&c->frame);
+            c->frame.device = device;
+            c->frame.number = list[i];
+            c->frame.command = rates[r].command;
+            fronius_pkt_checksum(&c->frame);
+
+            for (depth = 1; depth < rates[r].depth; depth <<= 1);
+            c->period = rates[r].period * 1000LL;
+            c->base = total;
+            c->mask = depth - 1;
+            total += depth;
+        }
+    }
+
+    s->time = malloc(total * sizeof(*s->time));
+    s->value = malloc(total * sizeof(*s->value));
+    s->fixed = malloc(total * sizeof(*s->fixed));
+    s->error = malloc(total * sizeof(*s->error));
+    if (!s->time || !s->value || !s->fixed || !s->error)
+        goto nomem;
+
+    return s;
+
+nomem:
+    fronius_sampler_free(s);
+    errno = ENOMEM;
+    return NULL;
+}
+
+void fronius_sampler_free(struct fronius_sampler *s)
+{
+    if (!s)
+        return;
+
+    free(s->columns);
+    free(s->heap);
+    free(s->time);
+    free(s->value);
+    free(s->fixed);
+    free(s->error);
+    free(s);
+}
+
+int fronius_sampler_start(struct fronius_sampler *s)
+{
+    struct timespec ts;
+    int64_t now;
+    size_t i, j, rank, peers;
+
+    if (s->running || s->busy) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = fronius_sampler_now();
+    s->epoch = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - now;
+
+    /* spread the columns of a period evenly over it */
+    for (i = 0; i < s->ncolumns; ++i) {
+        for (j = 0, rank = 0, peers = 0; j < s->ncolumns; ++j) {
+            if (s->columns[j].period != s->columns[i].period)
+                continue;
+            if (j < i)
+                rank++;
+            peers++;
+        }
+        s->columns[i].due = now + s->columns[i].period * rank / peers;
+    }
+
+    fronius_sampler_heapify(s);
+    memset(&s->stats, 0, sizeof(s->stats));
+    s->running = 1;
+
+    if (fronius_sampler_next(s) < 0) {
+        s->running = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+void fronius_sampler_stop(struct fronius_sampler *s)
+{
+    /* the request in flight completes, but no further one is submitted */
+    s->running = 0;
+}
+
+int fronius_sampler_timeout(struct fronius_sampler *s)
+{
+    int64_t us;
+
+    if (s->busy)
+        return fronius_timeout(s->dev);
+
+    if (!s->running)
+        return -1;
+
+    /* round up so that the column is due when poll returns */
+    us = s->heap[0]->due - fronius_sampler_now();
+    return us > 0 ? (us + 999) / 1000 : 0;
+}
+
+int fronius_sampler_process(struct fronius_sampler *s, int revents)
+{
+    int rv = 0;
+
+    /* completions submit the next due column themselves */
+    if (s->busy)
+        rv = fronius_process(s->dev, revents);
+
+    if (fronius_sampler_next(s) < 0)
+        return -1;
+
+    return rv < 0 ? rv : 0;
+}
+
+int fronius_sampler_run(struct fronius_sampler *s, int timeout)
+{
+    int64_t end = fronius_sampler_now() + timeout * 1000LL;
+    int64_t left;
+    int wait, revents;
+
+    while ((left = end - fronius_sampler_now()) > 0) {
+        wait = fronius_sampler_timeout(s);
+        if (wait < 0 || wait > (left + 999) / 1000)
+            wait = (left + 999) / 1000;
+
+        revents = s->dev->transport->wait(s->dev, fronius_events(s->dev),
+                                          wait);
+        if (revents == -1)
+            return -1;
+
+        if (fronius_sampler_process(s, revents) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* first sample of a column at or after the given time */
+static uint64_t fronius_sampler_find(struct fronius_sampler *s,
+                                     const struct fronius_column *c,
+                                     uint64_t lo, uint64_t hi, int64_t t)
+{
+    uint64_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (s->time[c->base + (mid & c->mask)] < t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+int fronius_sampler_window(struct fronius_sampler *s, uint8_t number,
+                           uint8_t command, int64_t from, int64_t to,
+                           struct fronius_window *w)
+{
+    const struct fronius_column *c;
+    uint64_t oldest, first, last;
+    size_t start, n, i;
+
+    if (s->numidx[number] == 0xff || s->cmdidx[command] == 0xff) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    c = &s->columns[s->numidx[number] * s->nrates + s->cmdidx[command]];
+    oldest = c->head > c->mask ? c->head - c->mask - 1 : 0;
+
+    /* timestamps never decrease within a column */
+    first = fronius_sampler_find(s, c, oldest, c->head, from);
+    last = fronius_sampler_find(s, c, first, c->head, to);
+
+    start = first & c->mask;
+    n = last - first;
+
+    w->seq = first;
+    w->count[0] = n < c->mask + 1 - start ? n : c->mask + 1 - start;
+    w->count[1] = n - w->count[0];
+
+    for (i = 0; i < 2; ++i) {
+        size_t at = c->base + (i ? 0 : start);
+
+        w->time[i] = &s->time[at];
+        w->value[i] = &s->value[at];
+        w->fixed[i] = &s->fixed[at];
+        w->error[i] = &s->error[at];
+    }
+
+    return n;
+}
+
+struct fronius_dev *fronius_sampler_dev(struct fronius_sampler *s)
+{
+    return s->dev;
+}
+
+size_t fronius_sampler_ncolumns(struct fronius_sampler *s)
+{
+    return s->ncolumns;
+}
+
+const struct fronius_pkt *fronius_sampler_frame(struct fronius_sampler *s,
+                                                size_t i)
+{
+    return &s->columns[i].frame;
+}
+
+int fronius_sampler_last(struct fronius_sampler *s, size_t i, int64_t *time,
+                         double *value, fronius_error_t *error)
+{
+    const struct fronius_column *c = &s->columns[i];
+    size_t j;
+
+    if (!c->head)
+        return 0;
+
+    j = c->base + ((c->head - 1) & c->mask);
+    *time = s->time[j];
+    *value = s->value[j];
+    *error = s->error[j];
+
+    return 1;
+}
+
+int fronius_sampler_stats(struct fronius_sampler *s,
+                          struct fronius_sampler_stats *stats)
+{
+    *stats = s->stats;
+
+    return 0;
+}
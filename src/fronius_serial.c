@@ -0,0 +1,322 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include <config.h>
+
+#ifdef HAVE_LINUX_SERIAL_H
+#include <linux/serial.h>
+#endif
+
+#include "fronius-private.h"
+
+/*
+ * In non-canonical mode with VTIME 0, the tty only reports readability to
+ * poll() once VMIN bytes are buffered. Setting VMIN to the length of the
+ * expected frame, and to the rest of it after a partial read, turns the
+ * byte trickle of a UART into one wakeup and one read() per frame.
+ */
+
+/* an error response carries the command and the error code */
+#define FRONIUS_ERROR_DATALEN	2
+
+struct fronius_lowlat {
+	/* termios as set, only VMIN changes */
+	struct termios	tio;
+	/* serial_struct flags before low latency was requested */
+	int		old_flags;
+	int		flags_set;
+	/* receive FIFO trigger level before it was lowered */
+	char		trig_path[96];
+	char		old_trig[16];
+};
+
+static int64_t fronius_serial_us(const struct timespec *from,
+                                 const struct timespec *to)
+{
+    int64_t us = (int64_t) (to->tv_sec - from->tv_sec) * 1000000 +
+                 (to->tv_nsec - from->tv_nsec) / 1000;
+
+    return us > 0 ? us : 0;
+}
+
+unsigned int fronius_serial_bps(fronius_baudrate_t baudrate)
+{
+    switch (baudrate) {
+    case FRONIUS_BAUDRATE_B2400:
+        return 2400;
+    case FRONIUS_BAUDRATE_B4800:
+        return 4800;
+    case FRONIUS_BAUDRATE_B9600:
+        return 9600;
+    case FRONIUS_BAUDRATE_B19200:
+        return 19200;
+    default:
+        return 0;
+    }
+}
+
+/* ask the driver to push received bytes up without delay */
+static int fronius_serial_driver(struct fronius_dev *dev, int enable)
+{
+#if defined(HAVE_LINUX_SERIAL_H) && defined(TIOCGSERIAL)
+    struct fronius_lowlat *ll = dev->lowlat;
+    struct serial_struct ss;
+
+    if (!enable) {
+        if (!ll->flags_set || ioctl(dev->fd, TIOCGSERIAL, &ss) == -1)
+            return 0;
+        ss.flags = ll->old_flags;
+        ioctl(dev->fd, TIOCSSERIAL, &ss);
+        return 0;
+    }
+
+    if (ioctl(dev->fd, TIOCGSERIAL, &ss) == -1)
+        return 0;
+
+    ll->old_flags = ss.flags;
+    ss.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(dev->fd, TIOCSSERIAL, &ss) == -1)
+        return 0;
+
+    ll->flags_set = 1;
+    return FRONIUS_LOWLAT_DRIVER;
+#else
+    (void) dev;
+    (void) enable;
+    return 0;
+#endif
+}
+
+/* lower the receive FIFO trigger level of 8250 style UARTs to one byte */
+static int fronius_serial_fifo(struct fronius_dev *dev, int enable)
+{
+    struct fronius_lowlat *ll = dev->lowlat;
+    char name[64];
+    const char *base;
+    ssize_t len;
+    int fd;
+
+    if (!enable) {
+        if (!ll->trig_path[0])
+            return 0;
+        fd = open(ll->trig_path, O_WRONLY | O_CLOEXEC);
+        if (fd == -1)
+            return 0;
+        if (write(fd, ll->old_trig, strlen(ll->old_trig)) < 0) {
+            /* nothing left to do about it */
+        }
+        close(fd);
+        return 0;
+    }
+
+    if (ttyname_r(dev->fd, name, sizeof(name)))
+        return 0;
+    base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+
+    snprintf(ll->trig_path, sizeof(ll->trig_path),
+             "/sys/class/tty/%s/rx_trig_bytes", base);
+    fd = open(ll->trig_path, O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        goto none;
+
+    len = read(fd, ll->old_trig, sizeof(ll->old_trig) - 1);
+    if (len <= 0 || lseek(fd, 0, SEEK_SET) == -1 || write(fd, "1", 1) != 1) {
+        close(fd);
+        goto none;
+    }
+    ll->old_trig[len] = '\0';
+    close(fd);
+
+    return FRONIUS_LOWLAT_FIFO;
+
+none:
+    ll->trig_path[0] = '\0';
+    return 0;
+}
+
+/* set the read threshold, VTIME 0 makes poll() honour it */
+static int fronius_serial_vmin(struct fronius_dev *dev, size_t bytes)
+{
+    struct fronius_lowlat *ll = dev->lowlat;
+
+    if (bytes < 1)
+        bytes = 1;
+    if (bytes > 255)
+        bytes = 255;
+
+    if (ll->tio.c_cc[VMIN] == bytes && ll->tio.c_cc[VTIME] == 0)
+        return 0;
+
+    ll->tio.c_cc[VMIN] = bytes;
+    ll->tio.c_cc[VTIME] = 0;
+
+    return tcsetattr(dev->fd, TCSANOW, &ll->tio);
+}
+
+int fronius_set_lowlatency(struct fronius_dev *dev, int enable)
+{
+    struct fronius_lowlat *ll = dev->lowlat;
+    int rv = 0;
+
+    if (!enable) {
+        if (!ll)
+            return 0;
+        fronius_serial_fifo(dev, 0);
+        fronius_serial_driver(dev, 0);
+        /* back to the read thresholds found at open */
+        ll->tio.c_cc[VMIN] = dev->old_tio->c_cc[VMIN];
+        ll->tio.c_cc[VTIME] = dev->old_tio->c_cc[VTIME];
+        tcsetattr(dev->fd, TCSANOW, &ll->tio);
+        free(ll);
+        dev->lowlat = NULL;
+        return 0;
+    }
+
+    /* only serial ports were put into raw mode */
+    if (!dev->old_tio) {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    if (ll)
+        return 0;
+
+    ll = calloc(1, sizeof(*ll));
+    if (!ll)
+        return -1;
+
+    if (tcgetattr(dev->fd, &ll->tio) == -1) {
+        free(ll);
+        return -1;
+    }
+
+    dev->lowlat = ll;
+    if (fronius_serial_vmin(dev, 1) == -1) {
+        free(ll);
+        dev->lowlat = NULL;
+        return -1;
+    }
+
+    rv |= fronius_serial_driver(dev, 1);
+    rv |= fronius_serial_fifo(dev, 1);
+
+    return rv;
+}
+
+int fronius_serial_baudrate(struct fronius_dev *dev,
+                            fronius_baudrate_t baudrate)
+{
+    struct termios tio;
+
+    if (!dev->old_tio) {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    if (tcgetattr(dev->fd, &tio) == -1)
+        return -1;
+    if (cfsetispeed(&tio, baudrate) == -1 || cfsetospeed(&tio, baudrate) == -1)
+        return -1;
+
+    /* whatever arrived at the previous speed is garbage */
+    if (tcflush(dev->fd, TCIOFLUSH) == -1 ||
+        tcsetattr(dev->fd, TCSANOW, &tio) == -1)
+        return -1;
+
+    /* low-latency mode sets the read threshold from its own copy */
+    if (dev->lowlat) {
+        cfsetispeed(&dev->lowlat->tio, baudrate);
+        cfsetospeed(&dev->lowlat->tio, baudrate);
+    }
+
+    dev->baudrate = baudrate;
+    fronius_parser_flush(&dev->parser);
+    dev->rx_busy = 0;
+
+    return 0;
+}
+
+void fronius_serial_expect(struct fronius_dev *dev)
+{
+    const struct fronius_cmd_info *info;
+    size_t datalen = FRONIUS_ERROR_DATALEN;
+
+    if (!dev->lowlat)
+        return;
+
+    /* the shortest answer possible, an error response or a short list */
+    info = fronius_cmd_info(dev->xfer.req->command);
+    if (info && info->min_length < datalen)
+        datalen = info->min_length;
+
+    /* a failure leaves the previous threshold, at worst the request
+       runs into its timeout */
+    fronius_serial_vmin(dev, fronius_parser_missing(&dev->parser, datalen));
+}
+
+void fronius_serial_rx(struct fronius_dev *dev)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    FRONIUS_STAT_ADD(dev->serial.reads, 1);
+
+    if (!dev->rx_busy) {
+        if (dev->xfer.state == FRONIUS_XFER_RECV)
+            fronius_hist_add(&dev->serial.first_byte,
+                             fronius_serial_us(&dev->xfer.sent, &now));
+        dev->rx_first = now;
+        dev->rx_busy = 1;
+    } else {
+        fronius_hist_add(&dev->serial.gap,
+                         fronius_serial_us(&dev->rx_last, &now));
+    }
+
+    dev->rx_last = now;
+}
+
+void fronius_serial_frame(struct fronius_dev *dev, size_t len)
+{
+    unsigned int bps = fronius_serial_bps(dev->baudrate);
+
+    FRONIUS_STAT_ADD(dev->serial.frames, 1);
+    FRONIUS_STAT_ADD(dev->serial.span_us,
+                     fronius_serial_us(&dev->rx_first, &dev->rx_last));
+    /* 8N1, ten bit times per byte */
+    if (bps)
+        FRONIUS_STAT_ADD(dev->serial.wire_us, len * 10 * 1000000ULL / bps);
+
+    /* bytes left over belong to the next frame */
+    dev->rx_busy = fronius_parser_pending(&dev->parser) != 0;
+    dev->rx_first = dev->rx_last;
+}
+
+int fronius_serial_stats(struct fronius_dev *dev,
+                         struct fronius_serial_stats *stats)
+{
+    const struct fronius_serial_stats *s = &dev->serial;
+
+    stats->frames = __atomic_load_n(&s->frames, __ATOMIC_RELAXED);
+    stats->reads = __atomic_load_n(&s->reads, __ATOMIC_RELAXED);
+    stats->span_us = __atomic_load_n(&s->span_us, __ATOMIC_RELAXED);
+    stats->wire_us = __atomic_load_n(&s->wire_us, __ATOMIC_RELAXED);
+    fronius_hist_read(&s->first_byte, &stats->first_byte);
+    fronius_hist_read(&s->gap, &stats->gap);
+
+    return 0;
+}
@@ -0,0 +1,323 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * Requests are queued on an intrusive multi-producer single-consumer list
+ * (D. Vyukov): producers atomically swap themselves in as the new head and
+ * link the previous head to them, the owner thread takes requests from the
+ * tail. Producers never wait for each other nor for the owner, the order of
+ * the swaps is the order on the bus.
+ */
+
+struct fronius_future {
+	struct fronius_future	*next;
+	/* request */
+	uint8_t			device;
+	uint8_t			number;
+	uint8_t			command;
+	/* completion by callback from the owner thread ... */
+	fronius_callback_t	callback;
+	void			*arg;
+	/* ... or by a waitable copy of the result */
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int			done;
+	struct fronius_result	result;
+	uint8_t			data[FRONIUS_MAX_DATALEN];
+};
+
+struct fronius_shared {
+	struct fronius_dev	*dev;
+	pthread_t		thread;
+	/* wakes the owner thread on new requests and on shutdown */
+	int			efd;
+	int			stop;
+	/* queue, head is written by producers, tail by the owner only */
+	struct fronius_future	*head;
+	struct fronius_future	*tail;
+	struct fronius_future	stub;
+	/* request in flight */
+	struct fronius_future	*cur;
+};
+
+static void fronius_shared_push(struct fronius_shared *sh,
+                                struct fronius_future *f)
+{
+    struct fronius_future *prev;
+
+    f->next = NULL;
+    prev = __atomic_exchange_n(&sh->head, f, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, f, __ATOMIC_RELEASE);
+}
+
+static struct fronius_future *fronius_shared_pop(struct fronius_shared *sh)
+{
+    struct fronius_future *tail = sh->tail;
+    struct fronius_future *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &sh->stub) {
+        if (!next)
+            return NULL;
+        sh->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        sh->tail = next;
+        return tail;
+    }
+
+    /* a producer is between its swap and the link, it wakes us again */
+    if (tail != __atomic_load_n(&sh->head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    /* tail is the last request, put the stub behind it to take it */
+    fronius_shared_push(sh, &sh->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        sh->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static void fronius_shared_complete(struct fronius_dev *dev,
+                                    struct fronius_future *f,
+                                    const struct fronius_result *res)
+{
+    if (f->callback) {
+        f->callback(dev, res, f->arg);
+        free(f);
+        return;
+    }
+
+    /* the response buffer of the device is reused, keep a copy */
+    pthread_mutex_lock(&f->lock);
+    f->result = *res;
+    memcpy(f->data, res->data, res->length);
+    f->result.data = f->data;
+    f->done = 1;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+static void fronius_shared_done(struct fronius_dev *dev,
+                                const struct fronius_result *res, void *arg)
+{
+    struct fronius_shared *sh = arg;
+    struct fronius_future *f = sh->cur;
+
+    sh->cur = NULL;
+    fronius_shared_complete(dev, f, res);
+}
+
+static void fronius_shared_start(struct fronius_shared *sh,
+                                 struct fronius_future *f)
+{
+    struct fronius_result res;
+
+    sh->cur = f;
+    if (fronius_submit(sh->dev, f->device, f->number, f->command,
+                       fronius_shared_done, sh) == 0)
+        return;
+
+    /* the request did not even make it to the wire */
+    sh->cur = NULL;
+    memset(&res, 0, sizeof(res));
+    res.error = FRONIUS_ERR_INVALID_RESPONSE;
+    res.device = f->device;
+    res.number = f->number;
+    res.command = f->command;
+    res.data = f->data;
+    fronius_shared_complete(sh->dev, f, &res);
+}
+
+static void *fronius_shared_run(void *arg)
+{
+    struct fronius_shared *sh = arg;
+    struct fronius_future *f;
+    struct pollfd pfd[2];
+    uint64_t cnt;
+    int events;
+
+    pfd[0].fd = sh->efd;
+    pfd[0].events = POLLIN;
+
+    for (;;) {
+        if (!sh->cur) {
+            if ((f = fronius_shared_pop(sh))) {
+                fronius_shared_start(sh, f);
+                continue;
+            }
+            /* all queued requests are done */
+            if (__atomic_load_n(&sh->stop, __ATOMIC_ACQUIRE))
+                break;
+        }
+
+        events = fronius_events(sh->dev);
+        pfd[0].revents = pfd[1].revents = 0;
+
+        if (sh->dev->fd == -1) {
+            /* transports without a descriptor are asked directly */
+            if (sh->cur)
+                pfd[1].revents = sh->dev->transport->wait(sh->dev, events,
+                                                          fronius_timeout(sh->dev));
+            else if (poll(pfd, 1, -1) == -1 && errno != EINTR)
+                break;
+        } else {
+            pfd[1].fd = events ? sh->dev->fd : -1;
+            pfd[1].events = events;
+            if (poll(pfd, 2, fronius_timeout(sh->dev)) == -1 &&
+                errno != EINTR)
+                break;
+        }
+
+        if (pfd[0].revents && read(sh->efd, &cnt, sizeof(cnt)) < 0) {
+            /* counter was reset by an earlier read */
+        }
+
+        /* drive the request in flight, also on timer expiry */
+        if (sh->cur)
+            fronius_process(sh->dev, pfd[1].revents);
+    }
+
+    return NULL;
+}
+
+static void fronius_shared_wakeup(struct fronius_shared *sh)
+{
+    uint64_t one = 1;
+
+    if (write(sh->efd, &one, sizeof(one)) < 0) {
+        /* only fails if the counter overflows, the owner is awake then */
+    }
+}
+
+struct fronius_shared *fronius_shared_new(struct fronius_dev *dev)
+{
+    struct fronius_shared *sh;
+
+    sh = calloc(1, sizeof(*sh));
+    if (!sh)
+        return NULL;
+
+    sh->dev = dev;
+    sh->head = sh->tail = &sh->stub;
+
+    sh->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sh->efd == -1)
+        goto free;
+
+    errno = pthread_create(&sh->thread, NULL, fronius_shared_run, sh);
+    if (errno)
+        goto close;
+
+    return sh;
+
+close:
+    close(sh->efd);
+free:
+    free(sh);
+    return NULL;
+}
+
+int fronius_shared_free(struct fronius_shared *sh)
+{
+    __atomic_store_n(&sh->stop, 1, __ATOMIC_RELEASE);
+    fronius_shared_wakeup(sh);
+
+    errno = pthread_join(sh->thread, NULL);
+    if (errno)
+        return -1;
+
+    close(sh->efd);
+    free(sh);
+
+    return 0;
+}
+
+int fronius_shared_submit(struct fronius_shared *sh, uint8_t device,
+                          uint8_t number, uint8_t command,
+                          fronius_callback_t callback, void *arg)
+{
+    struct fronius_future *f;
+
+    if (!callback) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    f = calloc(1, sizeof(*f));
+    if (!f)
+        return -1;
+
+    f->device = device;
+    f->number = number;
+    f->command = command;
+    f->callback = callback;
+    f->arg = arg;
+
+    fronius_shared_push(sh, f);
+    fronius_shared_wakeup(sh);
+
+    return 0;
+}
+
+struct fronius_future *fronius_shared_query(struct fronius_shared *sh,
+                                            uint8_t device, uint8_t number,
+                                            uint8_t command)
+{
+    struct fronius_future *f;
+
+    f = calloc(1, sizeof(*f));
+    if (!f)
+        return NULL;
+
+    f->device = device;
+    f->number = number;
+    f->command = command;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+
+    fronius_shared_push(sh, f);
+    fronius_shared_wakeup(sh);
+
+    return f;
+}
+
+int fronius_future_wait(struct fronius_future *f, struct fronius_result *res)
+{
+    pthread_mutex_lock(&f->lock);
+    while (!f->done)
+        pthread_cond_wait(&f->cond, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+
+    if (res)
+        *res = f->result;
+
+    return 0;
+}
+
+void fronius_future_free(struct fronius_future *f)
+{
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+}
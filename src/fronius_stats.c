@@ -0,0 +1,173 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * Histogram buckets are log-linear: latencies below 4 us get a bucket each,
+ * above that every power of two is split into 4 buckets, i.e. the bucket
+ * width is at most 25% of its value. The last bucket takes everything from
+ * about 7.3 s on.
+ */
+
+static unsigned int fronius_hist_index(uint64_t us)
+{
+    unsigned int e, i;
+
+    if (us < 4)
+        return us;
+
+    e = 63 - __builtin_clzll(us);
+    i = (e - 1) * 4 + ((us >> (e - 2)) & 3);
+
+    return i < FRONIUS_HIST_BUCKETS ? i : FRONIUS_HIST_BUCKETS - 1;
+}
+
+uint64_t fronius_hist_bucket(unsigned int i)
+{
+    if (i < 4)
+        return i;
+
+    if (i >= FRONIUS_HIST_BUCKETS)
+        i = FRONIUS_HIST_BUCKETS - 1;
+
+    return (uint64_t) (4 + i % 4) << (i / 4 - 1);
+}
+
+void fronius_hist_add(struct fronius_hist *h, uint64_t us)
+{
+    FRONIUS_STAT_ADD(h->count, 1);
+    FRONIUS_STAT_ADD(h->sum, us);
+    FRONIUS_STAT_ADD(h->buckets[fronius_hist_index(us)], 1);
+}
+
+void fronius_hist_read(const struct fronius_hist *h,
+                       struct fronius_hist *snap)
+{
+    int i;
+
+    snap->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    snap->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    for (i = 0; i < FRONIUS_HIST_BUCKETS; ++i)
+        snap->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+}
+
+/* histograms are allocated on first use, so that a device talking to a
+   single inverter does not carry hundreds of them */
+static struct fronius_hist *fronius_hist_get(struct fronius_hist **slot)
+{
+    struct fronius_hist *h = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (!h) {
+        h = calloc(1, sizeof(*h));
+        if (h)
+            __atomic_store_n(slot, h, __ATOMIC_RELEASE);
+    }
+
+    return h;
+}
+
+void fronius_stats_request(struct fronius_dev *dev)
+{
+    const struct fronius_pkt *req = dev->xfer.req;
+    struct fronius_hist *h;
+    struct timespec now;
+    int64_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (int64_t) (now.tv_sec - dev->xfer.started.tv_sec) * 1000000 +
+         (now.tv_nsec - dev->xfer.started.tv_nsec) / 1000;
+    if (us < 0)
+        us = 0;
+
+    FRONIUS_STAT_ADD(dev->stats.requests, 1);
+    if (dev->xfer.error < FRONIUS_STATS_ERRORS)
+        FRONIUS_STAT_ADD(dev->stats.errors[dev->xfer.error], 1);
+
+    fronius_hist_add(&dev->stats.latency, us);
+
+    if ((h = fronius_hist_get(&dev->cmd_hist[req->command])))
+        fronius_hist_add(h, us);
+
+    if (req->device == FRONIUS_DEVICE_INVERTER &&
+        (h = fronius_hist_get(&dev->inverter_hist[req->number])))
+        fronius_hist_add(h, us);
+}
+
+void fronius_stats_free(struct fronius_dev *dev)
+{
+    int i;
+
+    for (i = 0; i < 256; ++i) {
+        free(dev->cmd_hist[i]);
+        free(dev->inverter_hist[i]);
+    }
+}
+
+int fronius_stats(struct fronius_dev *dev, struct fronius_stats *stats)
+{
+    const struct fronius_stats *s = &dev->stats;
+    int i;
+
+#define LOAD(field) stats->field = __atomic_load_n(&s->field, __ATOMIC_RELAXED)
+    LOAD(bytes_sent);
+    LOAD(bytes_received);
+    LOAD(pkts_sent);
+    LOAD(pkts_received);
+    LOAD(requests);
+    LOAD(timeouts);
+    LOAD(retries);
+    LOAD(reconnects);
+#undef LOAD
+
+    /* the parser keeps its own counters */
+    stats->resyncs = __atomic_load_n(&dev->parser.resyncs, __ATOMIC_RELAXED);
+    stats->bytes_skipped = __atomic_load_n(&dev->parser.skipped,
+                                           __ATOMIC_RELAXED);
+    stats->checksum_errors = __atomic_load_n(&dev->parser.checksum_errors,
+                                             __ATOMIC_RELAXED);
+
+    for (i = 0; i < FRONIUS_STATS_ERRORS; ++i)
+        stats->errors[i] = __atomic_load_n(&s->errors[i], __ATOMIC_RELAXED);
+
+    fronius_hist_read(&s->latency, &stats->latency);
+
+    return 0;
+}
+
+static int fronius_stats_hist(struct fronius_hist **slot,
+                              struct fronius_hist *hist)
+{
+    const struct fronius_hist *h = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    if (!h) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    fronius_hist_read(h, hist);
+    return 0;
+}
+
+int fronius_stats_command(struct fronius_dev *dev, uint8_t command,
+                          struct fronius_hist *hist)
+{
+    return fronius_stats_hist(&dev->cmd_hist[command], hist);
+}
+
+int fronius_stats_inverter(struct fronius_dev *dev, uint8_t number,
+                           struct fronius_hist *hist)
+{
+    return fronius_stats_hist(&dev->inverter_hist[number], hist);
+}
@@ -0,0 +1,787 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * The store is a sequence of blocks, each holding consecutive samples of
+ * one (number, command) series behind a header with the time range they
+ * cover. Samples are collected per series in memory and a block is
+ * appended with a single write once it is full, so the flash sees few,
+ * large writes. Like the topology file, it is written in host byte order.
+ *
+ * Within a block, samples are a bit stream. A timestamp is stored as the
+ * change of the interval to the previous sample (delta-of-delta), which
+ * is 0 or close to it for periodic sampling:
+ *
+ *   0                   same interval
+ *   10   + 7 bits       -64 .. 63 ms
+ *   110  + 9 bits       -256 .. 255 ms
+ *   1110 + 12 bits      -2048 .. 2047 ms
+ *   1111 + 32 bits      anything else within 24 days
+ *
+ * A value is compared with the previous valid one. Most of the time the
+ * exponent stays and the mantissa moves a little:
+ *
+ *   0                   same value
+ *   10   + 6 bits       mantissa changed by -32 .. 31
+ *   110  + 12 bits      mantissa changed by -2048 .. 2047
+ *   1110 + 24 bits      mantissa and exponent
+ *   1111 + 8 bits       error code instead of a value
+ *
+ * Only the block being appended at the end of the file can be torn by a
+ * crash; on open it is checked and cut off if damaged. The block headers
+ * are indexed in memory per series, so a time range query reads only the
+ * blocks overlapping it.
+ */
+
+#define FRONIUS_STORE_MAGIC	0x31545246	/* "FRT1" */
+/* payload bytes per block */
+#define FRONIUS_STORE_BLOCK	1024
+/* bits of the largest sample, a timestamp and a value with prefixes */
+#define FRONIUS_STORE_MAXBITS	(4 + 32 + 4 + 24)
+
+struct fronius_store_hdr {
+	uint32_t	magic;
+	/* hash over the rest of the header and the payload */
+	uint32_t	hash;
+	uint32_t	count;
+	uint16_t	size;
+	uint8_t		number;
+	uint8_t		command;
+	/* time of the first and the last sample in ms since the epoch */
+	int64_t		first;
+	int64_t		last;
+};
+
+/* index entry of a block in the file */
+struct fronius_store_block {
+	off_t		offset;
+	int64_t		first;
+	int64_t		last;
+};
+
+struct fronius_series {
+	uint8_t				number;
+	uint8_t				command;
+	/* blocks in the file, ordered by time */
+	struct fronius_store_block	*blocks;
+	size_t				nblocks, ablocks;
+	/* time of the latest sample, stored or pending */
+	int64_t				last;
+
+	/* block being filled: header and payload, allocated on first use */
+	uint8_t				*block;
+	size_t				len;
+	uint32_t			count;
+	int64_t				first;
+	/* bits not yet written to the payload */
+	uint64_t			acc;
+	unsigned int			nacc;
+	/* encoder state */
+	int64_t				prev, delta;
+	struct fronius_fixed		value;
+};
+
+struct fronius_store {
+	int			fd;
+	int			readonly;
+	/* end of the last complete block, anything behind it is left over
+	   from a failed write if torn is set */
+	off_t			end;
+	int			torn;
+	/* series in order of appearance, looked up by (number, command) */
+	struct fronius_series	*series;
+	size_t			nseries, aseries;
+	uint16_t		*map;
+	/* scratch block for reading */
+	uint8_t			rbuf[sizeof(struct fronius_store_hdr) +
+				     FRONIUS_STORE_BLOCK];
+	struct fronius_store_stats	stats;
+};
+
+struct fronius_store_reader {
+	const uint8_t	*p, *end;
+	uint64_t	acc;
+	unsigned int	nacc;
+};
+
+static uint32_t fronius_store_hash(uint32_t h, const uint8_t *p, size_t len)
+{
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static uint32_t fronius_store_blockhash(const uint8_t *block)
+{
+    const struct fronius_store_hdr *hdr = (const void *) block;
+    size_t skip = offsetof(struct fronius_store_hdr, count);
+
+    return fronius_store_hash(2166136261u, block + skip,
+                              sizeof(*hdr) - skip + hdr->size);
+}
+
+static void fronius_store_put(struct fronius_series *s, uint32_t bits,
+                              unsigned int n)
+{
+    uint8_t *payload = s->block + sizeof(struct fronius_store_hdr);
+
+    s->acc = s->acc << n | (bits & ((1ULL << n) - 1));
+    s->nacc += n;
+
+    while (s->nacc >= 8) {
+        s->nacc -= 8;
+        payload[s->len++] = s->acc >> s->nacc;
+    }
+}
+
+static uint32_t fronius_store_get(struct fronius_store_reader *r,
+                                  unsigned int n)
+{
+    while (r->nacc < n) {
+        r->acc = r->acc << 8 | (r->p < r->end ? *r->p++ : 0);
+        r->nacc += 8;
+    }
+
+    r->nacc -= n;
+    return (r->acc >> r->nacc) & ((1ULL << n) - 1);
+}
+
+/* read a field of n bits as two's complement */
+static int32_t fronius_store_sget(struct fronius_store_reader *r,
+                                  unsigned int n)
+{
+    int64_t v = fronius_store_get(r, n);
+
+    return v & (1LL << (n - 1)) ? v - (1LL << n) : v;
+}
+
+/* count the leading one bits of a prefix, at most max */
+static unsigned int fronius_store_prefix(struct fronius_store_reader *r,
+                                         unsigned int max)
+{
+    unsigned int i;
+
+    for (i = 0; i < max && fronius_store_get(r, 1); ++i);
+
+    return i;
+}
+
+static int fronius_store_write(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t rv;
+
+    while (len) {
+        rv = write(fd, p, len);
+        if (rv == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += rv;
+        len -= rv;
+    }
+
+    return 0;
+}
+
+static struct fronius_series *fronius_store_series(struct fronius_store *st,
+                                                   uint8_t number,
+                                                   uint8_t command)
+{
+    struct fronius_series *s;
+    uint16_t key = number << 8 | command;
+
+    if (st->map[key])
+        return &st->series[st->map[key] - 1];
+
+    if (st->nseries == st->aseries) {
+        size_t n = st->aseries ? 2 * st->aseries : 16;
+
+        s = realloc(st->series, n * sizeof(*s));
+        if (!s)
+            return NULL;
+        st->series = s;
+        st->aseries = n;
+    }
+
+    s = &st->series[st->nseries];
+    memset(s, 0, sizeof(*s));
+    s->number = number;
+    s->command = command;
+    s->last = INT64_MIN;
+    st->map[key] = ++st->nseries;
+
+    return s;
+}
+
+/* make room for one more index entry */
+static int fronius_store_reserve(struct fronius_series *s)
+{
+    struct fronius_store_block *b;
+    size_t n;
+
+    if (s->nblocks < s->ablocks)
+        return 0;
+
+    n = s->ablocks ? 2 * s->ablocks : 16;
+    b = realloc(s->blocks, n * sizeof(*b));
+    if (!b)
+        return -1;
+    s->blocks = b;
+    s->ablocks = n;
+
+    return 0;
+}
+
+static int fronius_store_index(struct fronius_series *s, off_t offset,
+                               int64_t first, int64_t last)
+{
+    struct fronius_store_block *b;
+
+    if (fronius_store_reserve(s) < 0)
+        return -1;
+
+    b = &s->blocks[s->nblocks++];
+    b->offset = offset;
+    b->first = first;
+    b->last = last;
+    s->last = last;
+
+    return 0;
+}
+
+/* append the block being filled to the file; on failure the block stays
+   as it is and the next seal tries again */
+static int fronius_store_seal(struct fronius_store *st,
+                              struct fronius_series *s)
+{
+    struct fronius_store_hdr *hdr = (void *) s->block;
+    size_t size = s->len, len;
+
+    if (!s->count)
+        return 0;
+
+    /* the index cannot fail once the block is written */
+    if (fronius_store_reserve(s) < 0)
+        return -1;
+
+    /* cut off what a failed write left behind, the file is opened for
+       appending */
+    if (st->torn) {
+        if (ftruncate(st->fd, st->end) < 0)
+            return -1;
+        st->torn = 0;
+    }
+
+    /* the decoder knows the sample count, the padding is never read; it
+       goes behind the payload, the encoder overwrites it if the block
+       stays open */
+    if (s->nacc)
+        s->block[sizeof(*hdr) + size++] = s->acc << (8 - s->nacc);
+
+    hdr->magic = FRONIUS_STORE_MAGIC;
+    hdr->count = s->count;
+    hdr->size = size;
+    hdr->number = s->number;
+    hdr->command = s->command;
+    hdr->first = s->first;
+    hdr->last = s->last;
+    hdr->hash = fronius_store_blockhash(s->block);
+
+    len = sizeof(*hdr) + size;
+    if (fronius_store_write(st->fd, s->block, len) < 0) {
+        st->torn = 1;
+        st->stats.failed++;
+        return -1;
+    }
+
+    fronius_store_index(s, st->end, s->first, s->last);
+
+    st->end += len;
+    st->stats.blocks++;
+    st->stats.bytes = st->end;
+    st->stats.pending -= s->count;
+
+    s->len = 0;
+    s->nacc = 0;
+    s->count = 0;
+
+    return 0;
+}
+
+static void fronius_store_encode_time(struct fronius_series *s, int64_t dod)
+{
+    if (dod == 0) {
+        fronius_store_put(s, 0x0, 1);
+    } else if (dod >= -64 && dod < 64) {
+        fronius_store_put(s, 0x2, 2);
+        fronius_store_put(s, dod, 7);
+    } else if (dod >= -256 && dod < 256) {
+        fronius_store_put(s, 0x6, 3);
+        fronius_store_put(s, dod, 9);
+    } else if (dod >= -2048 && dod < 2048) {
+        fronius_store_put(s, 0xe, 4);
+        fronius_store_put(s, dod, 12);
+    } else {
+        fronius_store_put(s, 0xf, 4);
+        fronius_store_put(s, dod, 32);
+    }
+}
+
+static void fronius_store_encode_value(struct fronius_series *s,
+                                       const struct fronius_fixed *fixed,
+                                       fronius_error_t error)
+{
+    int32_t d = (int32_t) fixed->mantissa - s->value.mantissa;
+
+    if (error != FRONIUS_ERR_NOERROR) {
+        fronius_store_put(s, 0xf, 4);
+        fronius_store_put(s, error, 8);
+        return;
+    }
+
+    if (fixed->exponent != s->value.exponent) {
+        fronius_store_put(s, 0xe, 4);
+        fronius_store_put(s, fixed->mantissa, 16);
+        fronius_store_put(s, (uint8_t) fixed->exponent, 8);
+    } else if (d == 0) {
+        fronius_store_put(s, 0x0, 1);
+    } else if (d >= -32 && d < 32) {
+        fronius_store_put(s, 0x2, 2);
+        fronius_store_put(s, d, 6);
+    } else if (d >= -2048 && d < 2048) {
+        fronius_store_put(s, 0x6, 3);
+        fronius_store_put(s, d, 12);
+    } else {
+        fronius_store_put(s, 0xe, 4);
+        fronius_store_put(s, fixed->mantissa, 16);
+        fronius_store_put(s, (uint8_t) fixed->exponent, 8);
+    }
+
+    s->value = *fixed;
+}
+
+int fronius_store_append(struct fronius_store *st, uint8_t number,
+                         uint8_t command, int64_t time,
+                         const struct fronius_fixed *fixed,
+                         fronius_error_t error)
+{
+    static const struct fronius_fixed none;
+    struct fronius_series *s;
+    int64_t dod;
+
+    if (st->readonly) {
+        errno = EBADF;
+        return -1;
+    }
+
+    s = fronius_store_series(st, number, command);
+    if (!s)
+        return -1;
+
+    if (time < s->last) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!s->block) {
+        s->block = malloc(sizeof(struct fronius_store_hdr) +
+                          FRONIUS_STORE_BLOCK);
+        if (!s->block)
+            return -1;
+    }
+
+    if (!fixed)
+        fixed = &none;
+
+    dod = s->count ? (time - s->prev) - s->delta : 0;
+
+    /* a new block if this one is full or the gap does not fit */
+    if (s->count && (dod < INT32_MIN || dod > INT32_MAX ||
+        s->len + (s->nacc + FRONIUS_STORE_MAXBITS + 7) / 8 >
+        FRONIUS_STORE_BLOCK)) {
+        if (fronius_store_seal(st, s) < 0)
+            return -1;
+        dod = 0;
+    }
+
+    if (!s->count) {
+        s->first = time;
+        s->prev = time;
+        s->delta = 0;
+        s->value = none;
+    }
+
+    fronius_store_encode_time(s, dod);
+    fronius_store_encode_value(s, fixed, error);
+
+    s->delta = time - s->prev;
+    s->prev = time;
+    s->last = time;
+    s->count++;
+    st->stats.samples++;
+    st->stats.pending++;
+
+    return 0;
+}
+
+int fronius_store_append_window(struct fronius_store *st, uint8_t number,
+                                uint8_t command,
+                                const struct fronius_window *w)
+{
+    struct fronius_series *s;
+    int64_t last;
+    size_t i, j;
+    int n = 0;
+
+    if (st->readonly) {
+        errno = EBADF;
+        return -1;
+    }
+
+    s = fronius_store_series(st, number, command);
+    if (!s)
+        return -1;
+
+    /* overlapping windows can be passed, older samples are stored */
+    last = s->last;
+
+    for (i = 0; i < 2; ++i) {
+        for (j = 0; j < w->count[i]; ++j) {
+            if (w->time[i][j] <= last)
+                continue;
+            if (fronius_store_append(st, number, command, w->time[i][j],
+                                     &w->fixed[i][j], w->error[i][j]) < 0)
+                return -1;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+int fronius_store_flush(struct fronius_store *st)
+{
+    size_t i;
+
+    if (st->readonly)
+        return 0;
+
+    for (i = 0; i < st->nseries; ++i)
+        if (fronius_store_seal(st, &st->series[i]) < 0)
+            return -1;
+
+    return fdatasync(st->fd);
+}
+
+/* check the header of a block found at the given offset */
+static int fronius_store_valid(const struct fronius_store_hdr *hdr,
+                               off_t offset, off_t size)
+{
+    return hdr->magic == FRONIUS_STORE_MAGIC &&
+           hdr->count > 0 && hdr->size <= FRONIUS_STORE_BLOCK &&
+           hdr->first <= hdr->last &&
+           offset + (off_t) (sizeof(*hdr) + hdr->size) <= size;
+}
+
+static int fronius_store_read(struct fronius_store *st, off_t offset)
+{
+    struct fronius_store_hdr *hdr = (void *) st->rbuf;
+    size_t len = sizeof(st->rbuf);
+    ssize_t rv;
+
+    do {
+        rv = pread(st->fd, st->rbuf, len, offset);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv < (ssize_t) sizeof(*hdr) ||
+        rv < (ssize_t) (sizeof(*hdr) + hdr->size) ||
+        fronius_store_blockhash(st->rbuf) != hdr->hash) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* walk the block headers and build the index */
+static int fronius_store_load(struct fronius_store *st)
+{
+    struct fronius_store_hdr hdr;
+    struct fronius_series *s;
+    struct stat sb;
+    off_t offset = 0, prev = -1;
+    ssize_t rv;
+
+    if (fstat(st->fd, &sb) == -1)
+        return -1;
+
+    while (offset < sb.st_size) {
+        do {
+            rv = pread(st->fd, &hdr, sizeof(hdr), offset);
+        } while (rv == -1 && errno == EINTR);
+        if (rv == -1)
+            return -1;
+
+        if (rv != sizeof(hdr) || !fronius_store_valid(&hdr, offset,
+                                                      sb.st_size))
+            break;
+
+        s = fronius_store_series(st, hdr.number, hdr.command);
+        if (!s)
+            return -1;
+        /* a series never goes back in time */
+        if (hdr.first < s->last)
+            break;
+        if (fronius_store_index(s, offset, hdr.first, hdr.last) < 0)
+            return -1;
+
+        st->stats.samples += hdr.count;
+        st->stats.blocks++;
+        prev = offset;
+        offset += sizeof(hdr) + hdr.size;
+    }
+
+    /* only the block written last may have been torn */
+    if (prev >= 0 && offset == sb.st_size &&
+        fronius_store_read(st, prev) < 0) {
+        s = fronius_store_series(st, hdr.number, hdr.command);
+        st->stats.samples -= hdr.count;
+        st->stats.blocks--;
+        s->nblocks--;
+        s->last = s->nblocks ? s->blocks[s->nblocks - 1].last : INT64_MIN;
+        offset = prev;
+    }
+
+    if (offset < sb.st_size) {
+        st->stats.corrupt++;
+        if (!st->readonly && ftruncate(st->fd, offset) == -1)
+            return -1;
+    }
+
+    st->end = offset;
+    st->stats.bytes = offset;
+
+    return 0;
+}
+
+struct fronius_store *fronius_store_open(const char *path, int readonly)
+{
+    struct fronius_store *st;
+    int saved;
+
+    st = calloc(1, sizeof(*st));
+    if (!st)
+        return NULL;
+
+    st->map = calloc(1 << 16, sizeof(*st->map));
+    if (!st->map) {
+        free(st);
+        return NULL;
+    }
+
+    st->readonly = readonly;
+    st->fd = open(path, readonly ? O_RDONLY | O_CLOEXEC :
+                  O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (st->fd == -1 || fronius_store_load(st) < 0) {
+        saved = errno;
+        fronius_store_close(st);
+        errno = saved;
+        return NULL;
+    }
+
+    return st;
+}
+
+int fronius_store_close(struct fronius_store *st)
+{
+    int rv = 0;
+    size_t i;
+
+    if (st->fd != -1) {
+        rv = fronius_store_flush(st);
+        if (close(st->fd) == -1)
+            rv = -1;
+    }
+
+    for (i = 0; i < st->nseries; ++i) {
+        free(st->series[i].blocks);
+        free(st->series[i].block);
+    }
+
+    free(st->series);
+    free(st->map);
+    free(st);
+
+    return rv;
+}
+
+/* pass the samples of a payload within [from, to) on and count them;
+   returns -1 if the callback stopped the scan */
+static int fronius_store_decode(const uint8_t *payload, size_t size,
+                                uint32_t count, int64_t first,
+                                uint8_t number, uint8_t command,
+                                int64_t from, int64_t to,
+                                fronius_store_cb_t callback, void *arg,
+                                int *n)
+{
+    struct fronius_store_reader r;
+    struct fronius_fixed value = { 0, 0 };
+    fronius_error_t error;
+    int64_t time = first, delta = 0;
+    uint32_t i;
+
+    r.p = payload;
+    r.end = payload + size;
+    r.acc = 0;
+    r.nacc = 0;
+
+    for (i = 0; i < count; ++i) {
+        switch (fronius_store_prefix(&r, 4)) {
+        case 0:
+            break;
+        case 1:
+            delta += fronius_store_sget(&r, 7);
+            break;
+        case 2:
+            delta += fronius_store_sget(&r, 9);
+            break;
+        case 3:
+            delta += fronius_store_sget(&r, 12);
+            break;
+        default:
+            delta += fronius_store_sget(&r, 32);
+            break;
+        }
+        time += delta;
+
+        error = FRONIUS_ERR_NOERROR;
+        switch (fronius_store_prefix(&r, 4)) {
+        case 0:
+            break;
+        case 1:
+            value.mantissa += fronius_store_sget(&r, 6);
+            break;
+        case 2:
+            value.mantissa += fronius_store_sget(&r, 12);
+            break;
+        case 3:
+            value.mantissa = fronius_store_get(&r, 16);
+            value.exponent = (int8_t) fronius_store_get(&r, 8);
+            break;
+        default:
+            error = fronius_store_get(&r, 8);
+            break;
+        }
+
+        /* timestamps never decrease within a series */
+        if (time >= to)
+            break;
+        if (time < from)
+            continue;
+
+        if (callback(number, command, time,
+                     error == FRONIUS_ERR_NOERROR ? &value : NULL,
+                     error, arg))
+            return -1;
+        (*n)++;
+    }
+
+    return 0;
+}
+
+static int fronius_store_scan_series(struct fronius_store *st,
+                                     struct fronius_series *s,
+                                     int64_t from, int64_t to,
+                                     fronius_store_cb_t callback, void *arg,
+                                     int *n)
+{
+    const struct fronius_store_hdr *hdr = (void *) st->rbuf;
+    const uint8_t *payload = st->rbuf + sizeof(*hdr);
+    size_t lo = 0, hi = s->nblocks, mid, len;
+
+    /* first block reaching into the range */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (s->blocks[mid].last < from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < s->nblocks && s->blocks[lo].first < to; ++lo) {
+        if (fronius_store_read(st, s->blocks[lo].offset) < 0) {
+            st->stats.corrupt++;
+            continue;
+        }
+
+        if (fronius_store_decode(payload, hdr->size, hdr->count, hdr->first,
+                                 s->number, s->command, from, to,
+                                 callback, arg, n) < 0)
+            return -1;
+    }
+
+    /* samples not written yet */
+    if (s->count && s->first < to && s->last >= from) {
+        len = s->len;
+        memcpy(st->rbuf + sizeof(*hdr), s->block + sizeof(*hdr), len);
+        if (s->nacc)
+            st->rbuf[sizeof(*hdr) + len++] = s->acc << (8 - s->nacc);
+
+        if (fronius_store_decode(payload, len, s->count, s->first,
+                                 s->number, s->command, from, to,
+                                 callback, arg, n) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int fronius_store_scan(struct fronius_store *st, uint8_t number,
+                       uint8_t command, int64_t from, int64_t to,
+                       fronius_store_cb_t callback, void *arg)
+{
+    struct fronius_series *s;
+    size_t i;
+    int n = 0;
+
+    for (i = 0; i < st->nseries; ++i) {
+        s = &st->series[i];
+        if ((number && s->number != number) ||
+            (command && s->command != command))
+            continue;
+
+        if (fronius_store_scan_series(st, s, from, to, callback, arg, &n) < 0)
+            break;
+    }
+
+    return n;
+}
+
+int fronius_store_stats(struct fronius_store *st,
+                        struct fronius_store_stats *stats)
+{
+    *stats = st->stats;
+
+    return 0;
+}
@@ -0,0 +1,523 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * The file is a header followed by the saved cache entries and the
+ * inverters and sensor cards as (number, type) pairs; the entries come
+ * first to keep them aligned in the buffer. It is written in host
+ * byte order, it is meant to survive a restart and not to be moved to
+ * other machines. An FNV-1a hash over everything after the header catches
+ * truncated and damaged files.
+ */
+
+#define FRONIUS_TOPOLOGY_MAGIC		0x50545246	/* "FRTP" */
+#define FRONIUS_TOPOLOGY_VERSION	2
+
+struct fronius_topology_hdr {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	hdrsize;
+	/* hash and size of the rest of the file */
+	uint32_t	hash;
+	uint32_t	size;
+	/* wall clock time of the enumeration */
+	int64_t		discovered;
+	/* line speed in bits per second, 0 if not a serial line */
+	uint32_t	bps;
+	uint8_t		ifc_type;
+	uint8_t		ifc_version[3];
+	uint8_t		ninverters;
+	uint8_t		nsensors;
+	uint16_t	nvalues;
+	uint8_t		reserved[4];
+};
+
+/* largest file body: all devices and a full cache */
+#define FRONIUS_TOPOLOGY_BODY \
+    (FRONIUS_CACHE_SLOTS * sizeof(struct fronius_cache_value) + \
+     2 * (FRONIUS_MAX_INVERTERS + FRONIUS_MAX_SENSORS))
+
+static uint32_t fronius_topology_hash(const uint8_t *p, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static fronius_baudrate_t fronius_topology_baudrate(uint32_t bps)
+{
+    switch (bps) {
+    case 2400:
+        return FRONIUS_BAUDRATE_B2400;
+    case 4800:
+        return FRONIUS_BAUDRATE_B4800;
+    case 9600:
+        return FRONIUS_BAUDRATE_B9600;
+    case 19200:
+        return FRONIUS_BAUDRATE_B19200;
+    default:
+        return FRONIUS_BAUDRATE_AUTO;
+    }
+}
+
+static int fronius_topology_write(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t rv;
+
+    while (len) {
+        rv = write(fd, p, len);
+        if (rv == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += rv;
+        len -= rv;
+    }
+
+    return 0;
+}
+
+/* make the rename durable, it is only an entry in the directory */
+static int fronius_topology_syncdir(const char *path)
+{
+    char dir[4096];
+    char *slash;
+    int fd, rv;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    slash = strrchr(dir, '/');
+    if (!slash)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    rv = fsync(fd);
+    close(fd);
+
+    return rv;
+}
+
+int fronius_topology_save(const char *path, const struct fronius_topology *topo,
+                          struct fronius_dev *dev)
+{
+    struct fronius_topology_hdr hdr;
+    struct fronius_cache_value *values;
+    uint8_t *buf, *p;
+    char tmp[4096];
+    size_t i, nvalues = 0, len;
+    int fd, rv;
+
+    if (topo->ninverters > FRONIUS_MAX_INVERTERS ||
+        topo->nsensors > FRONIUS_MAX_SENSORS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    buf = malloc(FRONIUS_TOPOLOGY_BODY);
+    if (!buf)
+        return -1;
+
+    p = buf;
+
+    /* the values go right into the buffer, it has room for all slots */
+    if (dev && dev->cache) {
+        values = (struct fronius_cache_value *) p;
+        nvalues = fronius_cache_export(dev, values, FRONIUS_CACHE_SLOTS);
+        p += nvalues * sizeof(*values);
+    }
+
+    for (i = 0; i < topo->ninverters; ++i) {
+        *p++ = topo->inverters[i];
+        *p++ = topo->inverter_types[i];
+    }
+    for (i = 0; i < topo->nsensors; ++i) {
+        *p++ = topo->sensors[i];
+        *p++ = topo->sensor_types[i];
+    }
+    len = p - buf;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = FRONIUS_TOPOLOGY_MAGIC;
+    hdr.version = FRONIUS_TOPOLOGY_VERSION;
+    hdr.hdrsize = sizeof(hdr);
+    hdr.hash = fronius_topology_hash(buf, len);
+    hdr.size = len;
+    hdr.discovered = topo->discovered;
+    hdr.bps = fronius_serial_bps(topo->baudrate);
+    hdr.ifc_type = topo->ifc_type;
+    memcpy(hdr.ifc_version, topo->version, sizeof(hdr.ifc_version));
+    hdr.ninverters = topo->ninverters;
+    hdr.nsensors = topo->nsensors;
+    hdr.nvalues = nvalues;
+
+    /* write a new file and rename it, so that a crash never leaves a
+       partial one behind */
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        free(buf);
+        return -1;
+    }
+
+    rv = fronius_topology_write(fd, &hdr, sizeof(hdr));
+    if (!rv)
+        rv = fronius_topology_write(fd, buf, len);
+    free(buf);
+
+    if (rv || fsync(fd) == -1) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    if (close(fd) == -1 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return fronius_topology_syncdir(path);
+}
+
+int fronius_topology_load(const char *path, struct fronius_topology *topo,
+                          struct fronius_dev *dev)
+{
+    struct fronius_topology_hdr hdr;
+    uint8_t *buf;
+    const uint8_t *p;
+    size_t i;
+    ssize_t rv;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    buf = malloc(FRONIUS_TOPOLOGY_BODY);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+
+    rv = read(fd, &hdr, sizeof(hdr));
+    if (rv != (ssize_t) sizeof(hdr) ||
+        hdr.magic != FRONIUS_TOPOLOGY_MAGIC ||
+        hdr.version != FRONIUS_TOPOLOGY_VERSION ||
+        hdr.hdrsize != sizeof(hdr) ||
+        hdr.ninverters > FRONIUS_MAX_INVERTERS ||
+        hdr.nsensors > FRONIUS_MAX_SENSORS ||
+        hdr.nvalues > FRONIUS_CACHE_SLOTS ||
+        hdr.size != hdr.nvalues * sizeof(struct fronius_cache_value) +
+                    2 * (hdr.ninverters + hdr.nsensors))
+        goto invalid;
+
+    rv = read(fd, buf, hdr.size);
+    if (rv != (ssize_t) hdr.size ||
+        fronius_topology_hash(buf, hdr.size) != hdr.hash)
+        goto invalid;
+
+    close(fd);
+
+    memset(topo, 0, sizeof(*topo));
+    topo->ifc_type = hdr.ifc_type;
+    topo->baudrate = fronius_topology_baudrate(hdr.bps);
+    memcpy(topo->version, hdr.ifc_version, sizeof(topo->version));
+    topo->discovered = hdr.discovered;
+
+    p = buf + hdr.nvalues * sizeof(struct fronius_cache_value);
+    topo->ninverters = hdr.ninverters;
+    for (i = 0; i < topo->ninverters; ++i) {
+        topo->inverters[i] = *p++;
+        topo->inverter_types[i] = *p++;
+    }
+    topo->nsensors = hdr.nsensors;
+    for (i = 0; i < topo->nsensors; ++i) {
+        topo->sensors[i] = *p++;
+        topo->sensor_types[i] = *p++;
+    }
+
+    if (dev && dev->cache)
+        fronius_cache_import(dev, (const struct fronius_cache_value *) buf,
+                             hdr.nvalues);
+
+    free(buf);
+    return 0;
+
+invalid:
+    free(buf);
+    close(fd);
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Revalidation and enumeration share one walk over the bus: version and
+ * lists of active devices first, then the device types, which are skipped
+ * if nothing changed. Each completion submits the next request.
+ */
+
+struct fronius_topology_walk {
+	struct fronius_dev	*dev;
+	struct fronius_topology	*topo;
+	/* enumeration in progress, replaces topo once complete */
+	struct fronius_topology	next;
+	/* query the device types even if the lists did not change */
+	int			force;
+	/* device type being queried, index into the inverters, then the
+	   sensor cards */
+	size_t			index;
+	fronius_topology_cb_t	callback;
+	void			*arg;
+};
+
+static void fronius_topology_complete(struct fronius_dev *,
+                                      const struct fronius_result *, void *);
+
+static void fronius_topology_done(struct fronius_topology_walk *w,
+                                  int changed, fronius_error_t error)
+{
+    struct fronius_dev *dev = w->dev;
+    struct fronius_topology *topo = w->topo;
+    fronius_topology_cb_t callback = w->callback;
+    void *arg = w->arg;
+
+    if (changed)
+        memcpy(topo, &w->next, sizeof(*topo));
+
+    free(w);
+
+    if (callback)
+        callback(dev, topo, changed, error, arg);
+}
+
+static void fronius_topology_submit(struct fronius_topology_walk *w,
+                                    uint8_t device, uint8_t number,
+                                    uint8_t command)
+{
+    if (fronius_submit(w->dev, device, number, command,
+                       fronius_topology_complete, w) < 0)
+        fronius_topology_done(w, 0, FRONIUS_ERR_INVALID_RESPONSE);
+}
+
+/* query the device type of the next inverter or sensor card */
+static void fronius_topology_next_type(struct fronius_topology_walk *w)
+{
+    struct fronius_topology *t = &w->next;
+
+    if (w->index < t->ninverters)
+        fronius_topology_submit(w, FRONIUS_DEVICE_INVERTER,
+                                t->inverters[w->index],
+                                FRONIUS_CMD_IFCARD_GETDEVICETYPE);
+    else if (w->index < t->ninverters + t->nsensors)
+        fronius_topology_submit(w, FRONIUS_DEVICE_SENSORCARD,
+                                t->sensors[w->index - t->ninverters],
+                                FRONIUS_CMD_IFCARD_GETDEVICETYPE);
+    else
+        fronius_topology_done(w, 1, FRONIUS_ERR_NOERROR);
+}
+
+static int fronius_topology_same(const struct fronius_topology *a,
+                                 const struct fronius_topology *b)
+{
+    return a->ifc_type == b->ifc_type &&
+           !memcmp(a->version, b->version, sizeof(a->version)) &&
+           a->ninverters == b->ninverters &&
+           !memcmp(a->inverters, b->inverters, a->ninverters) &&
+           a->nsensors == b->nsensors &&
+           !memcmp(a->sensors, b->sensors, a->nsensors);
+}
+
+static void fronius_topology_complete(struct fronius_dev *dev,
+                                      const struct fronius_result *res,
+                                      void *arg)
+{
+    struct fronius_topology_walk *w = arg;
+    struct fronius_topology *t = &w->next;
+    int ok = res->error == FRONIUS_ERR_NOERROR &&
+             fronius_cmd_length_ok(res->command, res->length);
+
+    /* without an answer at all the Interface Card is not there, but it
+       may report errors for an empty list or an inverter gone to sleep */
+    if (res->error == FRONIUS_ERR_INVALID_RESPONSE &&
+        res->command != FRONIUS_CMD_IFCARD_GETDEVICETYPE) {
+        fronius_topology_done(w, 0, res->error);
+        return;
+    }
+
+    switch (res->command) {
+    case FRONIUS_CMD_IFCARD_GETVERSION:
+        if (!ok) {
+            fronius_topology_done(w, 0, res->error ? res->error :
+                                  FRONIUS_ERR_INVALID_RESPONSE);
+            return;
+        }
+        t->ifc_type = res->data[0];
+        memcpy(t->version, &res->data[1], sizeof(t->version));
+        t->baudrate = dev->old_tio ? dev->baudrate : FRONIUS_BAUDRATE_AUTO;
+        fronius_topology_submit(w, FRONIUS_DEVICE_INTERFACECARD, 0,
+                                FRONIUS_CMD_IFCARD_GETACTIVEINVERTERS);
+        return;
+
+    case FRONIUS_CMD_IFCARD_GETACTIVEINVERTERS:
+        if (ok) {
+            t->ninverters = res->length;
+            memcpy(t->inverters, res->data, res->length);
+        }
+        fronius_topology_submit(w, FRONIUS_DEVICE_INTERFACECARD, 0,
+                                FRONIUS_CMD_IFCARD_GETACTIVESENSORS);
+        return;
+
+    case FRONIUS_CMD_IFCARD_GETACTIVESENSORS:
+        if (ok) {
+            t->nsensors = res->length;
+            memcpy(t->sensors, res->data, res->length);
+        }
+        if (!w->force && fronius_topology_same(t, w->topo)) {
+            fronius_topology_done(w, 0, FRONIUS_ERR_NOERROR);
+            return;
+        }
+        t->discovered = time(NULL);
+        w->index = 0;
+        fronius_topology_next_type(w);
+        return;
+
+    default:
+        if (ok && w->index < t->ninverters)
+            t->inverter_types[w->index] = res->data[0];
+        else if (ok)
+            t->sensor_types[w->index - t->ninverters] = res->data[0];
+        w->index++;
+        fronius_topology_next_type(w);
+        return;
+    }
+}
+
+static struct fronius_topology_walk *
+fronius_topology_walk(struct fronius_dev *dev, struct fronius_topology *topo,
+                      int force, fronius_topology_cb_t callback, void *arg)
+{
+    struct fronius_topology_walk *w;
+
+    w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    w->dev = dev;
+    w->topo = topo;
+    w->force = force;
+    w->callback = callback;
+    w->arg = arg;
+
+    if (fronius_submit(dev, FRONIUS_DEVICE_INTERFACECARD, 0,
+                       FRONIUS_CMD_IFCARD_GETVERSION,
+                       fronius_topology_complete, w) < 0) {
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+int fronius_topology_revalidate_start(struct fronius_dev *dev,
+                                      struct fronius_topology *topo,
+                                      fronius_topology_cb_t callback,
+                                      void *arg)
+{
+    return fronius_topology_walk(dev, topo, 0, callback, arg) ? 0 : -1;
+}
+
+struct fronius_topology_status {
+	int		done;
+	int		changed;
+	fronius_error_t	error;
+};
+
+static void fronius_topology_status(struct fronius_dev *dev,
+                                    struct fronius_topology *topo,
+                                    int changed, fronius_error_t error,
+                                    void *arg)
+{
+    struct fronius_topology_status *st = arg;
+
+    (void) dev;
+    (void) topo;
+
+    st->done = 1;
+    st->changed = changed;
+    st->error = error;
+}
+
+/* run a walk to its end, each completion submits the next request */
+static fronius_error_t fronius_topology_run(struct fronius_dev *dev,
+                                            struct fronius_topology *topo,
+                                            int force, int *changed)
+{
+    struct fronius_topology_status st;
+    struct fronius_topology_walk *w;
+
+    memset(&st, 0, sizeof(st));
+
+    w = fronius_topology_walk(dev, topo, force, fronius_topology_status, &st);
+    if (!w)
+        return -1;
+
+    /* the walk frees itself once done, until then it is ours */
+    if (fronius_xfer_wait(dev) < 0 && !st.done) {
+        /* abandon the walk, the status goes out of scope */
+        if (dev->xfer.callback == fronius_topology_complete &&
+            dev->xfer.arg == w)
+            dev->xfer.state = FRONIUS_XFER_IDLE;
+        free(w);
+        return -1;
+    }
+
+    if (changed)
+        *changed = st.changed;
+
+    return st.error;
+}
+
+fronius_error_t fronius_topology_discover(struct fronius_dev *dev,
+                                          struct fronius_topology *topo)
+{
+    return fronius_topology_run(dev, topo, 1, NULL);
+}
+
+fronius_error_t fronius_topology_revalidate(struct fronius_dev *dev,
+                                            struct fronius_topology *topo,
+                                            int *changed)
+{
+    return fronius_topology_run(dev, topo, 0, changed);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+static const char hexdigits[] = "0123456789abcdef";
+
+int fronius_trace_format(char *buf, size_t size, const char *prefix,
+                         const uint8_t *frame, size_t len)
+{
+    size_t plen = prefix ? strlen(prefix) : 0;
+    size_t need = (plen ? plen + 2 : 0) + len * 5 + 1;
+    char *p = buf;
+
+    /* each byte is "0xXX" followed by a space or the final newline */
+    if (!len || need >= size) {
+        errno = len ? ENOSPC : EINVAL;
+        return -1;
+    }
+
+    if (plen) {
+        memcpy(p, prefix, plen);
+        p += plen;
+        *p++ = ':';
+        *p++ = ' ';
+    }
+
+    while (len--) {
+        *p++ = '0';
+        *p++ = 'x';
+        *p++ = hexdigits[*frame >> 4];
+        *p++ = hexdigits[*frame & 0x0f];
+        *p++ = len ? ' ' : '\n';
+        frame++;
+    }
+    *p = '\0';
+
+    return p - buf;
+}
+
+void fronius_trace_fd(struct fronius_dev *dev, int dir,
+                      const struct timespec *ts, const uint8_t *frame,
+                      size_t len, void *arg)
+{
+    char prefix[48];
+    int fd = (int) (intptr_t) arg;
+    int c;
+
+    snprintf(prefix, sizeof(prefix), "%ld.%06ld %s", (long) ts->tv_sec,
+             ts->tv_nsec / 1000, dir == FRONIUS_TRACE_TX ? "tx" : "rx");
+
+    c = fronius_trace_format(dev->tracebuf, sizeof(dev->tracebuf), prefix,
+                             frame, len);
+    if (c > 0 && write(fd, dev->tracebuf, c) < 0) {
+        /* nothing sensible to do about a failing trace */
+    }
+}
+
+int fronius_set_trace(struct fronius_dev *dev, fronius_trace_t trace,
+                      void *arg)
+{
+    dev->trace = trace;
+    dev->trace_arg = arg;
+
+    return 0;
+}
+
+void fronius_pkt_trace(struct fronius_dev *dev, int dir,
+                       const uint8_t *frame, size_t len)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    dev->trace(dev, dir, &ts, frame, len, dev->trace_arg);
+}
@@ -0,0 +1,689 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * File descriptor based transports share the plain read/write path and
+ * differ in how they end: a serial port gets its settings back, a
+ * datagram socket has no end of file.
+ */
+
+static ssize_t fronius_fd_send(struct fronius_dev *dev, const uint8_t *buf,
+                               size_t len)
+{
+    ssize_t rv;
+
+    do {
+        rv = write(dev->fd, buf, len);
+    } while (rv == -1 && errno == EINTR);
+
+    return rv;
+}
+
+static ssize_t fronius_fd_recv(struct fronius_dev *dev,
+                               struct fronius_parser *parser)
+{
+    ssize_t rv;
+
+    do {
+        rv = fronius_parser_fill(parser, dev->fd);
+    } while (rv == -1 && errno == EINTR);
+
+    return rv;
+}
+
+static int fronius_fd_wait(struct fronius_dev *dev, int events, int timeout)
+{
+    struct pollfd pfd;
+    int rv;
+
+    pfd.fd = dev->fd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    rv = poll(&pfd, 1, timeout);
+    if (rv == -1)
+        return errno == EINTR ? 0 : -1;
+
+    return pfd.revents;
+}
+
+static int fronius_fd_close(struct fronius_dev *dev)
+{
+    return close(dev->fd);
+}
+
+static int fronius_serial_close(struct fronius_dev *dev)
+{
+    /* restore original serial settings if saved */
+    if (dev->old_tio) {
+        if (tcflush(dev->fd, TCIOFLUSH) == -1)
+            return -1;
+
+        if (tcsetattr(dev->fd, TCSANOW, dev->old_tio) == -1)
+            return -1;
+
+        free(dev->old_tio);
+        dev->old_tio = NULL;
+    }
+
+    return close(dev->fd);
+}
+
+/* an empty datagram is not the end of the connection */
+static ssize_t fronius_dgram_recv(struct fronius_dev *dev,
+                                  struct fronius_parser *parser)
+{
+    ssize_t rv = fronius_fd_recv(dev, parser);
+
+    if (rv == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return rv;
+}
+
+const struct fronius_transport fronius_transport_serial = {
+    .name  = "serial",
+    .send  = fronius_fd_send,
+    .recv  = fronius_fd_recv,
+    .wait  = fronius_fd_wait,
+    .close = fronius_serial_close,
+};
+
+const struct fronius_transport fronius_transport_stream = {
+    .name  = "stream",
+    .send  = fronius_fd_send,
+    .recv  = fronius_fd_recv,
+    .wait  = fronius_fd_wait,
+    .close = fronius_fd_close,
+};
+
+const struct fronius_transport fronius_transport_dgram = {
+    .name  = "dgram",
+    .send  = fronius_fd_send,
+    .recv  = fronius_dgram_recv,
+    .wait  = fronius_fd_wait,
+    .close = fronius_fd_close,
+};
+
+/*
+ * TCP connections, e.g. to a serial-to-Ethernet converter, are
+ * re-established when they break, without ever blocking the caller. While
+ * the link is down, an epoll instance stands in behind the descriptor
+ * number of the old socket. It watches the connect in progress, so the
+ * caller's own poll loop wakes up when it finishes, and it is quiet while
+ * the next attempt has to wait for its backoff. Only a connected socket
+ * takes over the descriptor number again. Frames which cannot be sent
+ * meanwhile are lost and retransmitted after the timeout of their request.
+ */
+
+#define FRONIUS_BACKOFF_MIN	100	/* ms */
+#define FRONIUS_BACKOFF_MAX	(30 * 1000)
+
+struct fronius_tcp {
+	/* addresses of the peer, the current one is tried first */
+	struct sockaddr_storage	addr[FRONIUS_CONNECT_MAX];
+	socklen_t		addrlen[FRONIUS_CONNECT_MAX];
+	size_t			naddrs, cur;
+	/* stand-in while the link is down and the connect in progress */
+	int			epfd;
+	int			pending;
+	int			down;
+	struct timespec		deadline;
+	/* the link was up before, error of the latest connect */
+	int			established;
+	int			error;
+	/* earliest next attempt and the delay after that one */
+	struct timespec		retry_at;
+	unsigned int		backoff;
+};
+
+static void fronius_tcp_after(struct timespec *ts, unsigned int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += ms % 1000 * 1000000L;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* milliseconds until the given time, 0 if it has passed */
+static long fronius_tcp_until(const struct timespec *ts)
+{
+    struct timespec now;
+    long ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (ts->tv_sec - now.tv_sec) * 1000 +
+         (ts->tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+    return ms > 0 ? ms : 0;
+}
+
+static struct fronius_tcp *fronius_tcp_new(void)
+{
+    struct fronius_tcp *tcp;
+
+    tcp = calloc(1, sizeof(*tcp));
+    if (!tcp)
+        return NULL;
+
+    tcp->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (tcp->epfd == -1) {
+        free(tcp);
+        return NULL;
+    }
+    tcp->pending = -1;
+    tcp->backoff = FRONIUS_BACKOFF_MIN;
+
+    return tcp;
+}
+
+static void fronius_tcp_free(struct fronius_tcp *tcp)
+{
+    if (tcp->pending != -1)
+        close(tcp->pending);
+    close(tcp->epfd);
+    free(tcp);
+}
+
+/* add the addresses of host and port not known yet; they are looked up
+   once, so that no reconnect waits for a lookup */
+static int fronius_tcp_resolve(struct fronius_tcp *tcp, const char *host,
+                               const char *port)
+{
+    struct addrinfo hints, *result, *rp;
+    size_t i;
+    int s;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    s = getaddrinfo(host, port, &hints, &result);
+    if (s != 0) {
+        /* set a reasonable errno for compatibility */
+        if (s != EAI_SYSTEM)
+            errno = EINVAL;
+        return -1;
+    }
+
+    for (rp = result; rp && tcp->naddrs < FRONIUS_CONNECT_MAX;
+         rp = rp->ai_next) {
+        for (i = 0; i < tcp->naddrs; ++i)
+            if (tcp->addrlen[i] == rp->ai_addrlen &&
+                !memcmp(&tcp->addr[i], rp->ai_addr, rp->ai_addrlen))
+                break;
+        if (i < tcp->naddrs || rp->ai_addrlen > sizeof(tcp->addr[0]))
+            continue;
+
+        memcpy(&tcp->addr[tcp->naddrs], rp->ai_addr, rp->ai_addrlen);
+        tcp->addrlen[tcp->naddrs++] = rp->ai_addrlen;
+    }
+    freeaddrinfo(result);
+
+    return 0;
+}
+
+int fronius_tcp_init(struct fronius_dev *dev, const char *host,
+                     const char *port)
+{
+    struct fronius_tcp *tcp = fronius_tcp_new();
+
+    if (!tcp)
+        return -1;
+
+    /* the address connected to comes first, the others are fallbacks */
+    tcp->addrlen[0] = sizeof(tcp->addr[0]);
+    if (getpeername(dev->fd, (struct sockaddr *) &tcp->addr[0],
+                    &tcp->addrlen[0]) == 0)
+        tcp->naddrs = 1;
+    fronius_tcp_resolve(tcp, host, port);
+
+    if (!tcp->naddrs) {
+        fronius_tcp_free(tcp);
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+
+    tcp->established = 1;
+    dev->transport_priv = tcp;
+
+    return 0;
+}
+
+/* errors of a connection which is gone for good */
+static int fronius_tcp_broken(int err)
+{
+    switch (err) {
+    case EPIPE:
+    case ECONNRESET:
+    case ECONNABORTED:
+    case ENOTCONN:
+    case ETIMEDOUT:
+    case EHOSTUNREACH:
+    case ENETUNREACH:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* put a descriptor behind the device's one, which keeps its number */
+static int fronius_tcp_install(struct fronius_dev *dev, int fd)
+{
+    if (dup2(fd, dev->fd) == -1 ||
+        fcntl(dev->fd, F_SETFD, FD_CLOEXEC) == -1)
+        return -1;
+
+    /* a partial frame of the old connection is of no use */
+    fronius_parser_flush(&dev->parser);
+    dev->rx_busy = 0;
+    dev->txoff = 0;
+    dev->fdgen++;
+
+    return 0;
+}
+
+/* the connection broke, the stand-in takes its place */
+static void fronius_tcp_down(struct fronius_dev *dev)
+{
+    struct fronius_tcp *tcp = dev->transport_priv;
+
+    if (tcp->down)
+        return;
+
+    /* closing the socket is all that matters, a failure leaves the
+       broken socket, which is noticed again */
+    if (fronius_tcp_install(dev, tcp->epfd) == 0)
+        tcp->down = 1;
+}
+
+/* start a connect of up to timeout ms unless the backoff forbids it */
+static void fronius_tcp_connect(struct fronius_dev *dev, unsigned int timeout)
+{
+    struct fronius_tcp *tcp = dev->transport_priv;
+    const struct sockaddr *sa = (const struct sockaddr *) &tcp->addr[tcp->cur];
+    struct epoll_event ev;
+    int fd;
+
+    if (tcp->pending != -1 || fronius_tcp_until(&tcp->retry_at))
+        return;
+
+    /* space the attempts until the connection proves itself */
+    fronius_tcp_after(&tcp->retry_at, tcp->backoff);
+    if (tcp->backoff < FRONIUS_BACKOFF_MAX / 2)
+        tcp->backoff *= 2;
+    else
+        tcp->backoff = FRONIUS_BACKOFF_MAX;
+
+    fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        tcp->error = errno;
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+
+    if ((connect(fd, sa, tcp->addrlen[tcp->cur]) == -1 &&
+         errno != EINPROGRESS) ||
+        epoll_ctl(tcp->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        tcp->error = errno;
+        close(fd);
+        tcp->cur = (tcp->cur + 1) % tcp->naddrs;
+        return;
+    }
+
+    tcp->pending = fd;
+    fronius_tcp_after(&tcp->deadline, timeout);
+}
+
+int fronius_tcp_open(struct fronius_dev *dev, const char *host,
+                     const char *port)
+{
+    struct fronius_tcp *tcp = fronius_tcp_new();
+
+    if (!tcp)
+        return -1;
+
+    if (fronius_tcp_resolve(tcp, host, port) == -1 || !tcp->naddrs) {
+        if (!tcp->naddrs)
+            errno = EADDRNOTAVAIL;
+        fronius_tcp_free(tcp);
+        return -1;
+    }
+
+    /* the device starts out with its link down */
+    dev->fd = fcntl(tcp->epfd, F_DUPFD_CLOEXEC, 0);
+    if (dev->fd == -1) {
+        fronius_tcp_free(tcp);
+        return -1;
+    }
+
+    tcp->down = 1;
+    tcp->error = EINPROGRESS;
+    dev->transport_priv = tcp;
+    fronius_tcp_connect(dev, FRONIUS_CONNECT_TIMEOUT);
+
+    return 0;
+}
+
+int fronius_tcp_error(struct fronius_dev *dev)
+{
+    struct fronius_tcp *tcp = dev->transport_priv;
+
+    if (dev->transport != &fronius_transport_tcp || !tcp->down)
+        return 0;
+
+    return tcp->error;
+}
+
+/* check the connect in progress, returns 0 once the link is up again */
+static int fronius_tcp_finish(struct fronius_dev *dev)
+{
+    struct fronius_tcp *tcp = dev->transport_priv;
+    const struct sockaddr *sa = (const struct sockaddr *) &tcp->addr[tcp->cur];
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int fd = tcp->pending, soerr;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, 0) <= 0) {
+        if (fronius_tcp_until(&tcp->deadline))
+            return -1;
+        soerr = ETIMEDOUT;
+    } else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == -1) {
+        soerr = errno;
+    }
+
+    /* the stand-in must not keep the socket registered */
+    epoll_ctl(tcp->epfd, EPOLL_CTL_DEL, fd, NULL);
+    tcp->pending = -1;
+
+    if (soerr || fronius_tcp_install(dev, fd) == -1) {
+        tcp->error = soerr ? soerr : errno;
+        close(fd);
+        tcp->cur = (tcp->cur + 1) % tcp->naddrs;
+        return -1;
+    }
+    close(fd);
+
+    fronius_connect_tune(dev->fd, sa->sa_family);
+    tcp->down = 0;
+    tcp->error = 0;
+    if (tcp->established)
+        FRONIUS_STAT_ADD(dev->stats.reconnects, 1);
+    tcp->established = 1;
+
+    return 0;
+}
+
+/* bring the link up as far as possible without blocking, returns 0 if
+   it is up */
+static int fronius_tcp_link(struct fronius_dev *dev)
+{
+    struct fronius_tcp *tcp = dev->transport_priv;
+
+    if (!tcp->down)
+        return 0;
+
+    if (tcp->pending != -1 && fronius_tcp_finish(dev) == 0)
+        return 0;
+
+    fronius_tcp_connect(dev, FRONIUS_RECONNECT_TIMEOUT);
+
+    return -1;
+}
+
+/* while a connect is in progress the frame waits for it, else it is lost */
+static ssize_t fronius_tcp_unreachable(struct fronius_dev *dev)
+{
+    struct fronius_tcp *tcp = dev->transport_priv;
+
+    errno = tcp->pending != -1 ? EAGAIN : ENOTCONN;
+    return -1;
+}
+
+static ssize_t fronius_tcp_send(struct fronius_dev *dev, const uint8_t *buf,
+                                size_t len)
+{
+    ssize_t rv;
+
+    if (fronius_tcp_link(dev) < 0)
+        return fronius_tcp_unreachable(dev);
+
+    do {
+        /* no SIGPIPE if the peer is gone */
+        rv = send(dev->fd, buf, len, MSG_NOSIGNAL);
+    } while (rv == -1 && errno == EINTR);
+
+    if (rv == -1 && fronius_tcp_broken(errno)) {
+        fronius_tcp_down(dev);
+        /* start over with the whole frame on the new connection */
+        if (fronius_tcp_link(dev) < 0)
+            return fronius_tcp_unreachable(dev);
+        errno = EAGAIN;
+    }
+
+    return rv;
+}
+
+static ssize_t fronius_tcp_recv(struct fronius_dev *dev,
+                                struct fronius_parser *parser)
+{
+    struct fronius_tcp *tcp = dev->transport_priv;
+    ssize_t rv;
+
+    /* the response is lost with the old connection, the request runs into
+       its timeout and is retransmitted */
+    if (fronius_tcp_link(dev) < 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    rv = fronius_fd_recv(dev, parser);
+    if (rv > 0) {
+        tcp->backoff = FRONIUS_BACKOFF_MIN;
+        return rv;
+    }
+
+    if (rv == 0 || fronius_tcp_broken(errno)) {
+        fronius_tcp_down(dev);
+        fronius_tcp_link(dev);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return rv;
+}
+
+/* the stand-in only ever becomes readable */
+static int fronius_tcp_events(struct fronius_dev *dev, int events)
+{
+    struct fronius_tcp *tcp = dev->transport_priv;
+
+    return tcp->down && events ? POLLIN : events;
+}
+
+/* a connect in progress is given up at its deadline, the next one is
+   started once the backoff is over */
+static int fronius_tcp_timeout(struct fronius_dev *dev, int timeout)
+{
+    struct fronius_tcp *tcp = dev->transport_priv;
+    long ms;
+
+    if (!tcp->down)
+        return timeout;
+
+    ms = fronius_tcp_until(tcp->pending != -1 ? &tcp->deadline :
+                                                &tcp->retry_at);
+
+    return timeout >= 0 && timeout < ms ? timeout : ms;
+}
+
+static int fronius_tcp_close(struct fronius_dev *dev)
+{
+    fronius_tcp_free(dev->transport_priv);
+    dev->transport_priv = NULL;
+
+    return close(dev->fd);
+}
+
+const struct fronius_transport fronius_transport_tcp = {
+    .name    = "tcp",
+    .send    = fronius_tcp_send,
+    .recv    = fronius_tcp_recv,
+    .wait    = fronius_fd_wait,
+    .events  = fronius_tcp_events,
+    .timeout = fronius_tcp_timeout,
+    .close   = fronius_tcp_close,
+};
+
+/*
+ * The in-memory transport answers every frame synchronously from a
+ * responder callback. The response is written straight into the receive
+ * ring, so no byte is copied between the responder and the parser unless
+ * the free space wraps around the end of the ring.
+ */
+
+struct fronius_mem {
+	fronius_responder_t	responder;
+	void			*arg;
+	uint8_t			bounce[FRONIUS_MAX_PKTLEN];
+};
+
+static ssize_t fronius_mem_send(struct fronius_dev *dev, const uint8_t *buf,
+                                size_t len)
+{
+    struct fronius_mem *mem = dev->transport_priv;
+    struct fronius_parser *p = &dev->parser;
+    size_t pos = p->head & (FRONIUS_RXRING_SIZE - 1);
+    size_t space = FRONIUS_RXRING_SIZE - fronius_parser_pending(p);
+    size_t contig = FRONIUS_RXRING_SIZE - pos;
+    size_t n;
+
+    if (contig > space)
+        contig = space;
+
+    if (contig >= FRONIUS_MAX_PKTLEN) {
+        n = mem->responder(buf, len, &p->ring[pos], contig, mem->arg);
+        if (n > contig)
+            n = contig;
+        p->head += n;
+    } else {
+        n = mem->responder(buf, len, mem->bounce, sizeof(mem->bounce),
+                           mem->arg);
+        if (n > sizeof(mem->bounce))
+            n = sizeof(mem->bounce);
+        n = fronius_parser_feed(p, mem->bounce, n);
+    }
+
+    FRONIUS_STAT_ADD(dev->stats.bytes_received, n);
+
+    return len;
+}
+
+static ssize_t fronius_mem_recv(struct fronius_dev *dev,
+                                struct fronius_parser *parser)
+{
+    (void) dev;
+    (void) parser;
+
+    /* responses are in the ring already, nothing more will arrive */
+    errno = EAGAIN;
+    return -1;
+}
+
+static int fronius_mem_wait(struct fronius_dev *dev, int events, int timeout)
+{
+    struct timespec ts;
+    int revents = events & POLLOUT;
+
+    if (fronius_parser_pending(&dev->parser))
+        revents |= events & POLLIN;
+
+    /* an unanswered request can only run into its timeout */
+    if (!revents && timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = timeout % 1000 * 1000000L;
+        nanosleep(&ts, NULL);
+    }
+
+    return revents;
+}
+
+static int fronius_mem_close(struct fronius_dev *dev)
+{
+    free(dev->transport_priv);
+    dev->transport_priv = NULL;
+
+    return 0;
+}
+
+const struct fronius_transport fronius_transport_mem = {
+    .name  = "mem",
+    .send  = fronius_mem_send,
+    .recv  = fronius_mem_recv,
+    .wait  = fronius_mem_wait,
+    .close = fronius_mem_close,
+};
+
+struct fronius_dev *fronius_open_mem(fronius_responder_t responder, void *arg,
+                                     const fronius_ifc_type_t ifc_type)
+{
+    struct fronius_dev *dev;
+    struct fronius_mem *mem;
+
+    if (!responder || ifc_type == FRONIUS_IFC_TYPE_PROBE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    dev = calloc(1, sizeof(*dev));
+    if (!dev)
+        return NULL;
+
+    mem = calloc(1, sizeof(*mem));
+    if (!mem) {
+        free(dev);
+        return NULL;
+    }
+
+    mem->responder = responder;
+    mem->arg = arg;
+
+    dev->fd = -1;
+    dev->transport = &fronius_transport_mem;
+    dev->transport_priv = mem;
+    dev->ifc_type = ifc_type;
+    dev->baudrate = FRONIUS_BAUDRATE_AUTO;
+
+    return dev;
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/*
+ * A value is an unsigned 16 bit mantissa and a decimal exponent from -3 to
+ * 10, the exponents 11 and -4 flag an overflow and an underflow. Scaling
+ * is done with a table of powers of ten, so neither libm nor floating
+ * point is needed for the integer forms.
+ */
+
+#define FRONIUS_EXP_MIN		(-3)
+#define FRONIUS_EXP_MAX		10
+
+static const double fronius_pow10_exp[] = {
+    1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+};
+
+/* all powers of ten an int64_t can hold */
+static const int64_t fronius_pow10[] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL, 10000000000LL, 100000000000LL,
+    1000000000000LL, 10000000000000LL, 100000000000000LL,
+    1000000000000000LL, 10000000000000000LL, 100000000000000000LL,
+    1000000000000000000LL,
+};
+
+#define FRONIUS_POW10_MAX \
+    (int) (sizeof(fronius_pow10) / sizeof(fronius_pow10[0]) - 1)
+
+fronius_error_t fronius_fixed_decode(const uint8_t *data,
+                                     struct fronius_fixed *fixed)
+{
+    signed char e = data[2];
+
+    /* the flags are compared unsigned, 0xFC is -4 as exponent */
+    if (data[2] == FRONIUS_VALUE_OVERFLOW)
+        return FRONIUS_ERR_VALUE_OVERFLOW;
+
+    if (data[2] == FRONIUS_VALUE_UNDERFLOW)
+        return FRONIUS_ERR_VALUE_UNDERFLOW;
+
+    if (e < FRONIUS_EXP_MIN || e > FRONIUS_EXP_MAX)
+        return FRONIUS_ERR_INVALID_RESPONSE;
+
+    if (fixed) {
+        fixed->mantissa = data[0] << 8 | data[1];
+        fixed->exponent = e;
+    }
+
+    return FRONIUS_ERR_NOERROR;
+}
+
+fronius_error_t fronius_fixed_scale(const struct fronius_fixed *fixed,
+                                    int scale, int64_t *value)
+{
+    int64_t m = fixed->mantissa, p;
+    int d = fixed->exponent - scale;
+
+    if (d >= 0) {
+        if (m && (d > FRONIUS_POW10_MAX || m > INT64_MAX / fronius_pow10[d]))
+            return FRONIUS_ERR_VALUE_OVERFLOW;
+        *value = m ? m * fronius_pow10[d] : 0;
+        return FRONIUS_ERR_NOERROR;
+    }
+
+    /* finer than the chosen unit, round to nearest */
+    if (-d > FRONIUS_POW10_MAX) {
+        *value = 0;
+        return FRONIUS_ERR_NOERROR;
+    }
+
+    p = fronius_pow10[-d];
+    *value = (m + p / 2) / p;
+
+    return FRONIUS_ERR_NOERROR;
+}
+
+fronius_error_t fronius_value_scaled(const uint8_t *data, int scale,
+                                     int64_t *value)
+{
+    struct fronius_fixed fixed;
+    fronius_error_t rv;
+
+    if ((rv = fronius_fixed_decode(data, &fixed)) != FRONIUS_ERR_NOERROR)
+        return rv;
+
+    return fronius_fixed_scale(&fixed, scale, value);
+}
+
+size_t fronius_values_scaled(const uint8_t *data, size_t stride, size_t n,
+                             int scale, int64_t *values,
+                             fronius_error_t *errors)
+{
+    fronius_error_t rv;
+    size_t i, ok = 0;
+
+    for (i = 0; i < n; ++i, data += stride) {
+        rv = fronius_value_scaled(data, scale, &values[i]);
+        if (rv != FRONIUS_ERR_NOERROR)
+            values[i] = 0;
+        else
+            ok++;
+        if (errors)
+            errors[i] = rv;
+    }
+
+    return ok;
+}
+
+fronius_error_t fronius_decode_value(const uint8_t *data, double *value)
+{
+    struct fronius_fixed fixed;
+    fronius_error_t rv;
+
+    if ((rv = fronius_fixed_decode(data, &fixed)) != FRONIUS_ERR_NOERROR)
+        return rv;
+
+    if (value)
+        *value = fixed.mantissa *
+                 fronius_pow10_exp[fixed.exponent - FRONIUS_EXP_MIN];
+
+    return FRONIUS_ERR_NOERROR;
+}
+
+fronius_error_t fronius_get_value(const struct fronius_pkt *pkt, double *value)
+{
+    return fronius_decode_value(pkt->data, value);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <config.h>
+
+#include "check.h"
+
+int check_failures;
+
+int check_exit(void)
+{
+    if (check_failures)
+        fprintf(stderr, "%d check(s) failed\n", check_failures);
+
+    return check_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+struct fronius_dev *check_sim_open(struct sim *sim, pid_t *pid)
+{
+    struct fronius_dev *dev;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+        return NULL;
+
+    *pid = fork();
+    if (*pid == -1) {
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+
+    if (*pid == 0) {
+        close(sv[0]);
+        sim_serve(sim, sv[1]);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(sv[1]);
+
+    dev = fronius_open_fd(sv[0], FRONIUS_IFC_TYPE_INTERFACECARD);
+    if (!dev) {
+        close(sv[0]);
+        kill(*pid, SIGTERM);
+        waitpid(*pid, NULL, 0);
+    }
+
+    return dev;
+}
+
+void check_sim_close(struct fronius_dev *dev, pid_t pid)
+{
+    /* the simulator sees end of file and returns */
+    fronius_close(dev);
+    waitpid(pid, NULL, 0);
+}
+
+struct fronius_dev *check_silent_open(int *peer)
+{
+    struct fronius_dev *dev;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+        return NULL;
+
+    dev = fronius_open_fd(sv[0], FRONIUS_IFC_TYPE_INTERFACECARD);
+    if (!dev) {
+        close(sv[0]);
+        close(sv[1]);
+        return NULL;
+    }
+
+    *peer = sv[1];
+    return dev;
+}
+
+void check_fast_timeouts(struct fronius_dev *dev, uint8_t command)
+{
+    struct timespec now;
+    int i;
+
+    for (i = 0; i < 16; ++i) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        fronius_rto_sample(dev, command, &now);
+    }
+}
+
+double check_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <math.h>
+#include <sys/types.h>
+
+#include "sim.h"
+
+/* number of failed checks so far */
+extern int check_failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", \
+                    __FILE__, __LINE__, #cond); \
+            check_failures++; \
+        } \
+    } while (0)
+
+/* a decoded value, equal within the resolution of the protocol */
+#define CHECK_VALUE(v, expected) \
+    CHECK(fabs((v) - (expected)) <= fabs(expected) * 1e-3 + 1e-6)
+
+/*
+ * Returns the exit status for the test driver: 0 if all checks passed.
+ */
+int check_exit(void);
+
+/*
+ * Serve requests with the simulator from a child process on one end of a
+ * socket pair and return a device on the other end. The child ends when
+ * the device is closed.
+ */
+struct fronius_dev *check_sim_open(struct sim *, pid_t *);
+
+/*
+ * Close a device opened by check_sim_open() and reap the simulator.
+ */
+void check_sim_close(struct fronius_dev *, pid_t);
+
+/*
+ * Return a device whose peer never answers. The peer end is returned as
+ * well, it has to be kept open for the device to stay connected.
+ */
+struct fronius_dev *check_silent_open(int *);
+
+/*
+ * Feed the timeout estimator of a command with immediate answers, so that
+ * an unanswered request expires after the minimum timeout.
+ */
+void check_fast_timeouts(struct fronius_dev *, uint8_t);
+
+/*
+ * Milliseconds of CLOCK_MONOTONIC.
+ */
+double check_ms(void);
+
+#endif /* CHECK_H */
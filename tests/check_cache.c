@@ -0,0 +1,189 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <config.h>
+
+#include "check.h"
+
+/* value cache against in-memory devices answered by the simulator; the
+   request counter of the simulator tells what went to the bus */
+
+#define MAX_POWER_DAY	3120.0
+
+struct cached_dev {
+	struct sim		sim;
+	struct fronius_dev	*dev;
+};
+
+static int cached_open(struct cached_dev *c)
+{
+    sim_init(&c->sim);
+    c->dev = fronius_open_mem(sim_respond, &c->sim,
+                              FRONIUS_IFC_TYPE_INTERFACECARD);
+    if (!c->dev || fronius_cache_enable(c->dev, 1) == -1)
+        return -1;
+
+    return 0;
+}
+
+/* query a value, returns the number of requests it took */
+static unsigned long cached_get(struct cached_dev *c, uint8_t cmd,
+                                double expected)
+{
+    unsigned long requests = c->sim.requests;
+    double value;
+
+    CHECK(fronius_cmd_iv_getvalue(c->dev, cmd, &value) == FRONIUS_ERR_NOERROR);
+    if (expected)
+        CHECK_VALUE(value, expected);
+
+    return c->sim.requests - requests;
+}
+
+static int64_t wallclock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void check_classes(void)
+{
+    struct fronius_cache_stats stats;
+    struct cached_dev c;
+
+    if (cached_open(&c) == -1) {
+        CHECK(!"cannot open device");
+        return;
+    }
+
+    /* a day value is fetched once, a momentary value every time */
+    CHECK(cached_get(&c, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+    CHECK(cached_get(&c, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 0);
+    CHECK(cached_get(&c, FRONIUS_CMD_POWER_NOW, 0) == 1);
+    CHECK(cached_get(&c, FRONIUS_CMD_POWER_NOW, 0) == 1);
+
+    CHECK(fronius_cache_stats(c.dev, &stats) == 0);
+    CHECK(stats.hits == 1);
+    CHECK(stats.misses == 1);
+    CHECK(stats.entries == 1);
+
+    /* invalidated entries are fetched again */
+    CHECK(fronius_cache_invalidate(c.dev, FRONIUS_CACHE_ANY, FRONIUS_CACHE_ANY,
+                                   FRONIUS_CMD_MAX_POWER_DAY) == 0);
+    CHECK(cached_get(&c, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+
+    /* and so are expired ones */
+    CHECK(fronius_cache_set_ttl(c.dev, FRONIUS_CACHE_DAY, 50) == 0);
+    CHECK(fronius_cache_invalidate(c.dev, FRONIUS_CACHE_ANY, FRONIUS_CACHE_ANY,
+                                   FRONIUS_CACHE_ANY) == 0);
+    CHECK(cached_get(&c, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+    CHECK(cached_get(&c, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 0);
+    usleep(80000);
+    CHECK(cached_get(&c, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+
+    /* a TTL of 0 turns caching of a class off */
+    CHECK(fronius_cache_set_ttl(c.dev, FRONIUS_CACHE_DAY, 0) == 0);
+    CHECK(cached_get(&c, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+    CHECK(cached_get(&c, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+
+    fronius_close(c.dev);
+}
+
+/* garbled answers are never cached */
+static void check_malformed(void)
+{
+    struct cached_dev c;
+    struct fronius_pkt pkt;
+    uint8_t length;
+
+    if (cached_open(&c) == -1) {
+        CHECK(!"cannot open device");
+        return;
+    }
+
+    fronius_pkt_init(&pkt);
+    pkt.device = FRONIUS_DEVICE_INVERTER;
+    pkt.number = 1;
+    pkt.command = FRONIUS_CMD_MAX_POWER_DAY;
+    pkt.length = 2;
+    fronius_cache_store(c.dev, &pkt);
+    CHECK(!fronius_cache_lookup(c.dev, pkt.device, pkt.number, pkt.command,
+                                &length));
+
+    pkt.length = 3;
+    fronius_cache_store(c.dev, &pkt);
+    CHECK(fronius_cache_lookup(c.dev, pkt.device, pkt.number, pkt.command,
+                               &length) && length == 3);
+
+    fronius_close(c.dev);
+}
+
+/* exported values keep their expiry when imported elsewhere */
+static void check_export(void)
+{
+    struct fronius_cache_value values[FRONIUS_CACHE_SLOTS];
+    struct cached_dev a, b;
+    int64_t now;
+    size_t n;
+
+    if (cached_open(&a) == -1 || cached_open(&b) == -1) {
+        CHECK(!"cannot open device");
+        return;
+    }
+
+    CHECK(fronius_cache_set_ttl(a.dev, FRONIUS_CACHE_DAY, 300) == 0);
+    CHECK(cached_get(&a, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+    CHECK(cached_get(&a, FRONIUS_CMD_ENERGY_DAY, 0) == 1);
+
+    now = wallclock_ms();
+    n = fronius_cache_export(a.dev, values, FRONIUS_CACHE_SLOTS);
+    CHECK(n == 2);
+    CHECK(n > 0 && values[0].expires > now &&
+          values[0].expires <= now + 300);
+
+    /* imported values are served until they would have expired in the
+       exporting cache, not for a full default TTL */
+    fronius_cache_import(b.dev, values, n);
+    CHECK(cached_get(&b, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 0);
+    CHECK(cached_get(&b, FRONIUS_CMD_ENERGY_DAY, 0) == 0);
+    usleep(350000);
+    CHECK(cached_get(&b, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+
+    /* expired values are dropped */
+    fronius_cache_invalidate(b.dev, FRONIUS_CACHE_ANY, FRONIUS_CACHE_ANY,
+                             FRONIUS_CACHE_ANY);
+    fronius_cache_import(b.dev, values, n);
+    CHECK(cached_get(&b, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+
+    /* the class TTL of the importing cache caps what is left */
+    values[0].expires = wallclock_ms() + 60 * 1000;
+    fronius_cache_invalidate(b.dev, FRONIUS_CACHE_ANY, FRONIUS_CACHE_ANY,
+                             FRONIUS_CACHE_ANY);
+    CHECK(fronius_cache_set_ttl(b.dev, FRONIUS_CACHE_DAY, 50) == 0);
+    fronius_cache_import(b.dev, values, 1);
+    CHECK(cached_get(&b, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 0);
+    usleep(80000);
+    CHECK(cached_get(&b, FRONIUS_CMD_MAX_POWER_DAY, MAX_POWER_DAY) == 1);
+
+    fronius_close(a.dev);
+    fronius_close(b.dev);
+}
+
+int main(void)
+{
+    check_classes();
+    check_malformed();
+    check_export();
+
+    return check_exit();
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "check.h"
+
+/* a capture ring wrapped many times over still yields wall clock times */
+
+#define CAPTURE_PATH	"check_capture.cap"
+#define CAPTURE_SIZE	4096
+#define REQUESTS	500
+
+struct records {
+	uint64_t	from, to;
+	unsigned int	count, tx, rx;
+	unsigned int	out_of_range, backwards;
+	uint64_t	last;
+};
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int record_cb(int dir, uint64_t ts, const uint8_t *frame, size_t len,
+                     void *arg)
+{
+    struct records *r = arg;
+
+    (void) frame;
+    (void) len;
+
+    r->count++;
+    if (dir == FRONIUS_TRACE_TX)
+        r->tx++;
+    else if (dir == FRONIUS_TRACE_RX)
+        r->rx++;
+
+    if (ts < r->from || ts > r->to)
+        r->out_of_range++;
+    if (ts < r->last)
+        r->backwards++;
+    r->last = ts;
+
+    return 0;
+}
+
+static void run_requests(struct fronius_dev *dev)
+{
+    double value;
+    int i;
+
+    for (i = 0; i < REQUESTS; ++i)
+        CHECK(fronius_cmd_iv_getvalue(dev, FRONIUS_CMD_POWER_NOW,
+                                      &value) == FRONIUS_ERR_NOERROR);
+}
+
+static void check_read(struct records *r, uint64_t from)
+{
+    r->from = from;
+    r->to = realtime_ns();
+    r->count = r->tx = r->rx = 0;
+    r->out_of_range = r->backwards = 0;
+    r->last = 0;
+
+    CHECK(fronius_capture_read(CAPTURE_PATH, record_cb, r) == 0);
+
+    /* only the latest frames are left, all of them at the time they were
+       captured */
+    CHECK(r->count > 10 && r->count < REQUESTS);
+    CHECK(r->tx + r->rx == r->count);
+    CHECK(r->out_of_range == 0);
+    CHECK(r->backwards == 0);
+}
+
+int main(void)
+{
+    struct fronius_dev *dev;
+    struct records r;
+    struct sim sim;
+    uint64_t start;
+
+    unlink(CAPTURE_PATH);
+
+    sim_init(&sim);
+    dev = fronius_open_mem(sim_respond, &sim, FRONIUS_IFC_TYPE_INTERFACECARD);
+    if (!dev) {
+        CHECK(!"cannot open device");
+        return check_exit();
+    }
+
+    start = realtime_ns();
+    CHECK(fronius_capture_open(dev, CAPTURE_PATH, CAPTURE_SIZE) == 0);
+    run_requests(dev);
+    check_read(&r, start);
+
+    /* a continued capture wraps over the clock record of the first one */
+    CHECK(fronius_capture_close(dev) == 0);
+    CHECK(fronius_capture_open(dev, CAPTURE_PATH, CAPTURE_SIZE) == 0);
+    run_requests(dev);
+    check_read(&r, start);
+
+    CHECK(fronius_capture_close(dev) == 0);
+    fronius_close(dev);
+    unlink(CAPTURE_PATH);
+
+    return check_exit();
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <config.h>
+
+#include "check.h"
+
+/* one thread drives a simulated and a silent device: the simulated one is
+   answered while the other one waits for its receive deadlines */
+
+#define MAX_POWER_DAY	3120.0
+#define ROUNDS		20
+
+struct peer {
+	struct fronius_mux	*mux;
+	uint8_t			command;
+	int			rounds;
+	fronius_error_t		error;
+	double			value;
+	double			done;
+};
+
+static void completed(struct fronius_dev *dev,
+                      const struct fronius_result *result, void *arg)
+{
+    struct peer *p = arg;
+    struct fronius_fixed fixed;
+    int64_t scaled;
+
+    p->error = result->error;
+    if (result->error == FRONIUS_ERR_NOERROR &&
+        fronius_fixed_decode(result->data, &fixed) == FRONIUS_ERR_NOERROR &&
+        fronius_fixed_scale(&fixed, 0, &scaled) == FRONIUS_ERR_NOERROR)
+        p->value = scaled;
+
+    /* the next request is started from the callback, the device of a
+       failed one is removed */
+    if (result->error == FRONIUS_ERR_NOERROR && --p->rounds > 0) {
+        CHECK(fronius_submit(dev, FRONIUS_DEVICE_INVERTER, 1, p->command,
+                             completed, p) == 0);
+        return;
+    }
+
+    p->done = check_ms();
+    if (result->error != FRONIUS_ERR_NOERROR)
+        CHECK(fronius_mux_del(p->mux, dev) == 0);
+}
+
+static void check_deadlines(void)
+{
+    struct peer answered = { NULL, FRONIUS_CMD_MAX_POWER_DAY, ROUNDS,
+                             FRONIUS_ERR_NOERROR, 0, 0 };
+    struct peer silent = { NULL, FRONIUS_CMD_POWER_NOW, 1,
+                           FRONIUS_ERR_NOERROR, 0, 0 };
+    struct fronius_dev *a, *b;
+    struct fronius_mux *mux;
+    struct sim sim;
+    double start;
+    pid_t pid;
+    int peer, rv;
+
+    sim_init(&sim);
+    a = check_sim_open(&sim, &pid);
+    b = check_silent_open(&peer);
+    mux = fronius_mux_new();
+    if (!a || !b || !mux) {
+        CHECK(!"cannot set up devices");
+        return;
+    }
+    answered.mux = silent.mux = mux;
+
+    /* the silent device gives up after a few short timeouts */
+    check_fast_timeouts(b, FRONIUS_CMD_POWER_NOW);
+
+    CHECK(fronius_mux_add(mux, a) == 0);
+    CHECK(fronius_mux_add(mux, b) == 0);
+
+    start = check_ms();
+    CHECK(fronius_submit(b, FRONIUS_DEVICE_INVERTER, 1, silent.command,
+                         completed, &silent) == 0);
+    CHECK(fronius_submit(a, FRONIUS_DEVICE_INVERTER, 1, answered.command,
+                         completed, &answered) == 0);
+
+    do {
+        rv = fronius_mux_run(mux, 1000);
+    } while (rv > 0 && check_ms() - start < 10000);
+
+    CHECK(rv == 0);
+    CHECK(fronius_mux_error(mux, a) == 0);
+
+    CHECK(answered.rounds == 0);
+    CHECK(answered.error == FRONIUS_ERR_NOERROR);
+    CHECK_VALUE(answered.value, MAX_POWER_DAY);
+
+    /* all retransmissions of the silent device expired, after the
+       answered device was served */
+    CHECK(silent.error == FRONIUS_ERR_INVALID_RESPONSE);
+    CHECK(answered.done > 0 && answered.done < silent.done);
+    CHECK(silent.done - start > 20 && silent.done - start < 5000);
+
+    /* the removed device is left alone */
+    CHECK(fronius_mux_del(mux, b) == -1);
+
+    CHECK(fronius_mux_del(mux, a) == 0);
+    fronius_mux_free(mux);
+    fronius_close(b);
+    close(peer);
+    check_sim_close(a, pid);
+}
+
+/* without an estimate the receive timeout is long, it must not expire
+   early */
+static void check_cold(void)
+{
+    struct peer silent = { NULL, FRONIUS_CMD_POWER_NOW, 1,
+                           FRONIUS_ERR_NOERROR, 0, 0 };
+    struct fronius_stats stats;
+    struct fronius_dev *dev;
+    struct fronius_mux *mux;
+    double start;
+    int peer;
+
+    dev = check_silent_open(&peer);
+    mux = fronius_mux_new();
+    if (!dev || !mux) {
+        CHECK(!"cannot set up devices");
+        return;
+    }
+    silent.mux = mux;
+
+    CHECK(fronius_mux_add(mux, dev) == 0);
+    CHECK(fronius_submit(dev, FRONIUS_DEVICE_INVERTER, 1, silent.command,
+                         completed, &silent) == 0);
+
+    start = check_ms();
+    do {
+        CHECK(fronius_mux_run(mux, 100) == 1);
+        CHECK(fronius_stats(dev, &stats) == 0);
+    } while (!stats.timeouts && check_ms() - start < 5000);
+
+    CHECK(stats.timeouts == 1);
+    CHECK(check_ms() - start > 2900);
+    CHECK(!silent.done);
+
+    CHECK(fronius_mux_del(mux, dev) == 0);
+    fronius_mux_free(mux);
+    fronius_close(dev);
+    close(peer);
+}
+
+int main(void)
+{
+    check_deadlines();
+    check_cold();
+
+    return check_exit();
+}
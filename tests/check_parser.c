@@ -0,0 +1,173 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <config.h>
+
+#include "check.h"
+
+/* frames are taken from a byte stream: whole, split at any byte, behind
+   noise and after damaged frames */
+
+#define NFRAMES	300
+
+static uint32_t seed = 12345;
+
+/* deterministic pseudo random numbers */
+static unsigned int rnd(unsigned int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+static size_t put_frame(uint8_t *buf, struct fronius_pkt *pkt, unsigned int i)
+{
+    unsigned int j;
+
+    fronius_pkt_init(pkt);
+    pkt->device = FRONIUS_DEVICE_INVERTER;
+    pkt->number = 1 + i % 99;
+    pkt->command = 0x10 + i % 32;
+    pkt->length = i % (FRONIUS_MAX_DATALEN + 1);
+    for (j = 0; j < pkt->length; ++j)
+        pkt->data[j] = (i + j) & 0x7f;
+    fronius_pkt_checksum(pkt);
+
+    memcpy(buf, pkt->start, FRONIUS_PKT_LEN(pkt));
+    return FRONIUS_PKT_LEN(pkt);
+}
+
+static int same_frame(const struct fronius_pkt *a, const struct fronius_pkt *b)
+{
+    return !memcmp(a->start, b->start, FRONIUS_PKT_LEN(a));
+}
+
+/* a clean stream arriving in chunks of any size, wrapping the ring */
+static void check_chunks(void)
+{
+    static uint8_t stream[NFRAMES * FRONIUS_MAX_PKTLEN];
+    static struct fronius_pkt sent[NFRAMES];
+    struct fronius_parser parser;
+    struct fronius_pkt rx;
+    size_t len = 0, off = 0, n;
+    unsigned int i, got = 0;
+
+    for (i = 0; i < NFRAMES; ++i)
+        len += put_frame(&stream[len], &sent[i], i);
+
+    fronius_parser_init(&parser);
+    while (off < len) {
+        n = 1 + rnd(FRONIUS_MAX_PKTLEN);
+        if (n > len - off)
+            n = len - off;
+        off += fronius_parser_feed(&parser, &stream[off], n);
+
+        while (fronius_parser_next(&parser, &rx)) {
+            CHECK(got < NFRAMES && same_frame(&rx, &sent[got]));
+            got++;
+        }
+    }
+
+    CHECK(got == NFRAMES);
+    CHECK(parser.resyncs == 0);
+    CHECK(parser.checksum_errors == 0);
+    CHECK(fronius_parser_pending(&parser) == 0);
+}
+
+/* noise, a damaged and a truncated frame are skipped */
+static void check_resync(void)
+{
+    static const uint8_t noise[] = { 0x12, 0x80, 0x80, 0x34, 0x80 };
+    uint8_t stream[8 * FRONIUS_MAX_PKTLEN];
+    struct fronius_pkt a, b, c, d, rx;
+    struct fronius_parser parser;
+    size_t len = 0, off, blen;
+    int got = 0;
+
+    memcpy(stream, noise, sizeof(noise));
+    len += sizeof(noise);
+    len += put_frame(&stream[len], &a, 7);
+
+    /* checksum broken */
+    blen = put_frame(&stream[len], &b, 8);
+    stream[len + blen - 1] ^= 0x55;
+    len += blen;
+
+    /* a start byte too many in front of a frame */
+    stream[len++] = FRONIUS_START_SEQUENCE;
+    len += put_frame(&stream[len], &c, 9);
+
+    /* cut off in the middle, the next frame follows right away */
+    len += put_frame(&stream[len], &d, 20) - 15;
+    len += put_frame(&stream[len], &d, 11);
+
+    /* byte by byte, the worst case for partial frames */
+    fronius_parser_init(&parser);
+    for (off = 0; off < len; ++off) {
+        fronius_parser_feed(&parser, &stream[off], 1);
+        while (fronius_parser_next(&parser, &rx)) {
+            switch (got++) {
+            case 0:
+                CHECK(same_frame(&rx, &a));
+                break;
+            case 1:
+                CHECK(same_frame(&rx, &c));
+                break;
+            case 2:
+                CHECK(same_frame(&rx, &d));
+                break;
+            default:
+                CHECK(!"unexpected frame");
+                break;
+            }
+        }
+    }
+
+    CHECK(got == 3);
+    CHECK(parser.checksum_errors >= 1);
+    CHECK(parser.resyncs >= 3);
+    CHECK(parser.skipped >= sizeof(noise));
+}
+
+/* a full ring takes no more bytes until frames are read */
+static void check_full(void)
+{
+    uint8_t stream[FRONIUS_RXRING_SIZE + FRONIUS_MAX_PKTLEN];
+    struct fronius_parser parser;
+    struct fronius_pkt pkt, rx;
+    size_t len = 0, taken;
+    unsigned int i = 0, got = 0;
+
+    while (len < FRONIUS_RXRING_SIZE)
+        len += put_frame(&stream[len], &pkt, 3 + i++ % 5);
+
+    fronius_parser_init(&parser);
+    taken = fronius_parser_feed(&parser, stream, len);
+    CHECK(taken == FRONIUS_RXRING_SIZE);
+
+    while (fronius_parser_next(&parser, &rx))
+        got++;
+    CHECK(got > 0 && got <= i);
+
+    /* the rest fits in again and completes the frame cut off */
+    CHECK(fronius_parser_feed(&parser, &stream[taken], len - taken) ==
+          len - taken);
+    while (fronius_parser_next(&parser, &rx))
+        got++;
+    CHECK(got == i);
+    CHECK(parser.resyncs == 0);
+}
+
+int main(void)
+{
+    check_chunks();
+    check_resync();
+    check_full();
+
+    return check_exit();
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdlib.h>
+
+#include <config.h>
+
+#include "check.h"
+
+/* receive timeout estimation: bounds, backoff and adaption to a line
+   slower than estimated */
+
+/* bounds of the receive timeout in microseconds, see fronius_rto.c */
+#define RTO_MIN		(20 * 1000)
+#define RTO_MAX		(3 * 1000 * 1000)
+#define BACKOFF_MAX	3
+
+#define LATENCY_US	60000
+#define REQUESTS	30
+
+static void check_backoff(void)
+{
+    struct sim sim;
+    struct fronius_dev *dev;
+    int i;
+
+    sim_init(&sim);
+    dev = fronius_open_mem(sim_respond, &sim, FRONIUS_IFC_TYPE_INTERFACECARD);
+    if (!dev) {
+        CHECK(!"cannot open device");
+        return;
+    }
+
+    /* nothing known yet */
+    CHECK(fronius_rto(dev, FRONIUS_CMD_POWER_NOW, 0) == RTO_MAX);
+    fronius_rto_backoff(dev, FRONIUS_CMD_POWER_NOW);
+    CHECK(fronius_rto(dev, FRONIUS_CMD_POWER_NOW, 0) == RTO_MAX);
+
+    /* immediate answers give the minimum, also for other commands */
+    check_fast_timeouts(dev, FRONIUS_CMD_POWER_NOW);
+    CHECK(fronius_rto(dev, FRONIUS_CMD_POWER_NOW, 0) == RTO_MIN);
+    CHECK(fronius_rto(dev, FRONIUS_CMD_ENERGY_DAY, 0) == RTO_MIN);
+
+    /* retransmissions double the timeout up to the maximum */
+    CHECK(fronius_rto(dev, FRONIUS_CMD_POWER_NOW, 1) == 2 * RTO_MIN);
+    CHECK(fronius_rto(dev, FRONIUS_CMD_POWER_NOW, 2) == 4 * RTO_MIN);
+    CHECK(fronius_rto(dev, FRONIUS_CMD_POWER_NOW, 10) == RTO_MAX);
+
+    /* timeouts carry over to the following requests, but only a few */
+    for (i = 0; i < BACKOFF_MAX + 5; ++i)
+        fronius_rto_backoff(dev, FRONIUS_CMD_POWER_NOW);
+    CHECK(fronius_rto(dev, FRONIUS_CMD_POWER_NOW, 0) ==
+          RTO_MIN << BACKOFF_MAX);
+    CHECK(fronius_rto(dev, FRONIUS_CMD_POWER_NOW, 2) ==
+          RTO_MIN << (BACKOFF_MAX + 2));
+    CHECK(fronius_rto(dev, FRONIUS_CMD_ENERGY_DAY, 0) == RTO_MIN);
+
+    /* until the next answer */
+    check_fast_timeouts(dev, FRONIUS_CMD_POWER_NOW);
+    CHECK(fronius_rto(dev, FRONIUS_CMD_POWER_NOW, 0) == RTO_MIN);
+
+    fronius_close(dev);
+}
+
+/* an estimate far too short for the line adapts after a few timeouts
+   instead of retransmitting every request */
+static void check_adaption(void)
+{
+    struct fronius_stats stats;
+    struct fronius_dev *dev;
+    struct sim sim;
+    double value;
+    long rto;
+    pid_t pid;
+    int i, errors = 0;
+
+    sim_init(&sim);
+    sim.latency_us = LATENCY_US;
+    dev = check_sim_open(&sim, &pid);
+    if (!dev) {
+        CHECK(!"cannot open device");
+        return;
+    }
+
+    check_fast_timeouts(dev, FRONIUS_CMD_MAX_POWER_DAY);
+
+    for (i = 0; i < REQUESTS; ++i)
+        if (fronius_cmd_iv_getvalue(dev, FRONIUS_CMD_MAX_POWER_DAY,
+                                    &value) != FRONIUS_ERR_NOERROR)
+            errors++;
+
+    CHECK(errors == 0);
+    CHECK(fronius_stats(dev, &stats) == 0);
+    CHECK(stats.retries < REQUESTS / 5);
+
+    rto = fronius_rto(dev, FRONIUS_CMD_MAX_POWER_DAY, 0);
+    CHECK(rto > LATENCY_US && rto < 5 * LATENCY_US);
+
+    check_sim_close(dev, pid);
+}
+
+int main(void)
+{
+    check_backoff();
+    check_adaption();
+
+    return check_exit();
+}
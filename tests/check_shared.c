@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include <config.h>
+
+#include "check.h"
+
+/* several threads query a simulated device through one shared handle;
+   every answer reaches the thread which asked for it */
+
+#define THREADS		8
+#define QUERIES		25
+
+/* the inverter number tells the threads apart, the simulator adds 1 %
+   per number to the value */
+#define MAX_POWER_DAY(n)	(3120.0 * (1 + 0.01 * ((n) - 1)))
+
+struct worker {
+	pthread_t		thread;
+	struct fronius_shared	*shared;
+	uint8_t			number;
+	int			answered;
+	int			wrong;
+};
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct fronius_future *f;
+    struct fronius_result result;
+    struct fronius_fixed fixed;
+    int64_t value;
+    int i;
+
+    for (i = 0; i < QUERIES; ++i) {
+        f = fronius_shared_query(w->shared, FRONIUS_DEVICE_INVERTER,
+                                 w->number, FRONIUS_CMD_MAX_POWER_DAY);
+        if (!f) {
+            w->wrong++;
+            continue;
+        }
+
+        if (fronius_future_wait(f, &result) == 0 &&
+            result.error == FRONIUS_ERR_NOERROR &&
+            result.number == w->number &&
+            result.command == FRONIUS_CMD_MAX_POWER_DAY &&
+            fronius_fixed_decode(result.data, &fixed) == FRONIUS_ERR_NOERROR &&
+            fronius_fixed_scale(&fixed, 0, &value) == FRONIUS_ERR_NOERROR &&
+            fabs(value - MAX_POWER_DAY(w->number)) < 1)
+            w->answered++;
+        else
+            w->wrong++;
+
+        fronius_future_free(f);
+    }
+
+    return NULL;
+}
+
+int main(void)
+{
+    struct worker workers[THREADS];
+    struct fronius_shared *shared;
+    struct fronius_stats stats;
+    struct fronius_dev *dev;
+    struct sim sim;
+    pid_t pid;
+    int i;
+
+    sim_init(&sim);
+    sim.inverters = THREADS;
+    dev = check_sim_open(&sim, &pid);
+    if (!dev) {
+        CHECK(!"cannot open device");
+        return check_exit();
+    }
+
+    shared = fronius_shared_new(dev);
+    if (!shared) {
+        CHECK(!"cannot share device");
+        check_sim_close(dev, pid);
+        return check_exit();
+    }
+
+    for (i = 0; i < THREADS; ++i) {
+        workers[i].shared = shared;
+        workers[i].number = i + 1;
+        workers[i].answered = 0;
+        workers[i].wrong = 0;
+        CHECK(pthread_create(&workers[i].thread, NULL, worker_run,
+                             &workers[i]) == 0);
+    }
+
+    for (i = 0; i < THREADS; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        CHECK(workers[i].answered == QUERIES);
+        CHECK(workers[i].wrong == 0);
+    }
+
+    CHECK(fronius_shared_free(shared) == 0);
+
+    /* one request on the bus per query, none of them retransmitted */
+    CHECK(fronius_stats(dev, &stats) == 0);
+    CHECK(stats.requests == THREADS * QUERIES);
+    CHECK(stats.retries == 0);
+
+    check_sim_close(dev, pid);
+
+    return check_exit();
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <config.h>
+
+#include "check.h"
+
+/* samples written to a store come back unchanged, also after a crash
+   tore the block written last */
+
+#define STORE_PATH	"check_store.db"
+#define NSAMPLES	5000
+#define NSERIES		2
+
+struct sample {
+	int64_t			time;
+	struct fronius_fixed	fixed;
+	fronius_error_t		error;
+};
+
+static struct sample series[NSERIES][NSAMPLES];
+
+static const uint8_t series_cmd[NSERIES] = {
+    FRONIUS_CMD_POWER_NOW,
+    FRONIUS_CMD_ENERGY_DAY,
+};
+
+struct scan {
+	/* next sample expected per series */
+	size_t		next[NSERIES];
+	size_t		offset[NSERIES];
+	unsigned int	mismatches;
+};
+
+static uint32_t seed = 4711;
+
+static unsigned int rnd(unsigned int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+/* irregular intervals, gaps and exponent changes, some failed samples */
+static void make_samples(void)
+{
+    struct sample *x;
+    int64_t t;
+    int s, i, power = 1800;
+
+    for (s = 0; s < NSERIES; ++s) {
+        t = 1514764800000LL + s;
+        for (i = 0; i < NSAMPLES; ++i) {
+            x = &series[s][i];
+            t += 1000 + rnd(20);
+            if (rnd(500) == 0)
+                t += 3600 * 1000LL * (1 + rnd(48));
+            x->time = t;
+            x->error = rnd(50) ? FRONIUS_ERR_NOERROR : FRONIUS_ERR_NO_RESPONSE;
+            if (x->error != FRONIUS_ERR_NOERROR)
+                continue;
+            power += (int) rnd(41) - 20;
+            x->fixed.mantissa = s ? 9000 + i / 10 : power;
+            x->fixed.exponent = rnd(100) ? 0 : (int) rnd(7) - 3;
+        }
+    }
+}
+
+static int series_of(uint8_t number, uint8_t command)
+{
+    int s;
+
+    for (s = 0; s < NSERIES; ++s)
+        if (number == s + 1 && command == series_cmd[s])
+            return s;
+
+    return -1;
+}
+
+static int scan_cb(uint8_t number, uint8_t command, int64_t time,
+                   const struct fronius_fixed *fixed, fronius_error_t error,
+                   void *arg)
+{
+    struct scan *scan = arg;
+    const struct sample *x;
+    int s = series_of(number, command);
+    size_t i;
+
+    if (s < 0 || scan->next[s] >= NSAMPLES) {
+        scan->mismatches++;
+        return 0;
+    }
+
+    i = scan->offset[s] + scan->next[s]++;
+    x = &series[s][i];
+    if (time != x->time || error != x->error ||
+        (error == FRONIUS_ERR_NOERROR &&
+         (!fixed || fixed->mantissa != x->fixed.mantissa ||
+          fixed->exponent != x->fixed.exponent)))
+        scan->mismatches++;
+
+    return 0;
+}
+
+static struct fronius_store *write_store(void)
+{
+    struct fronius_store *st;
+    const struct sample *x;
+    int s, i;
+
+    unlink(STORE_PATH);
+    st = fronius_store_open(STORE_PATH, 0);
+    if (!st)
+        return NULL;
+
+    /* interleaved as a logger would append them */
+    for (i = 0; i < NSAMPLES; ++i)
+        for (s = 0; s < NSERIES; ++s) {
+            x = &series[s][i];
+            CHECK(fronius_store_append(st, s + 1, series_cmd[s], x->time,
+                                       x->error ? NULL : &x->fixed,
+                                       x->error) == 0);
+        }
+
+    /* time must not go back */
+    CHECK(fronius_store_append(st, 1, series_cmd[0], series[0][0].time,
+                               NULL, FRONIUS_ERR_NO_RESPONSE) == -1);
+
+    return st;
+}
+
+static void check_roundtrip(void)
+{
+    struct fronius_store_stats stats;
+    struct fronius_store *st;
+    struct scan scan;
+
+    st = write_store();
+    if (!st) {
+        CHECK(!"cannot create store");
+        return;
+    }
+    CHECK(fronius_store_close(st) == 0);
+
+    st = fronius_store_open(STORE_PATH, 1);
+    if (!st) {
+        CHECK(!"cannot open store");
+        return;
+    }
+
+    CHECK(fronius_store_stats(st, &stats) == 0);
+    CHECK(stats.samples == NSERIES * NSAMPLES);
+    CHECK(stats.pending == 0);
+    CHECK(stats.corrupt == 0);
+    /* far less than the 11 bytes of a raw time and value */
+    CHECK(stats.bytes < NSERIES * NSAMPLES * 3);
+
+    memset(&scan, 0, sizeof(scan));
+    CHECK(fronius_store_scan(st, 0, 0, INT64_MIN, INT64_MAX, scan_cb,
+                             &scan) == NSERIES * NSAMPLES);
+    CHECK(scan.next[0] == NSAMPLES && scan.next[1] == NSAMPLES);
+    CHECK(scan.mismatches == 0);
+
+    /* a time range of one series */
+    memset(&scan, 0, sizeof(scan));
+    scan.offset[1] = 1000;
+    CHECK(fronius_store_scan(st, 2, series_cmd[1], series[1][1000].time,
+                             series[1][1100].time, scan_cb, &scan) == 100);
+    CHECK(scan.next[0] == 0 && scan.next[1] == 100);
+    CHECK(scan.mismatches == 0);
+
+    CHECK(fronius_store_close(st) == 0);
+}
+
+static void check_torn(void)
+{
+    struct fronius_store_stats stats;
+    struct fronius_store *st;
+    struct scan scan;
+    struct stat sb;
+    int64_t t;
+
+    st = write_store();
+    if (!st) {
+        CHECK(!"cannot create store");
+        return;
+    }
+    CHECK(fronius_store_flush(st) == 0);
+    CHECK(fronius_store_stats(st, &stats) == 0);
+    CHECK(stats.pending == 0);
+    CHECK(fronius_store_close(st) == 0);
+
+    /* a crash in the middle of writing the last block */
+    CHECK(stat(STORE_PATH, &sb) == 0);
+    CHECK(truncate(STORE_PATH, sb.st_size - 100) == 0);
+
+    st = fronius_store_open(STORE_PATH, 0);
+    if (!st) {
+        CHECK(!"cannot open store");
+        return;
+    }
+
+    CHECK(fronius_store_stats(st, &stats) == 0);
+    CHECK(stats.corrupt == 1);
+    CHECK(stats.samples > 0 && stats.samples < NSERIES * NSAMPLES);
+
+    /* all samples before the torn block are intact */
+    memset(&scan, 0, sizeof(scan));
+    CHECK(fronius_store_scan(st, 0, 0, INT64_MIN, INT64_MAX, scan_cb,
+                             &scan) == (int) stats.samples);
+    CHECK(scan.next[0] + scan.next[1] == stats.samples);
+    CHECK(scan.mismatches == 0);
+
+    /* the store goes on after the cut */
+    t = series[0][NSAMPLES - 1].time;
+    CHECK(fronius_store_append(st, 1, series_cmd[0], t + 1000,
+                               &series[0][0].fixed,
+                               FRONIUS_ERR_NOERROR) == 0);
+    CHECK(fronius_store_close(st) == 0);
+
+    st = fronius_store_open(STORE_PATH, 1);
+    if (!st) {
+        CHECK(!"cannot open store");
+        return;
+    }
+    CHECK(fronius_store_stats(st, &stats) == 0);
+    CHECK(stats.corrupt == 0);
+    CHECK(stats.samples == scan.next[0] + scan.next[1] + 1);
+    CHECK(fronius_store_close(st) == 0);
+}
+
+int main(void)
+{
+    make_samples();
+    check_roundtrip();
+    check_torn();
+
+    unlink(STORE_PATH);
+
+    return check_exit();
+}
@@ -0,0 +1,483 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* config.h first: posix_openpt() and friends need the system extensions */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+
+/* number of frames prepared for the parser benchmarks */
+#define BENCH_FRAMES		4096
+
+/* number of values decoded per batch */
+#define BENCH_VALUES		64
+
+struct bench_result {
+	const char	*name;
+	unsigned long	iterations;
+	double		total_s;
+	double		p50_ns, p99_ns;
+};
+
+static FILE *out;
+static unsigned long scale = 1;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(const struct bench_result *r)
+{
+    double ns = r->total_s * 1e9 / r->iterations;
+
+    fprintf(out, "%s,%lu,%.6f,%.1f,%.1f,%.0f,%.0f\n", r->name,
+            r->iterations, r->total_s, ns, r->iterations / r->total_s,
+            r->p50_ns, r->p99_ns);
+    fflush(out);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void percentiles(struct bench_result *r, uint64_t *samples, size_t n)
+{
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    r->p50_ns = samples[n / 2];
+    r->p99_ns = samples[n * 99 / 100];
+}
+
+/* a valid response to a value query */
+static void bench_value_pkt(struct fronius_pkt *pkt, uint8_t cmd)
+{
+    fronius_pkt_init(pkt);
+    pkt->device = FRONIUS_DEVICE_INVERTER;
+    pkt->number = 1;
+    pkt->command = cmd;
+    pkt->length = 3;
+    pkt->data[0] = 0x09;
+    pkt->data[1] = 0xf6;
+    pkt->data[2] = 0xff;
+    fronius_pkt_checksum(pkt);
+}
+
+/* serialize a packet into its wire format */
+static size_t bench_frame(const struct fronius_pkt *pkt, uint8_t *buf)
+{
+    memcpy(buf, pkt->start, FRONIUS_PKT_LEN(pkt));
+
+    return FRONIUS_PKT_LEN(pkt);
+}
+
+static void bench_micro(void)
+{
+    struct bench_result r;
+    struct fronius_pkt pkt, rx;
+    volatile fronius_error_t err = 0;
+    double value = 0.0;
+    int64_t scaled, batch[BENCH_VALUES];
+    static uint8_t values[BENCH_VALUES * FRONIUS_MAX_PKTLEN];
+    unsigned long i, n = 2000000 * scale;
+    uint64_t t0;
+    FILE *devnull;
+
+    bench_value_pkt(&pkt, FRONIUS_CMD_POWER_NOW);
+    memset(&r, 0, sizeof(r));
+    r.iterations = n;
+
+    r.name = "pkt_checksum";
+    t0 = now_ns();
+    for (i = 0; i < n; ++i) {
+        pkt.data[1] = i;
+        fronius_pkt_checksum(&pkt);
+    }
+    r.total_s = (now_ns() - t0) / 1e9;
+    report(&r);
+
+    r.name = "pkt_validate";
+    fronius_pkt_checksum(&pkt);
+    t0 = now_ns();
+    for (i = 0; i < n; ++i)
+        err |= fronius_pkt_validate(&pkt);
+    r.total_s = (now_ns() - t0) / 1e9;
+    report(&r);
+
+    r.name = "get_value";
+    t0 = now_ns();
+    for (i = 0; i < n; ++i) {
+        pkt.data[2] = (i & 7) - 3;
+        err |= fronius_get_value(&pkt, &value);
+    }
+    r.total_s = (now_ns() - t0) / 1e9;
+    report(&r);
+
+    r.name = "value_scaled";
+    t0 = now_ns();
+    for (i = 0; i < n; ++i) {
+        pkt.data[2] = (i & 7) - 3;
+        err |= fronius_value_scaled(pkt.data, -3, &scaled);
+    }
+    r.total_s = (now_ns() - t0) / 1e9;
+    report(&r);
+
+    /* the payloads of a batch of frames, one pass over all of them */
+    r.name = "values_scaled";
+    for (i = 0; i < BENCH_VALUES; ++i) {
+        values[i * FRONIUS_MAX_PKTLEN] = i >> 8;
+        values[i * FRONIUS_MAX_PKTLEN + 1] = i;
+        values[i * FRONIUS_MAX_PKTLEN + 2] = (i & 7) - 3;
+    }
+    t0 = now_ns();
+    for (i = 0; i < n / BENCH_VALUES; ++i)
+        err |= !fronius_values_scaled(values, FRONIUS_MAX_PKTLEN, BENCH_VALUES,
+                                      -3, batch, NULL);
+    r.total_s = (now_ns() - t0) / 1e9;
+    report(&r);
+
+    devnull = fopen("/dev/null", "w");
+    if (devnull) {
+        r.name = "pkt_rawdump";
+        r.iterations = n / 10;
+        t0 = now_ns();
+        for (i = 0; i < r.iterations; ++i)
+            fronius_pkt_rawdump(devnull, "bench", &pkt);
+        r.total_s = (now_ns() - t0) / 1e9;
+        report(&r);
+        fclose(devnull);
+    }
+
+    /* parse a stream of back-to-back frames from memory */
+    {
+        uint8_t stream[BENCH_FRAMES * 16];
+        struct fronius_parser parser;
+        size_t len = 0, off;
+        unsigned long frames = 0;
+
+        for (i = 0; i < BENCH_FRAMES; ++i) {
+            bench_value_pkt(&pkt, FRONIUS_CMD_POWER_NOW + (i & 15));
+            len += bench_frame(&pkt, &stream[len]);
+        }
+
+        fronius_parser_init(&parser);
+        r.name = "parser_next";
+        r.iterations = 0;
+        t0 = now_ns();
+        for (i = 0; i < 100 * scale; ++i) {
+            for (off = 0; off < len; ) {
+                off += fronius_parser_feed(&parser, &stream[off], len - off);
+                while (fronius_parser_next(&parser, &rx))
+                    frames++;
+            }
+        }
+        r.total_s = (now_ns() - t0) / 1e9;
+        r.iterations = frames;
+        report(&r);
+    }
+
+    /* fronius_pkt_recv() including the read() from a pipe */
+    {
+        struct fronius_dev *dev = calloc(1, sizeof(*dev));
+        uint8_t frame[FRONIUS_MAX_PKTLEN];
+        int fds[2];
+        size_t len;
+        unsigned long j, batch = 1024;
+
+        if (dev && pipe(fds) == 0) {
+            dev->fd = fds[0];
+            dev->transport = &fronius_transport_stream;
+            bench_value_pkt(&pkt, FRONIUS_CMD_POWER_NOW);
+            len = bench_frame(&pkt, frame);
+
+            r.name = "pkt_recv";
+            r.iterations = 0;
+            r.total_s = 0;
+            for (i = 0; i < 200 * scale; ++i) {
+                for (j = 0; j < batch; ++j)
+                    if (write(fds[1], frame, len) != (ssize_t) len)
+                        break;
+                t0 = now_ns();
+                for (j = 0; j < batch; ++j)
+                    if (fronius_pkt_recv(dev, &rx) < 0)
+                        break;
+                r.total_s += (now_ns() - t0) / 1e9;
+                r.iterations += j;
+            }
+            report(&r);
+
+            close(fds[0]);
+            close(fds[1]);
+        }
+        free(dev);
+    }
+
+    if (err == 0xff)
+        fprintf(stderr, "unexpected\n");
+}
+
+static pid_t start_sim(struct sim *sim, char *name, size_t size, int *keep)
+{
+    struct termios tio;
+    pid_t pid;
+    int fd;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1)
+        return -1;
+    if (tcgetattr(fd, &tio) == -1)
+        return -1;
+    cfmakeraw(&tio);
+    if (tcsetattr(fd, TCSANOW, &tio) == -1)
+        return -1;
+
+    snprintf(name, size, "%s", ptsname(fd));
+
+    /* hold the slave open until the benchmark is done, so that the
+       simulator does not see a hangup in between */
+    *keep = open(name, O_RDWR | O_NOCTTY);
+    if (*keep == -1)
+        return -1;
+
+    pid = fork();
+    if (pid == 0) {
+        close(*keep);
+        sim_serve(sim, fd);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(fd);
+    return pid;
+}
+
+/* completions of a plan run, the latency of one is the time since the
+   previous one as the plan submits back-to-back */
+struct bench_plan {
+	unsigned long	*errors;
+	uint64_t	*samples;
+	size_t		n, max;
+	uint64_t	last;
+};
+
+static void bench_plan_done(struct fronius_dev *dev,
+                            const struct fronius_result *res, void *arg)
+{
+    struct bench_plan *bp = arg;
+    uint64_t t = now_ns();
+
+    (void) dev;
+
+    if (res->error != FRONIUS_ERR_NOERROR)
+        (*bp->errors)++;
+
+    if (bp->n < bp->max)
+        bp->samples[bp->n++] = t - bp->last;
+    bp->last = t;
+}
+
+static int bench_e2e(int bps)
+{
+    static const uint8_t cmds[] = {
+        FRONIUS_CMD_POWER_NOW, FRONIUS_CMD_ENERGY_DAY,
+        FRONIUS_CMD_AC_VOLTAGE_NOW, FRONIUS_CMD_DC_VOLTAGE_NOW,
+    };
+    struct bench_result r;
+    struct fronius_dev *dev;
+    struct fronius_plan *plan;
+    struct fronius_plan_stats ps;
+    struct bench_plan bp;
+    struct sim sim;
+    char name[64], list[4] = { 1, 2, 3, 0 };
+    uint64_t *samples, t0, t;
+    unsigned long i, n = (bps ? 50 : 20000) * scale, errors = 0;
+    unsigned int cycles;
+    double value;
+    int keep, status;
+    pid_t pid;
+
+    sim_init(&sim);
+    sim.inverters = 3;
+    sim.bps = bps;
+    sim.latency_us = bps ? sim.latency_us : 0;
+
+    pid = start_sim(&sim, name, sizeof(name), &keep);
+    if (pid < 0) {
+        perror("simulator");
+        return -1;
+    }
+
+    dev = fronius_open(name, FRONIUS_IFC_TYPE_INTERFACECARD,
+                       FRONIUS_BAUDRATE_B19200);
+    samples = calloc(n, sizeof(*samples));
+    if (!dev || !samples) {
+        perror("open");
+        kill(pid, SIGTERM);
+        return -1;
+    }
+
+    /* latency of single blocking requests */
+    memset(&r, 0, sizeof(r));
+    r.name = bps ? "e2e_getvalue_serial" : "e2e_getvalue";
+    r.iterations = n;
+    t0 = now_ns();
+    for (i = 0; i < n; ++i) {
+        t = now_ns();
+        if (fronius_cmd_iv_getvalue(dev, FRONIUS_CMD_POWER_NOW, &value))
+            errors++;
+        samples[i] = now_ns() - t;
+    }
+    r.total_s = (now_ns() - t0) / 1e9;
+    percentiles(&r, samples, n);
+    report(&r);
+
+    /* throughput and latency of a back-to-back poll plan */
+    cycles = n / (sizeof(cmds) * 3) + 1;
+    memset(&bp, 0, sizeof(bp));
+    bp.errors = &errors;
+    bp.max = cycles * sizeof(cmds) * 3;
+    bp.samples = calloc(bp.max, sizeof(*bp.samples));
+    plan = fronius_plan_new(dev, FRONIUS_DEVICE_INVERTER, list, sizeof(list),
+                            cmds, sizeof(cmds), bench_plan_done, &bp);
+    if (plan && bp.samples) {
+        memset(&r, 0, sizeof(r));
+        r.name = bps ? "e2e_plan_serial" : "e2e_plan";
+        bp.last = now_ns();
+        if (fronius_plan_run(plan, cycles) == 0 &&
+            fronius_plan_stats(plan, &ps) == 0 && bp.n) {
+            r.iterations = ps.transactions;
+            r.total_s = ps.elapsed;
+            percentiles(&r, bp.samples, bp.n);
+            report(&r);
+        }
+    }
+    if (plan)
+        fronius_plan_free(plan);
+    free(bp.samples);
+
+    if (errors)
+        fprintf(stderr, "%s: %lu failed requests\n", r.name, errors);
+
+    free(samples);
+    fronius_close(dev);
+    close(keep);
+    waitpid(pid, &status, 0);
+
+    return errors ? -1 : 0;
+}
+
+/* the protocol stack alone, without any i/o */
+static int bench_mem(void)
+{
+    struct bench_result r;
+    struct fronius_dev *dev;
+    struct sim sim;
+    uint64_t *samples, t0, t;
+    unsigned long i, n = 200000 * scale, errors = 0;
+    double value;
+
+    sim_init(&sim);
+    sim.bps = 0;
+    sim.latency_us = 0;
+
+    dev = fronius_open_mem(sim_respond, &sim, FRONIUS_IFC_TYPE_INTERFACECARD);
+    samples = calloc(n, sizeof(*samples));
+    if (!dev || !samples) {
+        perror("open");
+        free(samples);
+        return -1;
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.name = "mem_getvalue";
+    r.iterations = n;
+    t0 = now_ns();
+    for (i = 0; i < n; ++i) {
+        t = now_ns();
+        if (fronius_cmd_iv_getvalue(dev, FRONIUS_CMD_POWER_NOW, &value))
+            errors++;
+        samples[i] = now_ns() - t;
+    }
+    r.total_s = (now_ns() - t0) / 1e9;
+    percentiles(&r, samples, n);
+    report(&r);
+
+    if (errors)
+        fprintf(stderr, "%s: %lu failed requests\n", r.name, errors);
+
+    free(samples);
+    fronius_close(dev);
+
+    return errors ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int c, rv = EXIT_SUCCESS, serial = 0;
+
+    out = stdout;
+
+    while ((c = getopt(argc, argv, "o:n:s")) != -1) {
+        switch (c) {
+        case 'o':
+            out = fopen(optarg, "w");
+            if (!out) {
+                perror(optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            scale = strtoul(optarg, NULL, 0);
+            if (!scale)
+                scale = 1;
+            break;
+        case 's':
+            serial = 1;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-o file.csv] [-n scale] [-s]\n"
+                    "  -o file   write CSV results to file (default: stdout)\n"
+                    "  -n scale  multiply the number of iterations\n"
+                    "  -s        also run end-to-end tests with 19200 baud timing\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fprintf(out, "benchmark,iterations,total_s,ns_per_op,ops_per_s,p50_ns,p99_ns\n");
+
+    bench_micro();
+
+    if (bench_mem() < 0)
+        rv = EXIT_FAILURE;
+
+    if (bench_e2e(0) < 0)
+        rv = EXIT_FAILURE;
+    if (serial && bench_e2e(19200) < 0)
+        rv = EXIT_FAILURE;
+
+    if (out != stdout)
+        fclose(out);
+
+    return rv;
+}
@@ -0,0 +1,461 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <config.h>
+
+#include "fronius-private.h"
+
+/* first bytes of a capture file, see fronius_capture.c */
+static const uint8_t capture_magic[4] = { 'F', 'R', 'C', 'P' };
+
+/* a captured frame */
+struct record {
+	uint64_t	ts;
+	uint8_t		dir;
+	uint8_t		len;
+	uint8_t		frame[FRONIUS_MAX_PKTLEN];
+};
+
+/* a request together with the frames received until the next request */
+struct transaction {
+	struct record	*tx;
+	struct record	*rx;
+	size_t		nrx;
+};
+
+struct decoder {
+	FILE		*out;
+	int		count_only;
+	unsigned long	frames;
+	unsigned long	errors;
+	unsigned long	skipped;
+	/* timestamp and direction of the capture record being decoded */
+	uint64_t	ts;
+	int		dir;
+};
+
+struct replay {
+	struct record		*recs;
+	size_t			nrecs;
+	struct transaction	*trans;
+	size_t			ntrans;
+	int			unlimited;
+	/* result check of the currently replayed transaction */
+	struct transaction	*cur;
+	unsigned long		mismatches;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] file\n"
+            "  -f format  input is a 'raw' byte stream or a 'capture' file\n"
+            "             (default: detected from the file)\n"
+            "  -c         only count frames, do not print them\n"
+            "  -r         replay a capture file into a fronius_dev\n"
+            "  -u         replay at unlimited speed (default: original timing)\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Decoding
+ */
+
+static void print_value(FILE *out, const uint8_t *frame)
+{
+    const uint8_t *data = &frame[FRONIUS_OF_DATA];
+    uint8_t length = frame[FRONIUS_OF_LENGTH], i;
+    double value;
+
+    /* error frames carry the failed command and the error code */
+    if (frame[FRONIUS_OF_COMMAND] == 0x0e && length == 2) {
+        fprintf(out, "error 0x%02x 0x%02x", data[0], data[1]);
+        return;
+    }
+
+    /* value responses use the common mantissa/exponent encoding */
+    if (length == 3 && frame[FRONIUS_OF_DEVICE] != FRONIUS_DEVICE_INTERFACECARD) {
+        switch (fronius_decode_value(data, &value)) {
+        case FRONIUS_ERR_VALUE_OVERFLOW:
+            fputs("overflow", out);
+            break;
+        case FRONIUS_ERR_VALUE_UNDERFLOW:
+            fputs("underflow", out);
+            break;
+        default:
+            fprintf(out, "%g", value);
+        }
+        return;
+    }
+
+    for (i = 0; i < length; ++i)
+        fprintf(out, "%s%02x", i ? " " : "", data[i]);
+}
+
+static int decode_frame(const uint8_t *frame, size_t len, void *arg)
+{
+    struct decoder *d = arg;
+
+    (void) len;
+
+    d->frames++;
+    if (frame[FRONIUS_OF_COMMAND] == 0x0e)
+        d->errors++;
+
+    if (d->count_only)
+        return 0;
+
+    if (d->dir >= 0)
+        fprintf(d->out, "%llu.%09llu,%s,",
+                (unsigned long long) (d->ts / 1000000000ULL),
+                (unsigned long long) (d->ts % 1000000000ULL),
+                d->dir == FRONIUS_TRACE_TX ? "tx" : "rx");
+
+    fprintf(d->out, "%u,%u,0x%02x,%u,", frame[FRONIUS_OF_DEVICE],
+            frame[FRONIUS_OF_NUMBER], frame[FRONIUS_OF_COMMAND],
+            frame[FRONIUS_OF_LENGTH]);
+    print_value(d->out, frame);
+    fputc('\n', d->out);
+
+    return 0;
+}
+
+static int decode_record(int dir, uint64_t ts, const uint8_t *frame,
+                         size_t len, void *arg)
+{
+    struct decoder *d = arg;
+
+    d->ts = ts;
+    d->dir = dir;
+
+    /* the capture holds single frames, validate them all the same */
+    fronius_frames_scan(frame, len, decode_frame, d, &d->skipped);
+
+    return 0;
+}
+
+static int decode_raw(struct decoder *d, const uint8_t *buf, size_t len)
+{
+    size_t done;
+
+    d->dir = -1;
+    done = fronius_frames_scan(buf, len, decode_frame, d, &d->skipped);
+
+    /* a truncated frame at the end of the stream */
+    d->skipped += len - done;
+
+    return 0;
+}
+
+/*
+ * Replay
+ */
+
+static int load_record(int dir, uint64_t ts, const uint8_t *frame,
+                       size_t len, void *arg)
+{
+    struct replay *r = arg;
+    struct record *rec;
+
+    if (len > FRONIUS_MAX_PKTLEN)
+        return 0;
+
+    if (r->nrecs % 1024 == 0) {
+        rec = realloc(r->recs, (r->nrecs + 1024) * sizeof(*rec));
+        if (!rec)
+            return -1;
+        r->recs = rec;
+    }
+
+    rec = &r->recs[r->nrecs++];
+    rec->ts = ts;
+    rec->dir = dir;
+    rec->len = len;
+    memcpy(rec->frame, frame, len);
+
+    return 0;
+}
+
+/* pair each request with the frames received before the next request;
+   requests without any answer (lost or retransmitted) are dropped */
+static int build_transactions(struct replay *r)
+{
+    size_t i;
+
+    r->trans = calloc(r->nrecs + 1, sizeof(*r->trans));
+    if (!r->trans)
+        return -1;
+
+    for (i = 0; i < r->nrecs; ++i) {
+        struct record *rec = &r->recs[i];
+
+        if (rec->dir == FRONIUS_TRACE_TX) {
+            if (r->ntrans && !r->trans[r->ntrans - 1].nrx)
+                r->ntrans--;
+            r->trans[r->ntrans].tx = rec;
+            r->trans[r->ntrans].rx = rec + 1;
+            r->ntrans++;
+        } else if (r->ntrans) {
+            r->trans[r->ntrans - 1].nrx++;
+        }
+    }
+
+    if (r->ntrans && !r->trans[r->ntrans - 1].nrx)
+        r->ntrans--;
+
+    return 0;
+}
+
+/* the bus side: answer each request with the recorded frames */
+static void replay_peer(struct replay *r, int fd)
+{
+    struct fronius_parser parser;
+    struct fronius_pkt pkt;
+    struct transaction *t;
+    uint64_t start;
+    size_t i, j;
+
+    fronius_parser_init(&parser);
+
+    for (i = 0; i < r->ntrans; ++i) {
+        t = &r->trans[i];
+
+        while (!fronius_parser_next(&parser, &pkt))
+            if (fronius_parser_fill(&parser, fd) <= 0)
+                return;
+        start = now_ns();
+
+        for (j = 0; j < t->nrx; ++j) {
+            if (!r->unlimited)
+                sleep_until(start + (t->rx[j].ts - t->tx->ts));
+            if (write(fd, t->rx[j].frame, t->rx[j].len) != (ssize_t) t->rx[j].len)
+                return;
+        }
+    }
+}
+
+static void replay_done(struct fronius_dev *dev,
+                        const struct fronius_result *res, void *arg)
+{
+    struct replay *r = arg;
+    const struct record *rx = &r->cur->rx[r->cur->nrx - 1];
+    const struct record *tx = r->cur->tx;
+    int match;
+
+    (void) dev;
+
+    /* the last frame received is the one the request was answered with */
+    if (rx->frame[FRONIUS_OF_COMMAND] == 0x0e &&
+        rx->frame[FRONIUS_OF_LENGTH] == 2)
+        match = res->error == rx->frame[FRONIUS_OF_DATA + 1];
+    else
+        match = res->error == FRONIUS_ERR_NOERROR &&
+                res->command == rx->frame[FRONIUS_OF_COMMAND] &&
+                res->length == rx->frame[FRONIUS_OF_LENGTH] &&
+                !memcmp(res->data, &rx->frame[FRONIUS_OF_DATA], res->length);
+    if (!match)
+        r->mismatches++;
+
+    printf("%llu.%09llu,%u,%u,0x%02x,%s,%s\n",
+           (unsigned long long) (tx->ts / 1000000000ULL),
+           (unsigned long long) (tx->ts % 1000000000ULL),
+           tx->frame[FRONIUS_OF_DEVICE], tx->frame[FRONIUS_OF_NUMBER],
+           tx->frame[FRONIUS_OF_COMMAND],
+           res->error == FRONIUS_ERR_NOERROR ? "ok" : "error",
+           match ? "match" : "mismatch");
+}
+
+static int replay(struct replay *r)
+{
+    struct fronius_dev *dev;
+    struct fronius_pkt pkt;
+    struct transaction *t;
+    uint64_t start, t0;
+    int sv[2], status;
+    size_t i, len;
+    pid_t pid;
+
+    if (build_transactions(r) < 0)
+        return -1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        return -1;
+
+    pid = fork();
+    if (pid == -1)
+        return -1;
+    if (pid == 0) {
+        close(sv[0]);
+        replay_peer(r, sv[1]);
+        _exit(EXIT_SUCCESS);
+    }
+    close(sv[1]);
+
+    dev = fronius_open_fd(sv[0], FRONIUS_IFC_TYPE_INTERFACECARD);
+    if (!dev) {
+        kill(pid, SIGTERM);
+        return -1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < r->ntrans; ++i) {
+        t = r->cur = &r->trans[i];
+
+        /* keep the original spacing of the requests */
+        if (!r->unlimited)
+            sleep_until(start + (t->tx->ts - r->trans[0].tx->ts));
+
+        /* send the request exactly as it was captured */
+        len = t->tx->len;
+        memcpy(&pkt, t->tx->frame, len);
+
+        if (fronius_xfer_start_frame(dev, &pkt, replay_done, r) < 0 ||
+            fronius_xfer_wait(dev) < 0) {
+            perror("replay");
+            break;
+        }
+    }
+    t0 = now_ns() - start;
+
+    fronius_close(dev);
+    waitpid(pid, &status, 0);
+
+    fprintf(stderr, "%zu transactions, %lu mismatches, %.3f s\n",
+            i, r->mismatches, t0 / 1e9);
+
+    return i == r->ntrans && !r->mismatches ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct decoder d;
+    struct replay r;
+    struct stat st;
+    const char *format = NULL;
+    uint8_t *buf;
+    uint64_t t0;
+    int c, fd, rv = 0, do_replay = 0;
+
+    memset(&d, 0, sizeof(d));
+    memset(&r, 0, sizeof(r));
+    d.out = stdout;
+
+    while ((c = getopt(argc, argv, "f:cru")) != -1) {
+        switch (c) {
+        case 'f':
+            format = optarg;
+            break;
+        case 'c':
+            d.count_only = 1;
+            break;
+        case 'r':
+            do_replay = 1;
+            break;
+        case 'u':
+            r.unlimited = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind + 1 != argc)
+        usage(argv[0]);
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    buf = NULL;
+    if (st.st_size) {
+        buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        madvise(buf, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    if (!format)
+        format = st.st_size >= 4 && !memcmp(buf, capture_magic, 4) ?
+                 "capture" : "raw";
+
+    if (do_replay) {
+        if (strcmp(format, "capture")) {
+            fprintf(stderr, "replay needs a capture file\n");
+            exit(EXIT_FAILURE);
+        }
+        if (fronius_capture_read(argv[optind], load_record, &r) < 0) {
+            perror(argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+        return replay(&r) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* large output buffer, the formatting is the slow part */
+    setvbuf(d.out, NULL, _IOFBF, 1 << 20);
+
+    t0 = now_ns();
+    if (!strcmp(format, "capture"))
+        rv = fronius_capture_read(argv[optind], decode_record, &d);
+    else if (!strcmp(format, "raw"))
+        rv = decode_raw(&d, buf, st.st_size);
+    else
+        usage(argv[0]);
+    t0 = now_ns() - t0;
+    fflush(d.out);
+
+    if (rv < 0) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "%lu frames, %lu error frames, %lu bytes skipped, "
+            "%.1f MB/s\n", d.frames, d.errors, d.skipped,
+            t0 ? st.st_size * 1e3 / t0 : 0.0);
+
+    if (buf)
+        munmap(buf, st.st_size);
+    close(fd);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+/* config.h first: posix_openpt() and friends need the system extensions */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "sim.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -p         serve on a pseudo-terminal (default)\n"
+            "  -t port    serve on TCP port of 127.0.0.1\n"
+            "  -i count   number of inverters (default: 1)\n"
+            "  -s count   number of sensor cards (default: 0)\n"
+            "  -b baud    emulate byte timing of 2400/4800/9600/19200 baud,\n"
+            "             0 answers as fast as possible (default: 19200)\n"
+            "  -l usec    processing delay of the Interface Card (default: 2000)\n"
+            "  -f baud    only answer while the pseudo-terminal is set to this\n"
+            "             baudrate, like a card without baudrate detection\n"
+            "  -e         simulate an Interface Card (default: Interface Card easy)\n"
+            "  -v         dump all frames to stderr\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static int open_pty(int *slave)
+{
+    struct termios tio;
+    const char *name;
+    int fd;
+
+    fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd == -1 || grantpt(fd) == -1 || unlockpt(fd) == -1)
+        return -1;
+
+    if (tcgetattr(fd, &tio) == -1)
+        return -1;
+    cfmakeraw(&tio);
+    if (tcsetattr(fd, TCSANOW, &tio) == -1)
+        return -1;
+
+    name = ptsname(fd);
+    if (!name)
+        return -1;
+
+    /* keep the slave open, so that the master does not see a hangup
+       while no client is attached */
+    *slave = open(name, O_RDWR | O_NOCTTY);
+    if (*slave == -1)
+        return -1;
+
+    printf("%s\n", name);
+    fflush(stdout);
+
+    return fd;
+}
+
+static int open_listener(int port)
+{
+    struct sockaddr_in addr;
+    int fd, on = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(fd, 1) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    printf("raw://127.0.0.1:%d\n", port);
+    fflush(stdout);
+
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sim sim;
+    int port = 0, baud = 19200, line = 0;
+    int fd, slave = -1, c;
+
+    sim_init(&sim);
+
+    while ((c = getopt(argc, argv, "pt:i:s:b:l:f:ev")) != -1) {
+        switch (c) {
+        case 'p':
+            port = 0;
+            break;
+        case 't':
+            port = atoi(optarg);
+            break;
+        case 'i':
+            sim.inverters = atoi(optarg);
+            break;
+        case 's':
+            sim.sensors = atoi(optarg);
+            break;
+        case 'b':
+            baud = atoi(optarg);
+            break;
+        case 'l':
+            sim.latency_us = atol(optarg);
+            break;
+        case 'f':
+            line = atoi(optarg);
+            break;
+        case 'e':
+            sim.ifc_type = FRONIUS_IFC_TYPE_INTERFACECARD;
+            break;
+        case 'v':
+            sim.verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (sim.inverters < 0 || sim.inverters > SIM_MAX_INVERTERS ||
+        sim.sensors < 0 || sim.sensors > SIM_MAX_SENSORS ||
+        (baud && baud != 2400 && baud != 4800 && baud != 9600 &&
+         baud != 19200))
+        usage(argv[0]);
+    sim.bps = baud;
+
+    switch (line) {
+    case 0:
+        break;
+    case 2400:
+        sim.line_baudrate = FRONIUS_BAUDRATE_B2400;
+        break;
+    case 4800:
+        sim.line_baudrate = FRONIUS_BAUDRATE_B4800;
+        break;
+    case 9600:
+        sim.line_baudrate = FRONIUS_BAUDRATE_B9600;
+        break;
+    case 19200:
+        sim.line_baudrate = FRONIUS_BAUDRATE_B19200;
+        break;
+    default:
+        usage(argv[0]);
+    }
+
+    if (!port) {
+        if ((fd = open_pty(&slave)) == -1) {
+            perror("pty");
+            exit(EXIT_FAILURE);
+        }
+
+        if (sim_serve(&sim, fd) < 0) {
+            perror("serve");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        int lfd = open_listener(port);
+        if (lfd == -1) {
+            perror("listen");
+            exit(EXIT_FAILURE);
+        }
+
+        /* serve one client after the other */
+        while ((fd = accept(lfd, NULL, NULL)) != -1) {
+            if (sim_serve(&sim, fd) < 0)
+                perror("serve");
+            close(fd);
+        }
+        perror("accept");
+    }
+
+    return EXIT_SUCCESS;
+}
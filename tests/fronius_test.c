@@ -19,6 +19,7 @@ int main(int argc, char *argv[])
     char *device = "/dev/ttyS0";
     struct fronius_dev *dev;
     struct fronius_pkt pkt;
+    struct fronius_stats stats;
     char buf[255];
     char *devname, *devtype;
     int i;
@@ -76,7 +77,9 @@ int main(int argc, char *argv[])
     printf("Operation hours today: %f min\n", f);
 
 #if 1
-    printf("Checksum errors: %d\n", dev->checksum_errors);
+    fronius_stats(dev, &stats);
+    printf("Checksum errors: %llu\n",
+           (unsigned long long) stats.checksum_errors);
 #endif
     if (fronius_close(dev) < 0) {
         perror("close");
@@ -0,0 +1,417 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include <config.h>
+
+#include "sim.h"
+
+/* error response command of the protocol */
+#define SIM_CMD_ERROR		0x0e
+
+/* bits on the wire per byte (8N1) */
+#define SIM_BITS_PER_BYTE	10
+
+struct sim_value {
+	uint8_t	cmd;
+	/* value = base + swing * sin(t / period) + rate * t */
+	double	base;
+	double	swing;
+	double	period;
+	double	rate;
+};
+
+static const struct sim_value inverter_values[] = {
+    { FRONIUS_CMD_POWER_NOW,               1800.0, 900.0, 300.0,   0.0 },
+    { FRONIUS_CMD_ENERGY_TOTAL,        25300000.0,   0.0,   1.0,   0.5 },
+    { FRONIUS_CMD_ENERGY_DAY,              9120.0,   0.0,   1.0,   0.5 },
+    { FRONIUS_CMD_ENERGY_YEAR,          4230000.0,   0.0,   1.0,   0.5 },
+    { FRONIUS_CMD_AC_CURRENT_NOW,             7.8,   3.9, 300.0,   0.0 },
+    { FRONIUS_CMD_AC_VOLTAGE_NOW,           230.4,   2.5,  45.0,   0.0 },
+    { FRONIUS_CMD_AC_FREQUENCY_NOW,          50.0,  0.03,  20.0,   0.0 },
+    { FRONIUS_CMD_DC_CURRENT_NOW,             5.4,   2.7, 300.0,   0.0 },
+    { FRONIUS_CMD_DC_VOLTAGE_NOW,           351.0,  12.0, 120.0,   0.0 },
+    { FRONIUS_CMD_YIELD_DAY,                 2.74,   0.0,   1.0, 1e-4 },
+    { FRONIUS_CMD_MAX_POWER_DAY,           3120.0,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_MAX_AC_VOLTAGE_DAY,       236.1,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_MIN_AC_VOLTAGE_DAY,       224.7,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_MAX_DC_VOLTAGE_DAY,       418.0,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_OPERATING_HOURS_DAY,      412.0,   0.0,   1.0, 1.0 / 60 },
+    { FRONIUS_CMD_YIELD_YEAR,              1269.0,   0.0,   1.0, 1e-4 },
+    { FRONIUS_CMD_MAX_POWER_YEAR,          4380.0,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_MAX_AC_VOLTAGE_YEAR,      249.3,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_MIN_AC_VOLTAGE_YEAR,      209.8,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_MAX_DC_VOLTAGE_YEAR,      498.0,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_OPERATING_HOURS_YEAR,  123480.0,   0.0,   1.0, 1.0 / 60 },
+    { FRONIUS_CMD_YIELD_TOTAL,             7590.0,   0.0,   1.0, 1e-4 },
+    { FRONIUS_CMD_MAX_POWER_TOTAL,         4510.0,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_MAX_AC_VOLTAGE_TOTAL,     253.0,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_MIN_AC_VOLTAGE_TOTAL,     198.5,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_MAX_DC_VOLTAGE_TOTAL,     512.0,   0.0,   1.0,   0.0 },
+    { FRONIUS_CMD_OPERATING_HOURS_TOTAL, 1038120.0,  0.0,   1.0, 1.0 / 60 },
+    { FRONIUS_CMD_CURRENT_PHASE1,             2.6,   1.3, 300.0,   0.0 },
+    { FRONIUS_CMD_CURRENT_PHASE2,             2.6,   1.3, 300.0,   0.0 },
+    { FRONIUS_CMD_CURRENT_PHASE3,             2.6,   1.3, 300.0,   0.0 },
+    { FRONIUS_CMD_VOLTAGE_PHASE1,           230.1,   2.5,  45.0,   0.0 },
+    { FRONIUS_CMD_VOLTAGE_PHASE2,           229.7,   2.5,  47.0,   0.0 },
+    { FRONIUS_CMD_VOLTAGE_PHASE3,           231.0,   2.5,  43.0,   0.0 },
+    { FRONIUS_CMD_AMBIENT_TEMPERATUR,        34.0,   4.0, 900.0,   0.0 },
+    { FRONIUS_CMD_FAN_SPEED_FRONT_LEFT,    1850.0,  40.0,  60.0,   0.0 },
+    { FRONIUS_CMD_FAN_SPEED_FRONT_RIGHT,   1840.0,  40.0,  60.0,   0.0 },
+    { FRONIUS_CMD_FAN_SPEED_REAR_LEFT,     1790.0,  40.0,  60.0,   0.0 },
+    { FRONIUS_CMD_FAN_SPEED_REAR_RIGHT,    1810.0,  40.0,  60.0,   0.0 },
+};
+
+static const struct sim_value sensor_values[] = {
+    { FRONIUS_CMD_TEMPERATURE_CHANNEL1_NOW,       24.3,   6.0, 900.0, 0.0 },
+    { FRONIUS_CMD_TEMPERATURE_CHANNEL2_NOW,       41.7,   9.0, 900.0, 0.0 },
+    { FRONIUS_CMD_INSOLATION_NOW,                650.0, 300.0, 300.0, 0.0 },
+    { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL1_DAY,   12.1,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL1_DAY,   29.8,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL1_YEAR,   2.4,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL1_YEAR,  35.6,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL1_TOTAL,  1.2,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL1_TOTAL, 38.9,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL2_DAY,   14.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL2_DAY,   52.3,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL2_YEAR,   3.1,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL2_YEAR,  61.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MIN_TEMPERATURE_CHANNEL2_TOTAL,  1.9,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_TEMPERATURE_CHANNEL2_TOTAL, 64.2,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_INSOLATION_DAY,            985.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_INSOLATION_YEAR,          1120.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_INSOLATION_TOTAL,         1184.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_DIGITAL_CHANNEL1_NOW,            0.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_DIGITAL_CHANNEL2_NOW,            0.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_DIGITAL_CHANNEL1_DAY,        0.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_DIGITAL_CHANNEL1_YEAR,       0.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_DIGITAL_CHANNEL1_TOTAL,      0.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_DIGITAL_CHANNEL2_DAY,        0.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_DIGITAL_CHANNEL2_YEAR,       0.0,   0.0,   1.0, 0.0 },
+    { FRONIUS_CMD_MAX_DIGITAL_CHANNEL2_TOTAL,      0.0,   0.0,   1.0, 0.0 },
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+void sim_init(struct sim *sim)
+{
+    memset(sim, 0, sizeof(*sim));
+
+    sim->ifc_type = FRONIUS_IFC_TYPE_INTERFACECARDEASY;
+    sim->version[0] = 2;
+    sim->version[1] = 6;
+    sim->version[2] = 1;
+    sim->inverters = 1;
+    sim->inverter_type = 0xd5;  /* Fronius IG Plus 70-1 */
+    sim->latency_us = 2000;
+
+    clock_gettime(CLOCK_MONOTONIC, &sim->started);
+}
+
+int sim_bps(fronius_baudrate_t baudrate)
+{
+    switch (baudrate) {
+    case FRONIUS_BAUDRATE_B2400:
+        return 2400;
+    case FRONIUS_BAUDRATE_B4800:
+        return 4800;
+    case FRONIUS_BAUDRATE_B9600:
+        return 9600;
+    case FRONIUS_BAUDRATE_B19200:
+        return 19200;
+    default:
+        return 0;
+    }
+}
+
+static double sim_uptime(const struct sim *sim)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - sim->started.tv_sec) +
+           (now.tv_nsec - sim->started.tv_nsec) / 1e9;
+}
+
+/* encode as 16 bit mantissa and decimal exponent with best resolution */
+static void sim_encode(double v, uint8_t *data)
+{
+    int e = -3;
+    double m = v * 1000.0;
+
+    if (m < 0)
+        m = 0;
+
+    while (m + 0.5 >= 65536.0 && e < 10) {
+        m /= 10.0;
+        e++;
+    }
+
+    data[0] = ((unsigned int) (m + 0.5)) >> 8;
+    data[1] = ((unsigned int) (m + 0.5)) & 0xff;
+    data[2] = (uint8_t) (int8_t) e;
+}
+
+static int sim_value(const struct sim *sim, const struct sim_value *table,
+                     size_t n, int number, uint8_t cmd, uint8_t *data)
+{
+    double t = sim_uptime(sim);
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        const struct sim_value *v = &table[i];
+
+        if (v->cmd != cmd)
+            continue;
+
+        /* every device deviates a bit and runs its own phase */
+        sim_encode(v->base * (1.0 + 0.01 * (number - 1)) +
+                   v->swing * sin(t / v->period + number) +
+                   v->rate * t, data);
+        return 0;
+    }
+
+    return -1;
+}
+
+static void sim_error(const struct fronius_pkt *req, struct fronius_pkt *rsp,
+                      fronius_error_t err)
+{
+    rsp->command = SIM_CMD_ERROR;
+    rsp->length = 2;
+    rsp->data[0] = req->command;
+    rsp->data[1] = err;
+}
+
+static void sim_list(struct fronius_pkt *rsp, int n)
+{
+    int i;
+
+    for (i = 0; i < n; ++i)
+        rsp->data[i] = i + 1;
+    rsp->length = n;
+}
+
+int sim_answer(struct sim *sim, const struct fronius_pkt *req,
+               struct fronius_pkt *rsp)
+{
+    time_t now;
+    struct tm tm;
+    int active;
+
+    sim->requests++;
+
+    fronius_pkt_init(rsp);
+    rsp->device = req->device;
+    rsp->number = req->number;
+    rsp->command = req->command;
+
+    switch (req->device) {
+    case FRONIUS_DEVICE_INTERFACECARD:
+        switch (req->command) {
+        case FRONIUS_CMD_IFCARD_GETVERSION:
+            rsp->data[0] = sim->ifc_type;
+            memcpy(&rsp->data[1], sim->version, sizeof(sim->version));
+            rsp->length = 4;
+            return 0;
+        case FRONIUS_CMD_IFCARD_GETTIME:
+            now = time(NULL);
+            localtime_r(&now, &tm);
+            rsp->data[0] = tm.tm_mday;
+            rsp->data[1] = tm.tm_mon + 1;
+            rsp->data[2] = tm.tm_year % 100;
+            rsp->data[3] = tm.tm_hour;
+            rsp->data[4] = tm.tm_min;
+            rsp->data[5] = tm.tm_sec;
+            rsp->length = 6;
+            return 0;
+        case FRONIUS_CMD_IFCARD_GETACTIVEINVERTERS:
+            sim_list(rsp, sim->inverters);
+            return 0;
+        case FRONIUS_CMD_IFCARD_GETACTIVESENSORS:
+            sim_list(rsp, sim->sensors);
+            return 0;
+        case FRONIUS_CMD_IFCARD_GETLOCALNETSTATUS:
+            rsp->data[0] = 0;
+            rsp->length = 1;
+            return 0;
+        }
+        break;
+
+    case FRONIUS_DEVICE_INVERTER:
+    case FRONIUS_DEVICE_SENSORCARD:
+        active = req->device == FRONIUS_DEVICE_INVERTER ?
+                 sim->inverters : sim->sensors;
+        if (req->number < 1 || req->number > active) {
+            sim->errors++;
+            sim_error(req, rsp, FRONIUS_ERR_NO_DEV);
+            return 0;
+        }
+
+        if (req->command == FRONIUS_CMD_IFCARD_GETDEVICETYPE) {
+            rsp->data[0] = req->device == FRONIUS_DEVICE_INVERTER ?
+                           sim->inverter_type : 0xfe;
+            rsp->length = 1;
+            return 0;
+        }
+
+        if (req->device == FRONIUS_DEVICE_INVERTER &&
+            !sim_value(sim, inverter_values, ARRAY_SIZE(inverter_values),
+                       req->number, req->command, rsp->data)) {
+            rsp->length = 3;
+            return 0;
+        }
+
+        if (req->device == FRONIUS_DEVICE_SENSORCARD &&
+            !sim_value(sim, sensor_values, ARRAY_SIZE(sensor_values),
+                       req->number, req->command, rsp->data)) {
+            rsp->length = 3;
+            return 0;
+        }
+        break;
+
+    default:
+        sim->errors++;
+        sim_error(req, rsp, FRONIUS_ERR_NO_DEV);
+        return 0;
+    }
+
+    sim->errors++;
+    sim_error(req, rsp, FRONIUS_ERR_UNKNOWN_CMD);
+    return 0;
+}
+
+size_t sim_respond(const uint8_t *req, size_t len, uint8_t *rsp, size_t size,
+                   void *arg)
+{
+    struct fronius_pkt pkt, answer;
+
+    if (len < FRONIUS_MIN_PKTLEN || size < FRONIUS_MAX_PKTLEN)
+        return 0;
+
+    memcpy(&pkt, req, len);
+    if (sim_answer(arg, &pkt, &answer) < 0)
+        return 0;
+    fronius_pkt_checksum(&answer);
+
+    memcpy(rsp, answer.start, FRONIUS_PKT_LEN(&answer));
+    return FRONIUS_PKT_LEN(&answer);
+}
+
+static void sim_timespec_add(struct timespec *ts, long ns)
+{
+    ts->tv_nsec += ns;
+    while (ts->tv_nsec >= 1000000000L) {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec++;
+    }
+}
+
+static int sim_write(int fd, const uint8_t *buf, size_t len)
+{
+    while (len) {
+        ssize_t rv = write(fd, buf, len);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += rv;
+        len -= rv;
+    }
+
+    return 0;
+}
+
+/* transmit a frame, pacing the bytes like a serial line would */
+static int sim_send(struct sim *sim, int fd, const struct fronius_pkt *req,
+                    struct fronius_pkt *rsp)
+{
+    const uint8_t *buf = rsp->start;
+    size_t len = FRONIUS_PKT_LEN(rsp), i;
+    struct timespec ts;
+    long byte_ns;
+
+    fronius_pkt_checksum(rsp);
+
+    if (sim->verbose)
+        fronius_pkt_dump(stderr, "sim", rsp, 1);
+
+    if (!sim->bps) {
+        if (sim->latency_us) {
+            ts.tv_sec = sim->latency_us / 1000000;
+            ts.tv_nsec = (sim->latency_us % 1000000) * 1000;
+            nanosleep(&ts, NULL);
+        }
+        return sim_write(fd, buf, len);
+    }
+
+    /* the request arrived at once, but on a serial line its last byte
+       would be on the wire only now; then the card needs some time before
+       it starts to answer */
+    byte_ns = 1000000000L / sim->bps * SIM_BITS_PER_BYTE;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    sim_timespec_add(&ts, (FRONIUS_MIN_PKTLEN + req->length) * byte_ns +
+                          sim->latency_us * 1000);
+
+    for (i = 0; i < len; ++i) {
+        sim_timespec_add(&ts, byte_ns);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        if (sim_write(fd, &buf[i], 1) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* a pty master sees the line settings made on the slave side */
+static int sim_line_ok(const struct sim *sim, int fd)
+{
+    struct termios tio;
+
+    if (sim->line_baudrate == FRONIUS_BAUDRATE_AUTO ||
+        tcgetattr(fd, &tio) == -1)
+        return 1;
+
+    return cfgetispeed(&tio) == sim->line_baudrate;
+}
+
+int sim_serve(struct sim *sim, int fd)
+{
+    struct fronius_parser parser;
+    struct fronius_pkt req, rsp;
+    ssize_t c;
+
+    fronius_parser_init(&parser);
+
+    for (;;) {
+        while (fronius_parser_next(&parser, &req)) {
+            if (sim->verbose)
+                fronius_pkt_dump(stderr, "req", &req, 1);
+            if (!sim_line_ok(sim, fd))
+                continue;
+            if (sim_answer(sim, &req, &rsp) == 0 &&
+                sim_send(sim, fd, &req, &rsp) < 0)
+                return -1;
+        }
+
+        c = fronius_parser_fill(&parser, fd);
+        if (c < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (c == 0)
+            return 0;
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright © 2009-2018 Michael Heimpold <mhei@heimpold.de>
+ *
+ * SPDX-License-Identifier: GPL-3.0+
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "fronius-private.h"
+
+/* maximum number of simulated inverters and sensor cards */
+#define SIM_MAX_INVERTERS	100
+#define SIM_MAX_SENSORS		10
+
+struct sim {
+	/* simulated Interface Card */
+	fronius_ifc_type_t	ifc_type;
+	uint8_t			version[3];
+	/* number of active inverters (1..n) and sensor cards (1..m) */
+	int			inverters;
+	int			sensors;
+	/* device type id reported for inverters */
+	uint8_t			inverter_type;
+	/* line speed in bits per second for byte timing, 0 = unlimited */
+	int			bps;
+	/* baudrate the card understands, FRONIUS_BAUDRATE_AUTO for any;
+	   requests at another line speed are ignored */
+	fronius_baudrate_t	line_baudrate;
+	/* processing delay of the Interface Card in microseconds */
+	long			latency_us;
+	int			verbose;
+
+	struct timespec		started;
+	unsigned long		requests, errors;
+};
+
+/*
+ * Initialize a simulator with default values.
+ */
+void sim_init(struct sim *);
+
+/*
+ * Returns the bits per second of a termios baudrate, 0 for unknown.
+ */
+int sim_bps(fronius_baudrate_t);
+
+/*
+ * Build the response to a request, returns -1 if there is none.
+ */
+int sim_answer(struct sim *, const struct fronius_pkt *, struct fronius_pkt *);
+
+/*
+ * Responder of an in-memory device, see fronius_open_mem(); the argument
+ * is the simulator.
+ */
+size_t sim_respond(const uint8_t *, size_t, uint8_t *, size_t, void *);
+
+/*
+ * Answer requests on a file descriptor until end of file.
+ */
+int sim_serve(struct sim *, int);
+
+#endif /* SIM_H */